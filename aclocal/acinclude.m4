@@ -37,6 +37,29 @@ AC_DEFUN([ACX_ENABLE_DEBUG],
   AC_LANG_C
 ])
 
+dnl Compiles out debug log messages
+AC_DEFUN([ACX_ENABLE_DEBUG_LOGGING],
+[
+  AC_ARG_ENABLE(debug-logging,[  --disable-debug-logging compiles out debug log messages @<:@default=no@:>@],
+  [
+   if test $enableval = "no"
+     then
+       enable_debug_logging="no"
+     else
+       enable_debug_logging="yes"
+   fi
+  ],
+  [
+    enable_debug_logging="yes"
+  ])
+
+  if test "$enable_debug_logging" = "no"
+    then
+      AC_DEFINE([DISABLE_DEBUG_LOGGING], 1,
+        [Define to 1 to compile out debug log messages.])
+  fi
+])
+
 dnl Set local state directory
 AC_DEFUN([AC_LOCAL_STATE_DIR],
 [
@@ -98,6 +121,25 @@ AC_DEFUN([AC_CHECK_POSIX_SEMAPHORES],
   )
 ])
 
+dnl Checks for GCC atomic builtins
+AC_DEFUN([AC_CHECK_ATOMIC_BUILTINS],
+[
+  AC_MSG_CHECKING(for atomic builtins)
+  AC_TRY_LINK([], [
+  static void *p;
+  unsigned long n = 0;
+  void *e = 0;
+  (void) __atomic_compare_exchange_n(&p, &e, &n, 0, __ATOMIC_RELEASE,
+    __ATOMIC_RELAXED);
+  (void) __atomic_exchange_n(&p, 0, __ATOMIC_ACQUIRE);
+  (void) __atomic_add_fetch(&n, 1, __ATOMIC_RELAXED);
+  return __atomic_load_n(&n, __ATOMIC_ACQUIRE) != 1;
+  ],
+    AC_MSG_RESULT(yes),
+    AC_MSG_ERROR([no usable atomic builtins found])
+  )
+])
+
 dnl Checks for d_namlen in struct dirent
 AC_DEFUN([AC_STRUCT_DIRENT_D_NAMLEN],
 [
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+
+/*
+** Adaptive limit of amavisd connections
+**
+** The limit is adjusted after every window of completed amavisd
+** transactions, which has at least as many transactions as the limit.
+** When amavisd failed or the average scan time of the window exceeded the
+** latency target, the limit is decreased by ADAPTBACKOFF, otherwise it is
+** increased by one if all connections were used.  Without an explicit
+** target, the target is ADAPTTOLERANCE times the lowest average scan time.
+** The lowest scan time slowly follows the recent scan time only at the
+** lowest limit, when the target cannot be met otherwise (e.g. the messages
+** became bigger).
+*/
+static pthread_mutex_t adapt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int      adapt_on;               /* limit is adaptive */
+static int      adapt_min;              /* lowest limit */
+static int      adapt_max;              /* highest limit */
+static long     adapt_target;           /* latency target in usec */
+static long     adapt_base;             /* lowest average scan time */
+static long     adapt_latency;          /* average scan time of last window */
+static int      adapt_samples;          /* transactions in the window */
+static int      adapt_errors;           /* failed transactions */
+static long     adapt_sum;              /* scan time of the window */
+static int      adapt_saturated;        /* all connections were used */
+
+
+/*
+** ADAPT_PARSE - Parse adaptive limit
+**
+** The limit is specified as min:max[:latency], where latency is the scan
+** time target in milliseconds.  adapt_parse() returns -1 when the
+** specification is not valid.
+*/
+int
+adapt_parse(const char *spec)
+{
+    long        min, max, target = 0;
+    char       *end;
+
+    min = strtol(spec, &end, 10);
+    if (end == spec || *end != ':') {
+        return -1;
+    }
+    spec = end + 1;
+    max = strtol(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != ':')) {
+        return -1;
+    }
+    if (*end == ':') {
+        spec = end + 1;
+        target = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0' || target <= 0 ||
+            target > LONG_MAX / 1000)
+        {
+            return -1;
+        }
+    }
+    if (min <= 0 || max < min || max > INT_MAX) {
+        return -1;
+    }
+    adapt_min = (int) min;
+    adapt_max = (int) max;
+    adapt_target = target * 1000;
+    return 0;
+}
+
+
+/*
+** ADAPT_INIT - Start adaptive limit
+**
+** The limit starts at max_conns, which is moved between the bounds.
+** adapt_init() returns -1 when the limit is not set or when the lowest
+** limit is below the reserved connections.
+*/
+int
+adapt_init(int limit)
+{
+    const char *name;
+    int         i, reserved, used, queued, total = 0;
+
+    if (adapt_max == 0) {
+        return 0;
+    }
+    if (!admit_enabled()) {
+        logmsg(LOG_ERR, "adaptive limit requires max-conns");
+        return -1;
+    }
+    if (worker_enabled()) {
+        logmsg(LOG_ERR, "adaptive limit cannot be used with workers");
+        return -1;
+    }
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        admit_class_status(i, &reserved, &used, &queued);
+        total += reserved;
+    }
+    if (adapt_min < total) {
+        logmsg(LOG_ERR, "admission classes reserve %d connections, "
+            "more than adaptive limit %d", total, adapt_min);
+        return -1;
+    }
+    if (limit < adapt_min || limit > adapt_max) {
+        (void) admit_resize(MIN(MAX(limit, adapt_min), adapt_max));
+    }
+    __atomic_store_n(&adapt_on, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+** ADAPT_ENABLED - Check if the limit of amavisd connections is adaptive
+*/
+int
+adapt_enabled(void)
+{
+    return __atomic_load_n(&adapt_on, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+** ADAPT_SAMPLE - Add completed amavisd transaction
+**
+** The transaction must still hold its connection.  The argument ok is
+** zero when amavisd failed, then the scan time is not used.
+*/
+void
+adapt_sample(long usec, int ok)
+{
+    long        target, avg = 0;
+    int         limit, used, queued, next;
+
+    admit_status(&limit, &used, &queued);
+    (void) pthread_mutex_lock(&adapt_lock);
+    if (used >= limit || queued > 0) {
+        adapt_saturated = 1;
+    }
+    adapt_samples++;
+    if (ok) {
+        adapt_sum += usec;
+    } else {
+        adapt_errors++;
+    }
+    if (adapt_samples < MAX(limit, ADAPTWINDOW)) {
+        (void) pthread_mutex_unlock(&adapt_lock);
+        return;
+    }
+
+    /* End of window */
+    if (adapt_samples > adapt_errors) {
+        avg = adapt_sum / (adapt_samples - adapt_errors);
+        if (adapt_base == 0 || avg < adapt_base) {
+            adapt_base = avg;
+        } else if (limit <= adapt_min) {
+            adapt_base += (avg - adapt_base) / ADAPTDECAY;
+        }
+        adapt_latency = avg;
+    }
+    target = adapt_target != 0 ? adapt_target : adapt_base * ADAPTTOLERANCE;
+    next = limit;
+    if (adapt_errors > 0 || avg > target) {
+        next = MAX(MIN((int)(limit * ADAPTBACKOFF), limit - 1), adapt_min);
+    } else if (adapt_saturated) {
+        next = MIN(limit + 1, adapt_max);
+    }
+    adapt_samples = 0;
+    adapt_errors = 0;
+    adapt_sum = 0;
+    adapt_saturated = 0;
+    (void) pthread_mutex_unlock(&adapt_lock);
+
+    if (next != limit && admit_resize(next) == 0) {
+        logmsg(LOG_INFO, "adaptive limit %d -> %d, latency %ld ms, "
+            "target %ld ms", limit, next, avg / 1000, target / 1000);
+    }
+}
+
+
+/*
+** ADAPT_STATUS - Get bounds, latency target and last average scan time
+*/
+void
+adapt_status(int *min, int *max, long *target, long *latency)
+{
+    (void) pthread_mutex_lock(&adapt_lock);
+    *min = adapt_min;
+    *max = adapt_max;
+    *target = adapt_target != 0 ? adapt_target : adapt_base * ADAPTTOLERANCE;
+    *latency = adapt_latency;
+    (void) pthread_mutex_unlock(&adapt_lock);
+}
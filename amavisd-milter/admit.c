@@ -0,0 +1,825 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+
+/* Admission class rule types */
+#define ADMIT_CLIENT    1       /* client address or network */
+#define ADMIT_DAEMON    2       /* daemon name */
+#define ADMIT_AUTH      3       /* authentication mechanism */
+
+/* Admission class rule */
+struct admitRule {
+    struct      admitRule *r_next;      /* next rule */
+    int         r_type;                 /* rule type */
+    struct      mlfiNet r_net;          /* client network */
+    char        r_value[1];             /* daemon name or mechanism */
+};
+
+/* Admission queue entry */
+struct admitWaiter {
+    int         w_next;                 /* next waiter or -1 */
+    int         w_worker;               /* worker of the waiter or -1 */
+    pthread_cond_t w_cond;              /* signalled when admitted */
+    double      w_key;                  /* admission order */
+    int         w_admitted;             /* slot was handed over */
+};
+
+/* Admission class */
+struct admitClass {
+    const char *c_name;                 /* class name */
+    struct      admitRule *c_rules;     /* selection rules */
+    int         c_reserved;             /* reserved slots */
+};
+
+/*
+** Admission state
+**
+** The state is shared by all worker processes, so the waiters are kept in
+** a table and linked by their index.  The slots are counted also per
+** worker, so that the slots of a worker which has died can be given back.
+*/
+struct admitState {
+    pthread_mutex_t a_lock;             /* state lock */
+    int         a_limit;                /* max slots in use */
+    int         a_used;                 /* slots in use */
+    int         a_shared;               /* shared slots in use */
+    int         a_queued;               /* waiters in the queues */
+    int         a_free;                 /* first free waiter */
+    int         a_class_used[ADMITCLASSES];/* slots in use by class */
+    int         a_class_queued[ADMITCLASSES];/* waiters by class */
+    int         a_head[ADMITCLASSES];   /* first waiter of class */
+    int         a_worker_used[WORKERS][ADMITCLASSES];/* slots by worker */
+    struct      admitWaiter a_waiters[ADMITWAITERS];/* waiters */
+};
+
+/*
+** Admission of amavisd connections
+**
+** Every class can use its reserved slots and the shared slots, which are
+** not reserved by any class.  The waiters are ordered by their key,
+** which is the arrival time, or with the size order the arrival time
+** delayed by the message size divided by the aging rate.  Small messages
+** thus overtake big ones, but a big message is not passed by messages
+** which came more than size / rate seconds after it.  A released slot is
+** handed over to the first waiter which can use it, so that a thread
+** which has just come cannot take it first.  Class 0 is the default class
+** without reserved slots.
+*/
+static struct   admitState *admit;      /* admission state */
+static int      admit_on;               /* admission is limited */
+static int      admit_reserved;         /* reserved slots */
+static int      admit_by_size;          /* size order */
+static double   admit_aging = ADMITAGING; /* aging rate in bytes/s */
+static int      admit_nclasses = 1;     /* number of classes */
+static struct   admitClass admit_classes[ADMITCLASSES] =
+{
+    { "default", NULL, 0 }
+};
+
+
+/*
+** ADMIT_REPAIR - Recount slots and waiters
+**
+** admit_repair() is called when a worker died while it held the lock.
+*/
+static void
+admit_repair(void)
+{
+    int         c, i, n, w;
+
+    admit->a_used = admit->a_shared = admit->a_queued = 0;
+    for (c = 0; c < admit_nclasses; c++) {
+        for (n = 0, w = 0; w < WORKERS; w++) {
+            n += admit->a_worker_used[w][c];
+        }
+        admit->a_class_used[c] = n;
+        admit->a_used += n;
+        admit->a_shared += MAX(n - admit_classes[c].c_reserved, 0);
+        for (n = 0, i = admit->a_head[c]; i != -1 && n < ADMITWAITERS;
+            i = admit->a_waiters[i].w_next)
+        {
+            n++;
+        }
+        admit->a_class_queued[c] = n;
+        admit->a_queued += n;
+    }
+}
+
+
+/*
+** ADMIT_LOCK - Lock admission state
+*/
+static void
+admit_lock(void)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    if (pthread_mutex_lock(&admit->a_lock) == EOWNERDEAD) {
+        admit_repair();
+        (void) pthread_mutex_consistent(&admit->a_lock);
+    }
+#else
+    (void) pthread_mutex_lock(&admit->a_lock);
+#endif
+}
+
+
+/*
+** ADMIT_UNLOCK - Unlock admission state
+*/
+static void
+admit_unlock(void)
+{
+    (void) pthread_mutex_unlock(&admit->a_lock);
+}
+
+
+/*
+** ADMIT_WAIT - Wait for waiter condition until ts
+**
+** admit_wait() must be called with admission state locked
+*/
+static void
+admit_wait(struct admitWaiter *w, const struct timespec *ts)
+{
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    if (pthread_cond_timedwait(&w->w_cond, &admit->a_lock, ts) ==
+        EOWNERDEAD)
+    {
+        admit_repair();
+        (void) pthread_mutex_consistent(&admit->a_lock);
+    }
+#else
+    (void) pthread_cond_timedwait(&w->w_cond, &admit->a_lock, ts);
+#endif
+}
+
+
+/*
+** ADMIT_CAN_USE - Check if class can use another slot
+**
+** admit_can_use() must be called with admission state locked
+*/
+static int
+admit_can_use(int c)
+{
+    return admit->a_used < admit->a_limit &&
+        (admit->a_class_used[c] < admit_classes[c].c_reserved ||
+        admit->a_shared < admit->a_limit - admit_reserved);
+}
+
+
+/*
+** ADMIT_TAKE - Take slot for class and worker
+**
+** admit_take() must be called with admission state locked
+*/
+static void
+admit_take(int c, int worker)
+{
+    if (admit->a_class_used[c] >= admit_classes[c].c_reserved) {
+        admit->a_shared++;
+    }
+    admit->a_class_used[c]++;
+    admit->a_worker_used[worker][c]++;
+    admit->a_used++;
+}
+
+
+/*
+** ADMIT_GRANT - Hand over free slots to the longest waiting messages
+**
+** admit_grant() must be called with admission state locked
+*/
+static void
+admit_grant(void)
+{
+    struct      admitWaiter *w;
+    int         c, best;
+
+    for (;;) {
+        best = -1;
+        for (c = 0; c < admit_nclasses; c++) {
+            if (admit->a_head[c] != -1 && admit_can_use(c) && (best == -1 ||
+                admit->a_waiters[admit->a_head[c]].w_key <
+                admit->a_waiters[admit->a_head[best]].w_key))
+            {
+                best = c;
+            }
+        }
+        if (best == -1) {
+            return;
+        }
+        w = &admit->a_waiters[admit->a_head[best]];
+        admit->a_head[best] = w->w_next;
+        admit->a_class_queued[best]--;
+        admit->a_queued--;
+        admit_take(best, w->w_worker);
+        w->w_admitted = 1;
+        (void) pthread_cond_signal(&w->w_cond);
+    }
+}
+
+
+/*
+** ADMIT_REMOVE - Remove waiter from the queue
+**
+** admit_remove() must be called with admission state locked
+*/
+static void
+admit_remove(int c, int i)
+{
+    int        *p;
+
+    for (p = &admit->a_head[c]; *p != -1; p = &admit->a_waiters[*p].w_next) {
+        if (*p == i) {
+            *p = admit->a_waiters[i].w_next;
+            admit->a_class_queued[c]--;
+            admit->a_queued--;
+            return;
+        }
+    }
+}
+
+
+/*
+** ADMIT_INSERT - Insert waiter to the queue after waiters with lower or
+**                equal key
+**
+** admit_insert() must be called with admission state locked
+*/
+static void
+admit_insert(int c, int i)
+{
+    struct      admitWaiter *w = &admit->a_waiters[i];
+    int        *p;
+
+    for (p = &admit->a_head[c];
+        *p != -1 && admit->a_waiters[*p].w_key <= w->w_key;
+        p = &admit->a_waiters[*p].w_next)
+    {
+        continue;
+    }
+    w->w_next = *p;
+    *p = i;
+    admit->a_class_queued[c]++;
+    admit->a_queued++;
+}
+
+
+/*
+** ADMIT_GET_WAITER - Get free waiter
+**
+** admit_get_waiter() must be called with admission state locked.  It
+** returns -1 when all waiters are used.
+*/
+static int
+admit_get_waiter(void)
+{
+    int         i;
+
+    if ((i = admit->a_free) != -1) {
+        admit->a_free = admit->a_waiters[i].w_next;
+        admit->a_waiters[i].w_worker = worker_id();
+        admit->a_waiters[i].w_admitted = 0;
+    }
+    return i;
+}
+
+
+/*
+** ADMIT_PUT_WAITER - Return waiter
+**
+** admit_put_waiter() must be called with admission state locked
+*/
+static void
+admit_put_waiter(int i)
+{
+    admit->a_waiters[i].w_worker = -1;
+    admit->a_waiters[i].w_next = admit->a_free;
+    admit->a_free = i;
+}
+
+
+/*
+** ADMIT_PUT - Return slot of class and worker
+**
+** admit_put() must be called with admission state locked
+*/
+static void
+admit_put(int c, int worker)
+{
+    if (admit->a_class_used[c] > admit_classes[c].c_reserved) {
+        admit->a_shared--;
+    }
+    admit->a_class_used[c]--;
+    admit->a_worker_used[worker][c]--;
+    admit->a_used--;
+    admit_grant();
+}
+
+
+/*
+** ADMIT_ORDER - Set admission order
+**
+** The order is fifo or size[:rate], where rate is the aging rate in bytes
+** per second.  admit_order() returns -1 when the order is not valid.
+*/
+int
+admit_order(const char *spec)
+{
+    const char *rate;
+    char       *end;
+    double      aging = ADMITAGING;
+
+    if (strcasecmp(spec, "fifo") == 0) {
+        admit_by_size = 0;
+        return 0;
+    }
+    if (strncasecmp(spec, "size", 4) != 0 ||
+        (spec[4] != '\0' && spec[4] != ':'))
+    {
+        return -1;
+    }
+    if (spec[4] == ':') {
+        rate = spec + 5;
+        aging = strtod(rate, &end);
+        if (end == rate || *end != '\0' || !(aging > 0)) {
+            return -1;
+        }
+    }
+    admit_by_size = 1;
+    admit_aging = aging;
+    return 0;
+}
+
+
+/*
+** ADMIT_CLASS_ADD - Add admission class
+**
+** The class is specified as name:slots:rule[,rule...], where slots is the
+** number of reserved slots and rule is client=address[/prefix],
+** daemon=name, auth or auth=mechanism.  admit_class_add() returns -1 when
+** the specification is not valid.
+*/
+int
+admit_class_add(const char *spec)
+{
+    struct      admitClass *c;
+    struct      admitRule *r;
+    char       *name, *slots, *rules, *rule, *value, *end, *last;
+    size_t      len;
+
+    if (admit_nclasses >= ADMITCLASSES || *spec == ':' ||
+        (name = strdup(spec)) == NULL)
+    {
+        return -1;
+    }
+    c = &admit_classes[admit_nclasses];
+    c->c_name = name;
+    name = strtok_r(name, ":", &last);
+    slots = strtok_r(NULL, ":", &last);
+    rules = strtok_r(NULL, "", &last);
+    if (name == NULL || slots == NULL || rules == NULL) {
+        return -1;
+    }
+    c->c_reserved = (int) strtol(slots, &end, 10);
+    if (*end != '\0' || c->c_reserved < 0) {
+        return -1;
+    }
+    for (rule = strtok_r(rules, ",", &last); rule != NULL;
+        rule = strtok_r(NULL, ",", &last))
+    {
+        if ((value = strchr(rule, '=')) != NULL) {
+            *value++ = '\0';
+        } else {
+            value = "";
+        }
+        len = strlen(value);
+        if ((r = calloc(1, sizeof(*r) + len)) == NULL) {
+            return -1;
+        }
+        (void) memcpy(r->r_value, value, len + 1);
+        r->r_next = c->c_rules;
+        c->c_rules = r;
+        if (strcasecmp(rule, "client") == 0) {
+            r->r_type = ADMIT_CLIENT;
+            if (net_parse(&r->r_net, value) == -1) {
+                return -1;
+            }
+        } else if (strcasecmp(rule, "daemon") == 0 && *value != '\0') {
+            r->r_type = ADMIT_DAEMON;
+        } else if (strcasecmp(rule, "auth") == 0) {
+            r->r_type = ADMIT_AUTH;
+        } else {
+            return -1;
+        }
+    }
+    admit_nclasses++;
+    return 0;
+}
+
+
+/*
+** ADMIT_CLASS_CLIENT - Get admission class of the client
+**
+** admit_class_client() returns the first class with a matching client
+** rule, or the default class
+*/
+int
+admit_class_client(const _SOCK_ADDR *hostaddr)
+{
+    const struct admitRule *r;
+    int         i;
+
+    for (i = 1; i < admit_nclasses; i++) {
+        for (r = admit_classes[i].c_rules; r != NULL; r = r->r_next) {
+            if (r->r_type == ADMIT_CLIENT && net_match(&r->r_net, hostaddr)) {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+** ADMIT_CLASS - Get admission class of the message
+**
+** admit_class() returns the first class with a matching rule, where the
+** client rules were matched at the connection start by
+** admit_class_client()
+*/
+int
+admit_class(int client_class, const char *daemon_name, const char *auth_type)
+{
+    const struct admitRule *r;
+    int         i;
+
+    for (i = 1; i < admit_nclasses; i++) {
+        if (i == client_class) {
+            return i;
+        }
+        for (r = admit_classes[i].c_rules; r != NULL; r = r->r_next) {
+            if ((r->r_type == ADMIT_DAEMON && daemon_name != NULL &&
+                strcmp(daemon_name, r->r_value) == 0) ||
+                (r->r_type == ADMIT_AUTH && auth_type != NULL &&
+                (r->r_value[0] == '\0' ||
+                strcasecmp(auth_type, r->r_value) == 0)))
+            {
+                return i;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+** ADMIT_ALLOC - Allocate admission state
+**
+** With worker processes, the state is allocated in the shared memory and
+** its lock and conditions are shared by the processes.
+*/
+static int
+admit_alloc(void)
+{
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    int         c, i, pshared;
+
+    pshared = worker_enabled() ? PTHREAD_PROCESS_SHARED :
+        PTHREAD_PROCESS_PRIVATE;
+    if (pshared == PTHREAD_PROCESS_SHARED) {
+        admit = worker_alloc(sizeof(*admit));
+    } else if ((admit = calloc(1, sizeof(*admit))) == NULL) {
+        logmsg(LOG_ERR, "could not allocate admission state");
+    }
+    if (admit == NULL) {
+        return -1;
+    }
+    (void) pthread_mutexattr_init(&mattr);
+    (void) pthread_mutexattr_setpshared(&mattr, pshared);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+    (void) pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    (void) pthread_mutex_init(&admit->a_lock, &mattr);
+    (void) pthread_mutexattr_destroy(&mattr);
+    (void) pthread_condattr_init(&cattr);
+    (void) pthread_condattr_setpshared(&cattr, pshared);
+    for (i = 0; i < ADMITWAITERS; i++) {
+        (void) pthread_cond_init(&admit->a_waiters[i].w_cond, &cattr);
+        admit->a_waiters[i].w_worker = -1;
+        admit->a_waiters[i].w_next = i + 1 < ADMITWAITERS ? i + 1 : -1;
+    }
+    (void) pthread_condattr_destroy(&cattr);
+    admit->a_free = 0;
+    for (c = 0; c < ADMITCLASSES; c++) {
+        admit->a_head[c] = -1;
+    }
+    return 0;
+}
+
+
+/*
+** ADMIT_INIT - Limit number of amavisd connections
+**
+** Without limit, the admission classes cannot be used.  admit_init()
+** returns -1 when the classes reserve more slots than the limit.
+*/
+int
+admit_init(int limit)
+{
+    int         i, reserved = 0;
+
+    for (i = 0; i < admit_nclasses; i++) {
+        reserved += admit_classes[i].c_reserved;
+    }
+    if (limit == 0) {
+        if (admit_nclasses > 1) {
+            logmsg(LOG_ERR, "admission classes require max-conns");
+            return -1;
+        }
+        return 0;
+    }
+    if (reserved > limit) {
+        logmsg(LOG_ERR, "admission classes reserve %d of %d connections",
+            reserved, limit);
+        return -1;
+    }
+    if (admit_alloc() == -1) {
+        return -1;
+    }
+    admit->a_limit = limit;
+    admit_reserved = reserved;
+    __atomic_store_n(&admit_on, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+** ADMIT_FREE - Free admission class rules
+*/
+void
+admit_free(void)
+{
+    struct      admitRule *r, *next;
+    int         i;
+
+    for (i = 1; i < admit_nclasses; i++) {
+        for (r = admit_classes[i].c_rules; r != NULL; r = next) {
+            next = r->r_next;
+            free(r);
+        }
+        free((void *)admit_classes[i].c_name);
+    }
+    admit_nclasses = 1;
+
+    /* The shared state is used by the other workers */
+    if (admit != NULL && !worker_enabled()) {
+        __atomic_store_n(&admit_on, 0, __ATOMIC_RELEASE);
+        for (i = 0; i < ADMITWAITERS; i++) {
+            (void) pthread_cond_destroy(&admit->a_waiters[i].w_cond);
+        }
+        (void) pthread_mutex_destroy(&admit->a_lock);
+        free(admit);
+        admit = NULL;
+    }
+}
+
+
+/*
+** ADMIT_ENABLED - Check if the number of amavisd connections is limited
+*/
+int
+admit_enabled(void)
+{
+    return __atomic_load_n(&admit_on, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+** ADMIT_ACQUIRE - Wait for amavisd connection slot
+**
+** The size of the message is used by the size order.  The function
+** progress is called every SMFI_PROGRESS_TRIGGER seconds of the wait, the
+** waiter keeps its place in the queue.  It returns -1 with errno
+** ETIMEDOUT when no slot was free until timeout, ECANCELED when progress
+** failed, or EAGAIN when there are too many waiters.  A timeout which has
+** already passed only takes a free slot and does not join the queue.
+*/
+int
+admit_acquire(int class, long size, time_t timeout,
+    int (*progress)(void *), void *arg)
+{
+    struct      admitWaiter *w;
+    struct      timespec ts, arrival;
+    time_t      now, next;
+    int         i, rc = 0;
+
+    admit_lock();
+    if (admit->a_head[class] == -1 && admit_can_use(class)) {
+        admit_take(class, worker_id());
+        admit_unlock();
+        return 0;
+    }
+    if (timeout <= time(NULL)) {
+        admit_unlock();
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    /* Join the queue */
+    if ((i = admit_get_waiter()) == -1) {
+        admit_unlock();
+        errno = EAGAIN;
+        return -1;
+    }
+    w = &admit->a_waiters[i];
+    clock_now(&arrival);
+    w->w_key = arrival.tv_sec + arrival.tv_nsec / 1e9;
+    if (admit_by_size) {
+        w->w_key += size / admit_aging;
+    }
+    admit_insert(class, i);
+
+    next = time(NULL) + SMFI_PROGRESS_TRIGGER;
+    while (!w->w_admitted) {
+        ts.tv_sec = MIN(next, timeout);
+        ts.tv_nsec = 0;
+        admit_wait(w, &ts);
+        if (w->w_admitted) {
+            break;
+        }
+        now = time(NULL);
+        if (now >= timeout) {
+            admit_remove(class, i);
+            rc = ETIMEDOUT;
+            break;
+        }
+        if (now >= next && progress != NULL) {
+            admit_unlock();
+            rc = progress(arg);
+            admit_lock();
+            if (rc == -1) {
+                if (w->w_admitted) {
+                    admit_put(class, worker_id());
+                } else {
+                    admit_remove(class, i);
+                }
+                rc = ECANCELED;
+                break;
+            }
+            rc = 0;
+            next = now + SMFI_PROGRESS_TRIGGER;
+        }
+    }
+    admit_put_waiter(i);
+    admit_unlock();
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** ADMIT_RELEASE - Return amavisd connection slot
+*/
+void
+admit_release(int class)
+{
+    admit_lock();
+    admit_put(class, worker_id());
+    admit_unlock();
+}
+
+
+/*
+** ADMIT_RECLAIM - Give back slots and waiters of a worker which has died
+*/
+void
+admit_reclaim(int worker)
+{
+    int         c, i;
+
+    if (!admit_enabled()) {
+        return;
+    }
+    admit_lock();
+    for (c = 0; c < admit_nclasses; c++) {
+        for (i = 0; i < ADMITWAITERS; i++) {
+            if (admit->a_waiters[i].w_worker == worker) {
+                admit_remove(c, i);
+            }
+        }
+    }
+    for (i = 0; i < ADMITWAITERS; i++) {
+        if (admit->a_waiters[i].w_worker == worker) {
+            admit_put_waiter(i);
+        }
+    }
+    for (c = 0; c < admit_nclasses; c++) {
+        while (admit->a_worker_used[worker][c] > 0) {
+            admit_put(c, worker);
+        }
+    }
+    admit_unlock();
+}
+
+
+/*
+** ADMIT_RESIZE - Change maximum number of amavisd connections
+**
+** When the limit is lowered below the slots in use, no waiter is admitted
+** until enough slots are returned.  The limit can be changed only when it
+** was set at startup, and it is not lowered below the reserved slots.
+*/
+int
+admit_resize(int limit)
+{
+    if (!admit_enabled() || limit <= 0 || limit < admit_reserved) {
+        errno = EINVAL;
+        return -1;
+    }
+    admit_lock();
+    admit->a_limit = limit;
+    admit_grant();
+    admit_unlock();
+    return 0;
+}
+
+
+/*
+** ADMIT_STATUS - Get slot limit, slots in use and waiters in the queue
+*/
+void
+admit_status(int *limit, int *used, int *queued)
+{
+    if (!admit_enabled()) {
+        *limit = *used = *queued = 0;
+        return;
+    }
+    admit_lock();
+    *limit = admit->a_limit;
+    *used = admit->a_used;
+    *queued = admit->a_queued;
+    admit_unlock();
+}
+
+
+/*
+** ADMIT_CLASS_NAME - Get name of the admission class or NULL
+*/
+const char *
+admit_class_name(int class)
+{
+    return class >= 0 && class < admit_nclasses ?
+        admit_classes[class].c_name : NULL;
+}
+
+
+/*
+** ADMIT_CLASS_STATUS - Get reserved and used slots and waiters of class
+*/
+void
+admit_class_status(int class, int *reserved, int *used, int *queued)
+{
+    *reserved = admit_classes[class].c_reserved;
+    if (!admit_enabled()) {
+        *used = *queued = 0;
+        return;
+    }
+    admit_lock();
+    *used = admit->a_class_used[class];
+    *queued = admit->a_class_queued[class];
+    admit_unlock();
+}
@@ -31,6 +31,9 @@
 
 #include "compat.h"
 
+#include <pthread.h>
+#include <stdint.h>
+
 /* AM.PDP protocol version */
 #define AMPDP_VERSION   2
 
@@ -38,19 +41,160 @@
 #define MAXLOGBUF       1024    /* syslog message buffer */
 #define MAXAMABUF       65536   /* amavisd communication buffer */
 #define AMABUFCHUNK     2048    /* amavisd buffer reallocation step */
+#define AMABUFBATCH     16384   /* amavisd request batch size */
+#define CONNARENACHUNK  512     /* connection memory allocation step */
+#define MSGARENACHUNK   2048    /* message memory allocation step */
+#define MAXQIDLEN       32      /* saved queue id */
+#define MAXDATELEN      64      /* formatted date */
+#define LOGQUEUE        512     /* asynchronous log queue records */
+#define RCPTCHUNK       16      /* recipient array reallocation step */
+#define MAXFREECTX      64      /* recycled connection contexts */
+#define LOGLIMITS       128     /* rate limited log message templates */
+#define STATSHARDS      16      /* statistics shards */
+
+/* Log targets */
+#define LOGTARGET_SYSLOG        1       /* syslog */
+#define LOGTARGET_STDOUT        2       /* standard output */
+#define LOGTARGET_FILE          4       /* log file */
+
+/* Asynchronous log queue overflow policy */
+#define LOGASYNC_OFF    0       /* synchronous logging */
+#define LOGASYNC_DROP   1       /* drop messages when queue is full */
+#define LOGASYNC_BLOCK  2       /* wait for free space in queue */
+
+/* Message summary format */
+#define SUMMARY_OFF     0       /* no summary */
+#define SUMMARY_KV      1       /* key=value pairs */
+#define SUMMARY_JSON    2       /* JSON object */
 
 /* Timeouts */
 #define SMFI_PROGRESS_TRIGGER   60      /* smfi_progress trigger */
+#define DATETZCHECK     60      /* timezone change check interval */
+#define SERVER_TIMEOUT  5       /* local service client timeout */
+
+/* Health status */
+#define HEALTHPROBE     30      /* seconds without amavisd connect to probe */
+#define HEALTHWAIT      1000000 /* recent wait in usec degrading health */
+
+/* Admission classes */
+#define ADMITCLASSES    8       /* max classes including the default */
+#define ADMITAGING      1048576 /* default aging rate in bytes/s */
+#define ADMITWAITERS    4096    /* max messages waiting for connection */
+
+/* Worker processes */
+#define WORKERS         64      /* max worker processes */
+#define WORKERRESTART   1       /* min seconds between worker restarts */
+
+/* Adaptive connection limit */
+#define ADAPTWINDOW     10      /* min transactions in the window */
+#define ADAPTBACKOFF    0.9     /* limit decrease factor */
+#define ADAPTTOLERANCE  2       /* latency target over lowest latency */
+#define ADAPTDECAY      64      /* lowest latency decay at lowest limit */
+
+/* Circuit breaker */
+#define BREAKERWINDOW   64      /* transactions of the failure rate */
+#define BREAKERCOOLDOWN 30      /* default open period in seconds */
+#define BREAKER_CLOSED  0       /* amavisd is used */
+#define BREAKER_OPEN    1       /* transactions fail at once */
+#define BREAKER_HALFOPEN 2      /* single probe transaction */
+#define BREAKER_PASS    1       /* transaction may use amavisd */
+#define BREAKER_PROBE   2       /* transaction is the probe */
+
+/* Early rejection */
+#define EARLYQUANTILE   90      /* recent wait quantile in percent */
+
+/* Fairness */
+#define FAIRRULES       4       /* max fairness rules */
+#define FAIRSTRIPES     16      /* fairness table stripes */
+#define FAIRENTRIES     4096    /* fairness table entries */
+#define FAIRKEYLEN      256     /* max fairness key length */
+#define FAIR_FROM       0       /* reply to MAIL FROM */
+#define FAIR_RCPT       1       /* reply to RCPT TO */
+
+/* Verdict cache */
+#define CACHEENTRIES    1024    /* default verdict cache entries */
+#define CACHESTRIPES    16      /* verdict cache stripes */
+#define CACHEVERDICT    2048    /* max replayed response length */
+
+/* Control */
+#define CONTROLDRAIN    30      /* default drain period in seconds */
+
+/* Error log rate limiting */
+#define LOGBURST        10      /* messages logged before suppression */
+#define LOGREFILL       10      /* seconds to allow another message */
+
+/* Transaction phases */
+#define PHASE_IDLE      0       /* no message */
+#define PHASE_SPOOL     1       /* receiving message */
+#define PHASE_WAIT      2       /* waiting for amavisd connection */
+#define PHASE_CONNECT   3       /* connecting to amavisd */
+#define PHASE_REQUEST   4       /* writing amavisd request */
+#define PHASE_RESPONSE  5       /* reading amavisd response */
+#define PHASE_DONE      6       /* amavisd response was read */
+#define PHASES          7
+
+/* Latency histograms */
+#define STATS_WAIT      0       /* amavisd connection wait */
+#define STATS_SPOOL     1       /* MAIL FROM to the end of message */
+#define STATS_SCAN      2       /* amavisd request and response */
+#define STATS_EOM       3       /* end of message processing */
+#define STATS_HIT       4       /* end of message replayed from cache */
+#define STATS_HISTOGRAMS 5
 
 struct mlfiCtx;
+struct fairEntry;
+
+/* Local service listener */
+struct mlfiServer {
+    const char *s_name;                 /* service name */
+    const char *s_socket;               /* listening socket name */
+    void      (*s_handler)(int);        /* client handler */
+    void      (*s_idle)(void);          /* called every second or NULL */
+    int         s_fd;                   /* listening socket descriptor */
+    int         s_running;              /* listener thread is running */
+    int         s_stopping;             /* listener thread should stop */
+    pthread_t   s_thread;               /* listener thread */
+};
+
+/* Network address or prefix */
+struct mlfiNet {
+    int         n_family;               /* address family */
+    int         n_prefix;               /* prefix length */
+    unsigned char n_addr[16];           /* network address */
+};
 
-/* Address list */
-struct mlfiAddress {
-    struct      mlfiAddress *q_next;    /* next recipient */
-    char        q_paddr[1];             /* recipient */
+/* Incremental SipHash state */
+struct cacheHash {
+    uint64_t    h_v[4];                 /* internal state */
+    uint64_t    h_tail;                 /* bytes of the incomplete word */
+    uint64_t    h_len;                  /* hashed bytes */
 };
 
-/* Milter private data structure */
+/* Memory arena chunk */
+struct mlfiChunk {
+    struct      mlfiChunk *c_next;      /* next chunk */
+    size_t      c_size;                 /* chunk data size */
+};
+
+/* Memory arena */
+struct mlfiArena {
+    struct      mlfiChunk *a_head;      /* first chunk */
+    struct      mlfiChunk *a_chunk;     /* current chunk */
+    char       *a_ptr;                  /* free space in current chunk */
+    char       *a_end;                  /* end of current chunk */
+    size_t      a_chunk_size;           /* chunk allocation step */
+#ifndef NDEBUG
+    unsigned long a_nalloc;             /* allocator calls */
+#endif
+};
+
+/*
+ * Milter private data structure
+ *
+ * Keep it small, the context exists for every SMTP connection.  Strings
+ * are allocated from the connection and message memory arenas, and the
+ * working directory and mail file names are relative to working_dir.
+ */
 struct mlfiCtx {
     char       *mlfi_daemon_name;       /* sendmail daemon name */
     char       *mlfi_hostname;          /* sendmail hostname */
@@ -59,19 +203,50 @@ struct mlfiCtx {
     char       *mlfi_client_name;       /* remote host name */
     char       *mlfi_helo;              /* remote host helo */
     char       *mlfi_protocol;          /* communication protocol */
+    char       *mlfi_received;          /* Received header prefix */
     char       *mlfi_qid;               /* queue id */
-    char       *mlfi_prev_qid;          /* previous queue id */
     char       *mlfi_from;              /* mail sender */
-    struct      mlfiAddress *mlfi_rcpt; /* mail recipients */
-    char        mlfi_wrkdir[MAXPATHLEN];/* working directory */
-    char        mlfi_fname[MAXPATHLEN]; /* mail file name */
+    char      **mlfi_rcpt;              /* mail recipients */
+    unsigned int *mlfi_rcpt_hash;       /* recipient hash set */
+    unsigned int mlfi_rcpt_count;       /* number of recipients */
+    unsigned int mlfi_rcpt_size;        /* recipient array size */
+    char       *mlfi_policy_bank;       /* policy bank names */
+    char       *mlfi_log_id;            /* amavisd log id */
+    char       *mlfi_wrkdir;            /* working directory */
+    char       *mlfi_fname;             /* mail file name */
     FILE       *mlfi_fp;                /* mail file handler */
-    int         mlfi_max_sem_locked;    /* connections semaphore locked */
     char       *mlfi_amabuf;            /* amavisd communication buffer */
     size_t      mlfi_amabuf_length;     /* amavisd buffer length */
+    size_t      mlfi_amabuf_pos;        /* pending amavisd request length */
     int         mlfi_amasd;             /* amavisd socket descriptor */
-    char       *mlfi_policy_bank;       /* policy bank names */
+    int         mlfi_max_sem_locked;    /* amavisd connection admitted */
+    int         mlfi_class_conn;        /* connection admission class */
+    int         mlfi_class;             /* message admission class */
+    int         mlfi_breaker;           /* passed circuit breaker */
+    int         mlfi_cached;            /* verdict replayed from cache */
+    struct      cacheHash mlfi_hash;    /* message hash */
+    struct      mlfiNet mlfi_client_net;/* client address */
+    struct      fairEntry *mlfi_fair[FAIRRULES];/* counted by fairness rules */
+    int         mlfi_throttled;         /* message exceeds fairness rule */
     int         mlfi_cr_flag;           /* CR at the end of the body chunk */
+    int         mlfi_received_auth;     /* prefix with authentication */
+    int         mlfi_trace_conn;        /* connection debug trace level */
+    int         mlfi_trace;             /* message debug trace level */
+    int         mlfi_phase;             /* transaction phase */
+    struct      timespec mlfi_phase_start;/* phase start */
+    long        mlfi_size;              /* message file size */
+    long        mlfi_wait_usec;         /* amavisd connection wait */
+    long        mlfi_connect_usec;      /* amavisd connect */
+    long        mlfi_scan_usec;         /* amavisd request and response */
+    struct      timespec mlfi_start;    /* message start */
+    char        mlfi_prev_qid[MAXQIDLEN];/* previous queue id */
+    struct      mlfiCtx *mlfi_reg_next; /* next registered context */
+    struct      mlfiCtx **mlfi_reg_pprev;/* registry link to the context */
+    struct      mlfiArena mlfi_conn_arena;/* connection lifetime memory */
+    struct      mlfiArena mlfi_msg_arena;/* message lifetime memory */
+#ifndef NDEBUG
+    unsigned long mlfi_nalloc;          /* allocator calls */
+#endif
 };
 
 /* Get private data from libmilter */
@@ -91,6 +266,9 @@ extern sfsistat mlfi_body(SMFICTX *, unsigned char *, size_t);
 extern sfsistat mlfi_eom(SMFICTX *);
 extern sfsistat mlfi_close(SMFICTX *);
 extern sfsistat mlfi_abort(SMFICTX *);
+extern void     mlfi_free_contexts(void);
+extern void     mlfi_transactions(void (*)(const struct mlfiCtx *, void *),
+                    void *);
 
 /* Global variables */
 extern int      policybank_from_daemon_name; /* Select Policybank from Miltermacro daemon_name */
@@ -99,7 +277,6 @@ extern int      daemonized;             /* is daemon */
 extern int      debug_level;            /* max debug level */
 extern int      max_conns;              /* max amavisd connections */
 extern int      max_wait;               /* max wait for connection */
-extern sem_t   *max_sem;                /* amavisd connections semaphore */
 extern const char *pid_file;            /* pid file name */
 extern char    *mlfi_socket;            /* sendmail milter socket */
 #ifdef HAVE_SMFI_SETBACKLOG
@@ -109,26 +286,206 @@ extern long     mlfi_timeout;           /* connection timeout */
 extern const char *amavisd_socket;      /* amavisd socket */
 extern long     amavisd_timeout;        /* connection timeout */
 extern int      ignore_amavisd_error;   /* pass through when amavisd failed */
+extern int      amavisd_ahead;          /* connect to amavisd before EOM */
+extern int      progress_interval;      /* keep MTA informed during scan */
 extern const char *working_dir;         /* working ditectory name */
 extern const char *delivery_care_of;    /* delivery mechanism */
+extern int      log_target;             /* log targets (0 = default) */
+extern const char *log_file;            /* log file name */
+extern int      log_async;              /* asynchronous log overflow policy */
+extern int      summary_format;         /* message summary format */
+extern const char *trace_file;          /* debug trace rules file */
+extern const char *stats_socket;        /* statistics socket */
+extern const char *health_socket;       /* health status socket */
+extern const char *control_socket;      /* control socket */
 
 /* Amavisd communication */
 extern int      amavisd_connect(struct mlfiCtx *, struct sockaddr_un *,
-                    time_t timeout);
+                    time_t timeout, int (*)(void *), void *);
 extern int      amavisd_request(struct mlfiCtx *, const char *, const char *);
+extern int      amavisd_flush(struct mlfiCtx *);
+extern int      amavisd_wait(struct mlfiCtx *, int, int (*)(void *), void *);
 extern int      amavisd_response(struct mlfiCtx *);
+extern void     amavisd_disconnect(struct mlfiCtx *);
 extern void     amavisd_close(struct mlfiCtx *);
 
-/* errno value if amavisd_connect() timed out. */
-#ifdef HAVE_SEM_TIMEDWAIT
-# define AMAVISD_CONNECT_TIMEDOUT_ERRNO ETIMEDOUT
-#else
-# define AMAVISD_CONNECT_TIMEDOUT_ERRNO EAGAIN
-#endif
+/* Admission of amavisd connections */
+extern int      admit_class_add(const char *);
+extern int      admit_class_client(const _SOCK_ADDR *);
+extern int      admit_class(int, const char *, const char *);
+extern int      admit_init(int);
+extern void     admit_free(void);
+extern int      admit_enabled(void);
+extern int      admit_order(const char *);
+extern int      admit_acquire(int, long, time_t, int (*)(void *), void *);
+extern void     admit_release(int);
+extern void     admit_reclaim(int);
+extern int      admit_resize(int);
+extern void     admit_status(int *, int *, int *);
+extern const char *admit_class_name(int);
+extern void     admit_class_status(int, int *, int *, int *);
+
+/* Adaptive connection limit */
+extern int      adapt_parse(const char *);
+extern int      adapt_init(int);
+extern int      adapt_enabled(void);
+extern void     adapt_sample(long, int);
+extern void     adapt_status(int *, int *, long *, long *);
+
+/* Early rejection */
+extern int      early_parse(const char *);
+extern int      early_init(void);
+extern int      early_enabled(void);
+extern int      early_reject(struct mlfiCtx *);
+extern const char *early_reply_code(void);
+extern void     early_status(int *, long *, unsigned long *);
+
+/* Fairness */
+extern int      fair_add(const char *);
+extern int      fair_reply(const char *);
+extern int      fair_init(void);
+extern void     fair_free(void);
+extern int      fair_enabled(void);
+extern int      fair_acquire(struct mlfiCtx *);
+extern void     fair_release(struct mlfiCtx *);
+extern int      fair_stage(void);
+extern void     fair_reply_text(const char **, const char **, const char **);
+extern const char *fair_rule_name(int);
+extern void     fair_rule_status(int, unsigned long *, unsigned long *);
+extern int      fair_entries(void);
+
+/* Verdict cache */
+extern int      cache_parse(const char *);
+extern int      cache_init(void);
+extern void     cache_free(void);
+extern int      cache_enabled(void);
+extern void     cache_start(struct mlfiCtx *);
+extern void     cache_header(struct mlfiCtx *, const char *, const char *);
+extern void     cache_body(struct mlfiCtx *, const unsigned char *, size_t);
+extern uint64_t cache_key(struct mlfiCtx *);
+extern int      cache_lookup(uint64_t, char *, size_t, sfsistat *);
+extern int      cache_record(char *, size_t, int, const char *, const char *);
+extern void     cache_store(uint64_t, sfsistat, const char *, int);
+extern void     cache_status(int *, unsigned long *, unsigned long *,
+                    unsigned long *);
+
+/* Circuit breaker */
+extern int      breaker_parse(const char *);
+extern int      breaker_enabled(void);
+extern int      breaker_allow(void);
+extern void     breaker_done(int, int);
+extern void     breaker_cancel(int);
+extern void     breaker_status(int *, unsigned long *, unsigned long *);
+
+/* Memory arena */
+extern void     arena_init(struct mlfiArena *, size_t);
+extern void    *arena_alloc(struct mlfiArena *, size_t);
+extern char    *arena_strdup(struct mlfiArena *, const char *);
+extern void     arena_reset(struct mlfiArena *);
+extern void     arena_trim(struct mlfiArena *);
+extern void     arena_free(struct mlfiArena *);
+
+/* Date and time */
+extern const char *date_rfc2822(char *, int *);
+extern void     clock_now(struct timespec *);
+extern long     clock_usec(const struct timespec *, const struct timespec *);
 
 /* Log message */
-extern void     logmsg(int, const char *, ...);
-extern void     logqidmsg(struct mlfiCtx *, int, const char *, ...);
+extern int      log_open(void);
+extern int      log_start(void);
+extern void     log_stop(void);
+extern unsigned long log_dropped_count(void);
+extern unsigned long log_suppressed_count(void);
+extern void     logmsg_print(int, const char *, ...);
+extern void     logqidmsg_print(struct mlfiCtx *, int, const char *, ...);
+
+/* Network addresses */
+extern int      net_parse(struct mlfiNet *, char *);
+extern int      net_match(const struct mlfiNet *, const _SOCK_ADDR *);
+extern int      net_addr(struct mlfiNet *, const _SOCK_ADDR *);
+extern void     net_mask(struct mlfiNet *, int);
+extern const char *net_ntop(const struct mlfiNet *, char *, size_t);
+
+/* Local services */
+extern int      server_open(struct mlfiServer *);
+extern int      server_start(struct mlfiServer *);
+extern void     server_stop(struct mlfiServer *);
+extern ssize_t  server_read(int, char *, size_t, int);
+extern int      server_printf(char **, size_t *, size_t *, const char *, ...);
+extern int      server_http_reply(int, const char *, const char *,
+                    const char *, size_t);
+
+/* Statistics */
+extern int      stats_init(void);
+extern void     stats_reclaim(int);
+extern void     stats_observe(int, long);
+extern void     stats_phase(struct mlfiCtx *, int);
+extern const char *stats_phase_name(int);
+extern void     stats_message(struct mlfiCtx *, sfsistat, int,
+                    const struct timespec *, const struct timespec *);
+extern char    *stats_format(size_t *);
+extern long     stats_wait_quantile(int);
+extern long     stats_scan_mean(void);
+extern void     stats_connect(int);
+extern void     stats_connect_time(time_t *, time_t *);
+extern int      stats_open(void);
+extern int      stats_start(void);
+extern void     stats_stop(void);
+
+/* Health status */
+extern int      health_open(void);
+extern int      health_start(void);
+extern void     health_stop(void);
+
+/* Control */
+extern int      control_open(void);
+extern int      control_start(void);
+extern void     control_stop(void);
+extern int      control_draining(void);
+
+/* Debug tracing */
+extern int      trace_init(void);
+extern void     trace_free(void);
+extern int      trace_connect(const _SOCK_ADDR *, const char *);
+extern int      trace_message(const char *);
+
+/* Worker processes */
+extern int      worker_parse(const char *);
+extern int      worker_enabled(void);
+extern int      worker_id(void);
+extern void    *worker_alloc(size_t);
+extern int      worker_start(void);
+
+/*
+ * Log message only when its priority is enabled, so the arguments of the
+ * disabled messages are neither evaluated nor formatted.  With
+ * --disable-debug-logging, the debug messages are compiled out.  Messages
+ * with the context of a traced transaction use its debug level.
+ */
+#ifdef DISABLE_DEBUG_LOGGING
+# define LOG_ENABLED(priority) ((priority) < LOG_DEBUG && \
+                    ((priority) <= LOG_WARNING || \
+                    (priority) <= __atomic_load_n(&debug_level, __ATOMIC_RELAXED)))
+# define LOG_TRACED(mlfi, priority) ((priority) < LOG_DEBUG && \
+                    (mlfi) != NULL && \
+                    (priority) <= ((struct mlfiCtx *)(mlfi))->mlfi_trace)
+#else
+# define LOG_ENABLED(priority) \
+                    ((priority) <= LOG_WARNING || \
+                    (priority) <= __atomic_load_n(&debug_level, __ATOMIC_RELAXED))
+# define LOG_TRACED(mlfi, priority) ((mlfi) != NULL && \
+                    (priority) <= ((struct mlfiCtx *)(mlfi))->mlfi_trace)
+#endif
+#define logmsg(priority, ...) do { \
+        if (LOG_ENABLED(priority)) { \
+            logmsg_print(priority, __VA_ARGS__); \
+        } \
+    } while (0)
+#define logqidmsg(mlfi, priority, ...) do { \
+        if (LOG_ENABLED(priority) || LOG_TRACED(mlfi, priority)) { \
+            logqidmsg_print(mlfi, priority, __VA_ARGS__); \
+        } \
+    } while (0)
 
 /* Macros */
 
@@ -70,6 +70,9 @@ amavisd_grow_amabuf(struct mlfiCtx *mlfi, char *b)
     }
     mlfi->mlfi_amabuf = amabuf;
     mlfi->mlfi_amabuf_length = buflen;
+#ifndef NDEBUG
+    mlfi->mlfi_nalloc++;
+#endif
 
     logqidmsg(mlfi, LOG_DEBUG,
         "amavisd communication buffer was increased to %lu",
@@ -81,44 +84,59 @@ amavisd_grow_amabuf(struct mlfiCtx *mlfi, char *b)
 
 /*
 ** AMAVISD_CONNECT - Connect to amavisd socket
+**
+** When the number of amavisd connections is limited, amavisd_connect()
+** waits for a free connection until timeout and calls the function
+** progress during the wait, see admit_acquire().
 */
 int
-amavisd_connect(struct mlfiCtx *mlfi, struct sockaddr_un *sock, time_t timeout)
+amavisd_connect(struct mlfiCtx *mlfi, struct sockaddr_un *sock, time_t timeout,
+    int (*progress)(void *), void *arg)
 {
-    int         i;
-#ifdef HAVE_SEM_TIMEDWAIT
-    struct      timespec max_timeout;
-#endif
+    int         i, limit, queued;
+    struct      timespec start, now;
 
-    /* Lock amavisd connection */
-    if (max_sem != NULL && mlfi->mlfi_max_sem_locked == 0) {
-#ifdef HAVE_SEM_TIMEDWAIT
-        max_timeout.tv_sec = timeout;
-        max_timeout.tv_nsec = 0;
-        while ((i = sem_timedwait(max_sem, &max_timeout)) != 0 &&
-            errno == EINTR)
-        {
-            continue;
+    /* Fail at once while amavisd is failing */
+    if (breaker_enabled() && mlfi->mlfi_breaker == 0) {
+        if ((i = breaker_allow()) == -1) {
+            stats_phase(mlfi, PHASE_CONNECT);
+            logqidmsg(mlfi, LOG_WARNING, "amavisd circuit breaker is open");
+            errno = ECONNREFUSED;
+            return -1;
         }
-#else
-        while ((i = sem_trywait(max_sem)) != 0 &&
-            errno == EAGAIN && time(NULL) < timeout)
+        mlfi->mlfi_breaker = i;
+    }
+
+    /* Lock amavisd connection */
+    stats_phase(mlfi, PHASE_WAIT);
+    clock_now(&start);
+    if (admit_enabled() && mlfi->mlfi_max_sem_locked == 0) {
+        if (admit_acquire(mlfi->mlfi_class, mlfi->mlfi_size, timeout,
+            progress, arg) == -1)
         {
-            sleep(1);
-        }
-#endif
-        if (i == -1) {
-            if (errno != AMAVISD_CONNECT_TIMEDOUT_ERRNO) {
+            if (errno != ETIMEDOUT && errno != ECANCELED) {
                 logqidmsg(mlfi, LOG_ERR,
-                    "could not lock amavisd connections semaphore: %s",
+                    "could not wait for amavisd connection: %s",
                     strerror(errno));
             }
+            clock_now(&now);
+            mlfi->mlfi_wait_usec += clock_usec(&start, &now);
+            breaker_cancel(mlfi->mlfi_breaker);
+            mlfi->mlfi_breaker = 0;
             return -1;
         }
-        mlfi->mlfi_max_sem_locked = 1;
-        sem_getvalue(max_sem, &i);
-        logqidmsg(mlfi, LOG_DEBUG, "grab amavisd connection %d", i);
+        __atomic_store_n(&mlfi->mlfi_max_sem_locked, 1, __ATOMIC_RELAXED);
+        if (LOG_ENABLED(LOG_DEBUG) || LOG_TRACED(mlfi, LOG_DEBUG)) {
+            admit_status(&limit, &i, &queued);
+            logqidmsg(mlfi, LOG_DEBUG, "grab amavisd connection %d", i);
+        }
     }
+    clock_now(&now);
+    mlfi->mlfi_wait_usec += clock_usec(&start, &now);
+    stats_phase(mlfi, PHASE_CONNECT);
+
+    /* Discard pending request lines */
+    mlfi->mlfi_amabuf_pos = 0;
 
     /* Initialize domain socket */
     memset(sock, '\0', sizeof(*sock));
@@ -131,8 +149,11 @@ amavisd_connect(struct mlfiCtx *mlfi, struct sockaddr_un *sock, time_t timeout)
     }
 
     /* Connect to amavisd */
-    if (connect(mlfi->mlfi_amasd, (struct sockaddr *)sock, sizeof(*sock)) == -1)
-    {
+    i = connect(mlfi->mlfi_amasd, (struct sockaddr *)sock, sizeof(*sock));
+    clock_now(&start);
+    mlfi->mlfi_connect_usec += clock_usec(&now, &start);
+    stats_connect(i == 0);
+    if (i == -1) {
         logqidmsg(mlfi, LOG_ERR, "could not connect to amavisd socket %s: %s",
             amavisd_socket, strerror(errno));
         return -1;
@@ -145,14 +166,50 @@ amavisd_connect(struct mlfiCtx *mlfi, struct sockaddr_un *sock, time_t timeout)
 }
 
 
+/*
+** AMAVISD_FLUSH - Write pending request lines to amavisd
+*/
+int
+amavisd_flush(struct mlfiCtx *mlfi)
+{
+    ssize_t     n;
+
+    n = write_sock(mlfi->mlfi_amasd, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_pos,
+        amavisd_timeout);
+    mlfi->mlfi_amabuf_pos = 0;
+    return n == -1 ? -1 : 0;
+}
+
+
 /*
 ** AMAVISD_REQUEST - Write request line to amavisd
+**
+** amavisd_request() collects request lines in the amavisd communication
+** buffer and writes them in batches.  The end of the request (both name and
+** value are NULL) writes all pending lines.
 */
 int
 amavisd_request(struct mlfiCtx *mlfi, const char *name, const char *value)
 {
     const char *p;
-    char       *b = mlfi->mlfi_amabuf;
+    char       *b;
+    size_t      len;
+
+    /* Write pending lines when the encoded line may exceed batch size */
+    len = 3 * ((name != NULL ? strlen(name) : 0) +
+        (value != NULL ? strlen(value) : 0)) + 2;
+    if (mlfi->mlfi_amabuf_pos > 0 &&
+        mlfi->mlfi_amabuf_pos + len > AMABUFBATCH &&
+        amavisd_flush(mlfi) == -1)
+    {
+        return -1;
+    }
+    b = mlfi->mlfi_amabuf + mlfi->mlfi_amabuf_pos;
+    if (b >= mlfi->mlfi_amabuf + mlfi->mlfi_amabuf_length - 5 &&
+        (b = amavisd_grow_amabuf(mlfi, b)) == NULL)
+    {
+        return -1;
+    }
 
     /* Encode request */
     if (name != NULL) {
@@ -191,10 +248,69 @@ amavisd_request(struct mlfiCtx *mlfi, const char *name, const char *value)
         }
     }
     *b++ = '\n';
+    mlfi->mlfi_amabuf_pos = b - mlfi->mlfi_amabuf;
 
     /* Write request to amavisd socket */
-    return write_sock(mlfi->mlfi_amasd, mlfi->mlfi_amabuf,
-        b - mlfi->mlfi_amabuf, amavisd_timeout);
+    if (name == NULL && value == NULL) {
+        return amavisd_flush(mlfi);
+    }
+    return 0;
+}
+
+
+/*
+** AMAVISD_WAIT - Wait for amavisd response
+**
+** amavisd_wait() calls the function progress every interval seconds until
+** amavisd starts to respond.  It returns -1 with errno ETIMEDOUT when
+** amavisd did not respond within amavisd_timeout, or ECANCELED when
+** progress failed.
+*/
+int
+amavisd_wait(struct mlfiCtx *mlfi, int interval, int (*progress)(void *),
+    void *arg)
+{
+    int         sd = mlfi->mlfi_amasd;
+    int         rc;
+    fd_set      rfds;
+    struct      timeval tv;
+    struct      timespec start, now;
+    long        left;
+
+    if (sd >= (int) FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+    clock_now(&start);
+    for (;;) {
+        clock_now(&now);
+        if ((left = amavisd_timeout * 1000000L - clock_usec(&start, &now))
+            <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        left = MIN(left, interval * 1000000L);
+        FD_ZERO(&rfds);
+        FD_SET((unsigned int)sd, &rfds);
+        tv.tv_sec = left / 1000000;
+        tv.tv_usec = left % 1000000;
+        if ((rc = select(sd + 1, &rfds, NULL, NULL, &tv)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (rc > 0) {
+            return 0;
+        }
+        clock_now(&now);
+        if (clock_usec(&start, &now) < amavisd_timeout * 1000000L &&
+            progress(arg) == -1)
+        {
+            errno = ECANCELED;
+            return -1;
+        }
+    }
 }
 
 
@@ -256,29 +372,55 @@ amavisd_response(struct mlfiCtx *mlfi)
 
 
 /*
-** AMAVISD_CLOSE - Close amavisd socket
+** AMAVISD_DISCONNECT - Close amavisd socket and keep amavisd connection
+**
+** amavisd_disconnect() is used when the connection opened ahead of the end
+** of the message failed, the next amavisd_connect() reuses the slot.
 */
 void
-amavisd_close(struct mlfiCtx *mlfi)
+amavisd_disconnect(struct mlfiCtx *mlfi)
 {
-    /* Close amavisd connection */
     if (mlfi->mlfi_amasd != -1) {
         if (close(mlfi->mlfi_amasd) == -1) {
             logqidmsg(mlfi, LOG_ERR, "could not close amavisd socket %s: %s",
-                mlfi->mlfi_fname, strerror(errno));
+                amavisd_socket, strerror(errno));
         }
         mlfi->mlfi_amasd = -1;
         logqidmsg(mlfi, LOG_DEBUG, "close amavisd communication socket");
     }
+}
+
+
+/*
+** AMAVISD_CLOSE - Close amavisd socket
+**
+** A message aborted while it is still received is not a result of amavisd,
+** although the connection was opened ahead.
+*/
+void
+amavisd_close(struct mlfiCtx *mlfi)
+{
+    /* Close amavisd connection */
+    amavisd_disconnect(mlfi);
+
+    /* Record result of the transaction */
+    if (mlfi->mlfi_breaker != 0) {
+        if (mlfi->mlfi_phase == PHASE_SPOOL) {
+            breaker_cancel(mlfi->mlfi_breaker);
+        } else {
+            breaker_done(mlfi->mlfi_breaker, mlfi->mlfi_phase == PHASE_DONE);
+        }
+        mlfi->mlfi_breaker = 0;
+    }
 
     /* Unlock amavisd connection */
     if (mlfi->mlfi_max_sem_locked != 0) {
-        if (sem_post(max_sem) == -1) {
-            logqidmsg(mlfi, LOG_ERR,
-                "%s: could not unlock amavisd connections semaphore: %s",
-                strerror(errno));
+        if (adapt_enabled() && mlfi->mlfi_phase != PHASE_SPOOL) {
+            adapt_sample(mlfi->mlfi_scan_usec,
+                mlfi->mlfi_phase == PHASE_DONE);
         }
-        mlfi->mlfi_max_sem_locked = 0;
+        admit_release(mlfi->mlfi_class);
+        __atomic_store_n(&mlfi->mlfi_max_sem_locked, 0, __ATOMIC_RELAXED);
         logqidmsg(mlfi, LOG_DEBUG, "got back amavisd connection");
     }
 }
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+
+/* Allocation alignment */
+#define ARENA_ALIGN     (sizeof(double) > sizeof(void *) ? \
+                            sizeof(double) : sizeof(void *))
+#define ARENA_ROUND(n)  (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Chunk data */
+#define ARENA_DATA(c)   ((char *)(c) + ARENA_ROUND(sizeof(struct mlfiChunk)))
+
+
+/*
+** ARENA_INIT - Initialize memory arena
+*/
+void
+arena_init(struct mlfiArena *arena, size_t chunk_size)
+{
+    (void) memset(arena, '\0', sizeof(*arena));
+    arena->a_chunk_size = chunk_size;
+}
+
+
+/*
+** ARENA_ALLOC - Allocate memory from arena
+**
+** arena_alloc() returns memory from the current chunk.  When the current
+** chunk is exhausted, the next chunk retained by arena_reset() is used
+** and only if there is none large enough, a new chunk is allocated.
+*/
+void *
+arena_alloc(struct mlfiArena *arena, size_t size)
+{
+    struct      mlfiChunk *chunk;
+    size_t      chunk_size;
+    char       *p;
+
+    size = ARENA_ROUND(MAX(size, 1));
+
+    /* Find a chunk with enough free space */
+    while (arena->a_ptr == NULL || size > (size_t)(arena->a_end - arena->a_ptr))
+    {
+        if (arena->a_chunk == NULL || arena->a_chunk->c_next == NULL) {
+            break;
+        }
+        arena->a_chunk = arena->a_chunk->c_next;
+        arena->a_ptr = ARENA_DATA(arena->a_chunk);
+        arena->a_end = arena->a_ptr + arena->a_chunk->c_size;
+    }
+
+    /* Allocate new chunk after the current one */
+    if (arena->a_ptr == NULL || size > (size_t)(arena->a_end - arena->a_ptr)) {
+        chunk_size = MAX(arena->a_chunk_size, size);
+        chunk = malloc(ARENA_ROUND(sizeof(*chunk)) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+#ifndef NDEBUG
+        arena->a_nalloc++;
+#endif
+        chunk->c_size = chunk_size;
+        if (arena->a_chunk == NULL) {
+            chunk->c_next = arena->a_head;
+            arena->a_head = chunk;
+        } else {
+            chunk->c_next = arena->a_chunk->c_next;
+            arena->a_chunk->c_next = chunk;
+        }
+        arena->a_chunk = chunk;
+        arena->a_ptr = ARENA_DATA(chunk);
+        arena->a_end = arena->a_ptr + chunk_size;
+    }
+
+    p = arena->a_ptr;
+    arena->a_ptr += size;
+    return p;
+}
+
+
+/*
+** ARENA_STRDUP - Copy string to arena
+*/
+char *
+arena_strdup(struct mlfiArena *arena, const char *s)
+{
+    size_t      len;
+    char       *p;
+
+    len = strlen(s) + 1;
+    if ((p = arena_alloc(arena, len)) != NULL) {
+        (void) memcpy(p, s, len);
+    }
+    return p;
+}
+
+
+/*
+** ARENA_RESET - Release all memory allocated from arena
+**
+** arena_reset() keeps the allocated chunks for reuse
+*/
+void
+arena_reset(struct mlfiArena *arena)
+{
+    arena->a_chunk = arena->a_head;
+    if (arena->a_chunk != NULL) {
+        arena->a_ptr = ARENA_DATA(arena->a_chunk);
+        arena->a_end = arena->a_ptr + arena->a_chunk->c_size;
+    }
+}
+
+
+/*
+** ARENA_TRIM - Release all memory and free the spare chunks
+**
+** arena_trim() keeps only the first chunk and only when it has the default
+** size, so an arena which once grew large does not hold the memory forever
+*/
+void
+arena_trim(struct mlfiArena *arena)
+{
+    struct      mlfiChunk *chunk;
+
+    if (arena->a_head != NULL && arena->a_head->c_size != arena->a_chunk_size)
+    {
+        arena_free(arena);
+        return;
+    }
+    if (arena->a_head != NULL) {
+        while ((chunk = arena->a_head->c_next) != NULL) {
+            arena->a_head->c_next = chunk->c_next;
+            free(chunk);
+        }
+    }
+    arena_reset(arena);
+}
+
+
+/*
+** ARENA_FREE - Free all arena chunks
+*/
+void
+arena_free(struct mlfiArena *arena)
+{
+    struct      mlfiChunk *chunk;
+
+    while ((chunk = arena->a_head) != NULL) {
+        arena->a_head = chunk->c_next;
+        free(chunk);
+    }
+    arena_init(arena, arena->a_chunk_size);
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+
+/*
+** Circuit breaker of amavisd
+**
+** The breaker opens after breaker_failures consecutive amavisd failures,
+** or when breaker_rate percent of the last BREAKERWINDOW transactions
+** failed.  While it is open, the transactions fail at once without
+** waiting for amavisd.  After breaker_cooldown seconds it is half-open
+** and lets a single probe transaction through, which closes it when
+** amavisd answered or opens it again.
+*/
+static pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+static int      breaker_failures;       /* consecutive failures to open */
+static int      breaker_cooldown = BREAKERCOOLDOWN; /* open period */
+static int      breaker_rate;           /* failure rate to open */
+static int      breaker_state;          /* BREAKER_CLOSED, OPEN, HALFOPEN */
+static int      breaker_probing;        /* probe is in progress */
+static time_t   breaker_opened;         /* time of opening */
+static int      breaker_consecutive;    /* consecutive failures */
+static unsigned long long breaker_window; /* outcomes, 1 = failure */
+static int      breaker_count;          /* outcomes in the window */
+static unsigned long breaker_opens;     /* number of openings */
+static unsigned long breaker_rejected;  /* failed fast transactions */
+
+
+/*
+** BREAKER_NOW - Get monotonic time in seconds
+*/
+static time_t
+breaker_now(void)
+{
+    struct      timespec now;
+
+    clock_now(&now);
+    return now.tv_sec;
+}
+
+
+/*
+** BREAKER_OPEN - Open circuit breaker
+**
+** breaker_open() must be called with breaker_lock locked
+*/
+static void
+breaker_open(const char *reason)
+{
+    breaker_state = BREAKER_OPEN;
+    breaker_probing = 0;
+    breaker_opened = breaker_now();
+    breaker_consecutive = 0;
+    breaker_window = 0;
+    breaker_count = 0;
+    breaker_opens++;
+    logmsg(LOG_WARNING, "amavisd circuit breaker is open for %d sec: %s",
+        breaker_cooldown, reason);
+}
+
+
+/*
+** BREAKER_PARSE - Parse circuit breaker thresholds
+**
+** The thresholds are specified as failures[:cooldown[:rate]], where rate is
+** the failure rate in percent.  breaker_parse() returns -1 when the
+** specification is not valid.
+*/
+int
+breaker_parse(const char *spec)
+{
+    long        failures, cooldown = BREAKERCOOLDOWN, rate = 0;
+    char       *end;
+
+    failures = strtol(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != ':') || failures <= 0 ||
+        failures > INT_MAX)
+    {
+        return -1;
+    }
+    if (*end == ':') {
+        spec = end + 1;
+        cooldown = strtol(spec, &end, 10);
+        if (end == spec || (*end != '\0' && *end != ':') || cooldown <= 0 ||
+            cooldown > INT_MAX)
+        {
+            return -1;
+        }
+    }
+    if (*end == ':') {
+        spec = end + 1;
+        rate = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0' || rate <= 0 || rate > 100) {
+            return -1;
+        }
+    }
+    breaker_failures = (int) failures;
+    breaker_cooldown = (int) cooldown;
+    breaker_rate = (int) rate;
+    return 0;
+}
+
+
+/*
+** BREAKER_ENABLED - Check if circuit breaker is enabled
+*/
+int
+breaker_enabled(void)
+{
+    return breaker_failures != 0;
+}
+
+
+/*
+** BREAKER_ALLOW - Check if transaction may use amavisd
+**
+** breaker_allow() returns -1 when the transaction should fail at once,
+** BREAKER_PASS or BREAKER_PROBE, which must be passed to breaker_done()
+** or breaker_cancel()
+*/
+int
+breaker_allow(void)
+{
+    int         rc = BREAKER_PASS;
+
+    (void) pthread_mutex_lock(&breaker_lock);
+    if (breaker_state == BREAKER_OPEN &&
+        breaker_now() - breaker_opened >= breaker_cooldown)
+    {
+        breaker_state = BREAKER_HALFOPEN;
+    }
+    if (breaker_state == BREAKER_HALFOPEN && !breaker_probing) {
+        breaker_probing = 1;
+        rc = BREAKER_PROBE;
+    } else if (breaker_state != BREAKER_CLOSED) {
+        breaker_rejected++;
+        rc = -1;
+    }
+    (void) pthread_mutex_unlock(&breaker_lock);
+    return rc;
+}
+
+
+/*
+** BREAKER_DONE - Record result of amavisd transaction
+**
+** The results of transactions which started before the breaker opened are
+** ignored.
+*/
+void
+breaker_done(int pass, int ok)
+{
+    (void) pthread_mutex_lock(&breaker_lock);
+    if (pass == BREAKER_PROBE) {
+        if (ok) {
+            breaker_state = BREAKER_CLOSED;
+            breaker_probing = 0;
+            breaker_consecutive = 0;
+            breaker_window = 0;
+            breaker_count = 0;
+            logmsg(LOG_WARNING, "amavisd circuit breaker is closed");
+        } else {
+            breaker_open("probe failed");
+        }
+    } else if (breaker_state == BREAKER_CLOSED) {
+        breaker_consecutive = ok ? 0 : breaker_consecutive + 1;
+        breaker_window = (breaker_window << 1) | (ok ? 0 : 1);
+        breaker_count = MIN(breaker_count + 1, BREAKERWINDOW);
+        if (breaker_consecutive >= breaker_failures) {
+            breaker_open("consecutive failures");
+        } else if (breaker_rate > 0 && breaker_count == BREAKERWINDOW &&
+            __builtin_popcountll(breaker_window) * 100 >=
+            breaker_rate * BREAKERWINDOW)
+        {
+            breaker_open("failure rate");
+        }
+    }
+    (void) pthread_mutex_unlock(&breaker_lock);
+}
+
+
+/*
+** BREAKER_CANCEL - Forget transaction which did not use amavisd
+*/
+void
+breaker_cancel(int pass)
+{
+    if (pass == BREAKER_PROBE) {
+        (void) pthread_mutex_lock(&breaker_lock);
+        breaker_probing = 0;
+        (void) pthread_mutex_unlock(&breaker_lock);
+    }
+}
+
+
+/*
+** BREAKER_STATUS - Get state, openings and failed fast transactions
+*/
+void
+breaker_status(int *state, unsigned long *opens, unsigned long *rejected)
+{
+    (void) pthread_mutex_lock(&breaker_lock);
+    *state = breaker_state;
+    *opens = breaker_opens;
+    *rejected = breaker_rejected;
+    (void) pthread_mutex_unlock(&breaker_lock);
+}
@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+#include <time.h>
+
+
+/* Verdict cache entry */
+struct cacheEntry {
+    struct      cacheEntry *e_next;     /* next entry in the bucket */
+    struct      cacheEntry *e_older;    /* less recently used entry */
+    struct      cacheEntry *e_newer;    /* more recently used entry */
+    uint64_t    e_key;                  /* message key */
+    time_t      e_expire;               /* end of validity */
+    sfsistat    e_rstat;                /* milter verdict */
+    size_t      e_len;                  /* verdict response length */
+    char        e_verdict[CACHEVERDICT];/* replayed response lines */
+};
+
+/* Verdict cache stripe */
+struct cacheStripe {
+    pthread_mutex_t s_lock;             /* stripe lock */
+    struct      cacheEntry **s_buckets; /* hash table buckets */
+    struct      cacheEntry *s_newest;   /* most recently used entry */
+    struct      cacheEntry *s_oldest;   /* least recently used entry */
+    struct      cacheEntry *s_free;     /* unused entries */
+    int         s_used;                 /* used entries */
+};
+
+/*
+** Verdict cache
+**
+** The same message may be delivered many times.  The body is hashed while
+** it is received, together with the headers which decide how amavisd reads
+** the body (MIME-Version, Content-Type, Content-Transfer-Encoding) and
+** which the spam score and the replayed headers depend on (From, Subject).
+** The headers which differ in every copy of a message (Message-ID, Date,
+** Received and other trace headers) are not hashed.  The hash of them and
+** of the envelope attributes, which amavisd selects the policy by, is the
+** key of the amavisd verdict.  The hash is keyed SipHash with a random key,
+** so the keys of different messages collide only by chance and only the
+** 64-bit key is kept.  The verdicts are kept for cache_ttl seconds in a
+** hash table of cache_entries entries, which is split into CACHESTRIPES
+** stripes with their own locks and LRU lists.
+**
+** Only the verdicts which do not depend on the message itself are kept:
+** the response must not change recipients, change or delete headers or
+** quarantine the message, and the verdict must not be tempfail.
+*/
+static int      cache_ttl;              /* verdict lifetime in seconds */
+static int      cache_entries = CACHEENTRIES;/* table entries */
+static int      cache_buckets;          /* buckets per stripe */
+static struct   cacheStripe *cache_stripes;/* hash table stripes */
+static struct   cacheEntry *cache_pool; /* table entries */
+static struct   cacheEntry **cache_bucket_pool;/* table buckets */
+static uint64_t cache_sipkey[2];        /* SipHash key */
+static unsigned long cache_hits;        /* replayed verdicts */
+static unsigned long cache_misses;      /* verdicts not found */
+static unsigned long cache_stores;      /* stored verdicts */
+static const char *cache_headers[] = {  /* hashed headers */
+    "MIME-Version", "Content-Type", "Content-Transfer-Encoding", "From",
+    "Subject", NULL
+};
+
+
+/*
+** SipHash-2-4
+*/
+#define CACHE_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define CACHE_SIPROUND(v) do { \
+        (v)[0] += (v)[1]; (v)[1] = CACHE_ROTL((v)[1], 13); \
+        (v)[1] ^= (v)[0]; (v)[0] = CACHE_ROTL((v)[0], 32); \
+        (v)[2] += (v)[3]; (v)[3] = CACHE_ROTL((v)[3], 16); \
+        (v)[3] ^= (v)[2]; \
+        (v)[0] += (v)[3]; (v)[3] = CACHE_ROTL((v)[3], 21); \
+        (v)[3] ^= (v)[0]; \
+        (v)[2] += (v)[1]; (v)[1] = CACHE_ROTL((v)[1], 17); \
+        (v)[1] ^= (v)[2]; (v)[2] = CACHE_ROTL((v)[2], 32); \
+    } while (0)
+
+
+/*
+** CACHE_COMPRESS - Add 64-bit word to the hash
+*/
+static void
+cache_compress(struct cacheHash *h, uint64_t m)
+{
+    h->h_v[3] ^= m;
+    CACHE_SIPROUND(h->h_v);
+    CACHE_SIPROUND(h->h_v);
+    h->h_v[0] ^= m;
+}
+
+
+/*
+** CACHE_HASH_ADD - Add bytes to the hash
+*/
+static void
+cache_hash_add(struct cacheHash *h, const unsigned char *p, size_t len)
+{
+    unsigned int n = h->h_len & 7;
+    uint64_t    m;
+    int         i;
+
+    h->h_len += len;
+
+    /* Complete the pending word */
+    if (n != 0) {
+        for (; n < 8 && len > 0; n++, len--) {
+            h->h_tail |= (uint64_t) *p++ << (8 * n);
+        }
+        if (n < 8) {
+            return;
+        }
+        cache_compress(h, h->h_tail);
+        h->h_tail = 0;
+    }
+
+    /* Whole little-endian words */
+    for (; len >= 8; p += 8, len -= 8) {
+        for (m = 0, i = 7; i >= 0; i--) {
+            m = m << 8 | p[i];
+        }
+        cache_compress(h, m);
+    }
+    for (n = 0; n < len; n++) {
+        h->h_tail |= (uint64_t) p[n] << (8 * n);
+    }
+}
+
+
+/*
+** CACHE_HASH_STRING - Add string with its terminating NUL to the hash
+*/
+static void
+cache_hash_string(struct cacheHash *h, const char *s)
+{
+    if (s == NULL) {
+        s = "";
+    }
+    cache_hash_add(h, (const unsigned char *) s, strlen(s) + 1);
+}
+
+
+/*
+** CACHE_HASH_END - Get 64-bit hash value
+*/
+static uint64_t
+cache_hash_end(struct cacheHash *h)
+{
+    int         i;
+
+    cache_compress(h, h->h_tail | h->h_len << 56);
+    h->h_v[2] ^= 0xff;
+    for (i = 0; i < 4; i++) {
+        CACHE_SIPROUND(h->h_v);
+    }
+    return h->h_v[0] ^ h->h_v[1] ^ h->h_v[2] ^ h->h_v[3];
+}
+
+
+/*
+** CACHE_PARSE - Parse verdict cache specification
+**
+** The cache is specified as ttl[:entries], where ttl is the verdict
+** lifetime in seconds.  cache_parse() returns -1 when the specification
+** is not valid.
+*/
+int
+cache_parse(const char *spec)
+{
+    long        ttl, entries;
+    char       *end;
+
+    ttl = strtol(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != ':') || ttl <= 0 ||
+        ttl > 86400)
+    {
+        return -1;
+    }
+    entries = CACHEENTRIES;
+    if (*end == ':') {
+        spec = end + 1;
+        entries = strtol(spec, &end, 10);
+        if (end == spec || *end != '\0' || entries < CACHESTRIPES ||
+            entries > 1048576)
+        {
+            return -1;
+        }
+    }
+    cache_ttl = (int) ttl;
+    cache_entries = (int) entries;
+    return 0;
+}
+
+
+/*
+** CACHE_INIT - Allocate verdict cache
+**
+** cache_init() returns -1 when the cache cannot be used or allocated
+*/
+int
+cache_init(void)
+{
+    struct      cacheStripe *s;
+    int         i, j, n;
+#ifndef HAVE_ARC4RANDOM
+    int         fd;
+#endif
+
+    if (cache_ttl == 0) {
+        return 0;
+    }
+
+    /* Messages delivered by amavisd have no verdict to replay */
+    if (strcmp(delivery_care_of, "client") != 0) {
+        logmsg(LOG_ERR, "verdict cache requires delivery care of client");
+        return -1;
+    }
+
+    /* Random SipHash key */
+#ifdef HAVE_ARC4RANDOM
+    for (i = 0; i < 2; i++) {
+        cache_sipkey[i] = (uint64_t) arc4random() << 32 | arc4random();
+    }
+#else
+    if ((fd = open("/dev/urandom", O_RDONLY)) == -1 ||
+        read(fd, cache_sipkey, sizeof(cache_sipkey)) !=
+        (ssize_t) sizeof(cache_sipkey))
+    {
+        logmsg(LOG_ERR, "could not read /dev/urandom: %s", strerror(errno));
+        if (fd != -1) {
+            (void) close(fd);
+        }
+        return -1;
+    }
+    (void) close(fd);
+#endif
+
+    /* Hash table */
+    n = cache_entries / CACHESTRIPES;
+    cache_buckets = n;
+    if ((cache_stripes = calloc(CACHESTRIPES, sizeof(*cache_stripes))) ==
+        NULL ||
+        (cache_pool = calloc(n * CACHESTRIPES, sizeof(*cache_pool))) == NULL ||
+        (cache_bucket_pool = calloc(n * CACHESTRIPES,
+        sizeof(*cache_bucket_pool))) == NULL)
+    {
+        logmsg(LOG_ERR, "could not allocate verdict cache");
+        return -1;
+    }
+    for (i = 0; i < CACHESTRIPES; i++) {
+        s = &cache_stripes[i];
+        (void) pthread_mutex_init(&s->s_lock, NULL);
+        s->s_buckets = &cache_bucket_pool[i * n];
+        for (j = n - 1; j >= 0; j--) {
+            cache_pool[i * n + j].e_next = s->s_free;
+            s->s_free = &cache_pool[i * n + j];
+        }
+    }
+    return 0;
+}
+
+
+/*
+** CACHE_FREE - Free verdict cache
+*/
+void
+cache_free(void)
+{
+    int         i;
+
+    if (cache_stripes != NULL) {
+        for (i = 0; i < CACHESTRIPES; i++) {
+            (void) pthread_mutex_destroy(&cache_stripes[i].s_lock);
+        }
+    }
+    free(cache_stripes);
+    free(cache_pool);
+    free(cache_bucket_pool);
+    cache_stripes = NULL;
+    cache_pool = NULL;
+    cache_bucket_pool = NULL;
+}
+
+
+/*
+** CACHE_ENABLED - Check if verdict cache is enabled
+*/
+int
+cache_enabled(void)
+{
+    return cache_stripes != NULL;
+}
+
+
+/*
+** CACHE_START - Start hashing of message
+*/
+void
+cache_start(struct mlfiCtx *mlfi)
+{
+    struct      cacheHash *h = &mlfi->mlfi_hash;
+
+    h->h_v[0] = cache_sipkey[0] ^ 0x736f6d6570736575ULL;
+    h->h_v[1] = cache_sipkey[1] ^ 0x646f72616e646f6dULL;
+    h->h_v[2] = cache_sipkey[0] ^ 0x6c7967656e657261ULL;
+    h->h_v[3] = cache_sipkey[1] ^ 0x7465646279746573ULL;
+    h->h_tail = 0;
+    h->h_len = 0;
+}
+
+
+/*
+** CACHE_HEADER - Add header from MTA to the hash
+**
+** Only the headers in cache_headers are hashed
+*/
+void
+cache_header(struct mlfiCtx *mlfi, const char *name, const char *value)
+{
+    int         i;
+
+    if (cache_stripes == NULL) {
+        return;
+    }
+    for (i = 0; cache_headers[i] != NULL; i++) {
+        if (strcasecmp(name, cache_headers[i]) == 0) {
+            cache_hash_string(&mlfi->mlfi_hash, cache_headers[i]);
+            cache_hash_string(&mlfi->mlfi_hash, value);
+            return;
+        }
+    }
+}
+
+
+/*
+** CACHE_BODY - Add spooled body chunk to the hash
+*/
+void
+cache_body(struct mlfiCtx *mlfi, const unsigned char *p, size_t len)
+{
+    if (cache_stripes != NULL) {
+        cache_hash_add(&mlfi->mlfi_hash, p, len);
+    }
+}
+
+
+/*
+** CACHE_KEY - Get key of the message
+**
+** The key covers the hashed headers, the body and the envelope attributes,
+** which amavisd uses to select the policy: the client address (mynetworks),
+** the policy bank, the sender and the recipients (per-recipient settings)
+*/
+uint64_t
+cache_key(struct mlfiCtx *mlfi)
+{
+    struct      cacheHash *h = &mlfi->mlfi_hash;
+    unsigned int i;
+
+    cache_hash_string(h, mlfi->mlfi_client_addr);
+    cache_hash_string(h, mlfi->mlfi_policy_bank);
+    cache_hash_string(h, mlfi->mlfi_from);
+    for (i = 0; i < mlfi->mlfi_rcpt_count; i++) {
+        cache_hash_string(h, mlfi->mlfi_rcpt[i]);
+    }
+    return cache_hash_end(h);
+}
+
+
+/*
+** CACHE_UNLINK - Remove entry from the bucket and from the LRU list
+**
+** cache_unlink() must be called with the stripe locked
+*/
+static void
+cache_unlink(struct cacheStripe *s, struct cacheEntry *e)
+{
+    struct      cacheEntry **p;
+
+    p = &s->s_buckets[(e->e_key / CACHESTRIPES) % cache_buckets];
+    while (*p != e) {
+        p = &(*p)->e_next;
+    }
+    *p = e->e_next;
+    if (e->e_older != NULL) {
+        e->e_older->e_newer = e->e_newer;
+    } else {
+        s->s_oldest = e->e_newer;
+    }
+    if (e->e_newer != NULL) {
+        e->e_newer->e_older = e->e_older;
+    } else {
+        s->s_newest = e->e_older;
+    }
+    s->s_used--;
+}
+
+
+/*
+** CACHE_LINK - Insert entry as the most recently used one
+**
+** cache_link() must be called with the stripe locked
+*/
+static void
+cache_link(struct cacheStripe *s, struct cacheEntry *e)
+{
+    struct      cacheEntry **bucket;
+
+    bucket = &s->s_buckets[(e->e_key / CACHESTRIPES) % cache_buckets];
+    e->e_next = *bucket;
+    *bucket = e;
+    e->e_older = s->s_newest;
+    e->e_newer = NULL;
+    if (s->s_newest != NULL) {
+        s->s_newest->e_newer = e;
+    } else {
+        s->s_oldest = e;
+    }
+    s->s_newest = e;
+    s->s_used++;
+}
+
+
+/*
+** CACHE_FIND - Find entry of the key
+**
+** cache_find() must be called with the stripe locked.  Expired entry is
+** freed and not found.
+*/
+static struct cacheEntry *
+cache_find(struct cacheStripe *s, uint64_t key, time_t now)
+{
+    struct      cacheEntry *e;
+
+    for (e = s->s_buckets[(key / CACHESTRIPES) % cache_buckets]; e != NULL;
+        e = e->e_next)
+    {
+        if (e->e_key == key) {
+            break;
+        }
+    }
+    if (e != NULL && e->e_expire <= now) {
+        cache_unlink(s, e);
+        e->e_next = s->s_free;
+        s->s_free = e;
+        e = NULL;
+    }
+    return e;
+}
+
+
+/*
+** CACHE_LOOKUP - Get verdict of the message
+**
+** cache_lookup() copies the recorded response lines of the verdict to buf
+** and returns their length, or -1 when the verdict is not known
+*/
+int
+cache_lookup(uint64_t key, char *buf, size_t size, sfsistat *rstat)
+{
+    struct      cacheStripe *s = &cache_stripes[key % CACHESTRIPES];
+    struct      cacheEntry *e;
+    int         len = -1;
+
+    (void) pthread_mutex_lock(&s->s_lock);
+    if ((e = cache_find(s, key, time(NULL))) != NULL && e->e_len <= size) {
+        cache_unlink(s, e);
+        cache_link(s, e);
+        (void) memcpy(buf, e->e_verdict, e->e_len);
+        *rstat = e->e_rstat;
+        len = (int) e->e_len;
+    }
+    (void) pthread_mutex_unlock(&s->s_lock);
+    __atomic_add_fetch(len != -1 ? &cache_hits : &cache_misses, 1,
+        __ATOMIC_RELAXED);
+    return len;
+}
+
+
+/*
+** CACHE_RECORD - Record amavisd response line for the verdict cache
+**
+** The lines are recorded as NUL terminated name and value, because the
+** decoded values may contain new lines.  len is the length of the recorded
+** lines in buf.  cache_record() returns the new length, or -1 when the
+** response cannot be replayed.
+*/
+int
+cache_record(char *buf, size_t size, int len, const char *name,
+    const char *value)
+{
+    size_t      n, v;
+
+    if (len == -1) {
+        return -1;
+    }
+
+    /* Lines of the amavisd transaction are not replayed */
+    if (strcmp(name, "version_server") == 0 || strcmp(name, "log_id") == 0 ||
+        strcmp(name, "exit_code") == 0)
+    {
+        return len;
+    }
+    if (strcmp(name, "return_value") != 0 && strcmp(name, "setreply") != 0 &&
+        strcmp(name, "addheader") != 0 && strcmp(name, "insheader") != 0)
+    {
+        return -1;
+    }
+    n = strlen(name) + 1;
+    v = strlen(value) + 1;
+    if (n + v > size - len) {
+        return -1;
+    }
+    (void) memcpy(buf + len, name, n);
+    (void) memcpy(buf + len + n, value, v);
+    return len + (int) (n + v);
+}
+
+
+/*
+** CACHE_STORE - Store verdict of the message
+*/
+void
+cache_store(uint64_t key, sfsistat rstat, const char *buf, int len)
+{
+    struct      cacheStripe *s = &cache_stripes[key % CACHESTRIPES];
+    struct      cacheEntry *e;
+    time_t      now = time(NULL);
+
+    if (rstat == SMFIS_TEMPFAIL || len < 0 || len > CACHEVERDICT) {
+        return;
+    }
+    (void) pthread_mutex_lock(&s->s_lock);
+    if ((e = cache_find(s, key, now)) != NULL) {
+        cache_unlink(s, e);
+    } else if ((e = s->s_free) != NULL) {
+        s->s_free = e->e_next;
+    } else {
+        e = s->s_oldest;
+        cache_unlink(s, e);
+    }
+    e->e_key = key;
+    e->e_expire = now + cache_ttl;
+    e->e_rstat = rstat;
+    e->e_len = (size_t) len;
+    (void) memcpy(e->e_verdict, buf, len);
+    cache_link(s, e);
+    (void) pthread_mutex_unlock(&s->s_lock);
+    __atomic_add_fetch(&cache_stores, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+** CACHE_STATUS - Get used entries, replayed, not found and stored verdicts
+*/
+void
+cache_status(int *entries, unsigned long *hits, unsigned long *misses,
+    unsigned long *stores)
+{
+    int         i;
+
+    *entries = 0;
+    for (i = 0; i < CACHESTRIPES; i++) {
+        (void) pthread_mutex_lock(&cache_stripes[i].s_lock);
+        *entries += cache_stripes[i].s_used;
+        (void) pthread_mutex_unlock(&cache_stripes[i].s_lock);
+    }
+    *hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+    *stores = __atomic_load_n(&cache_stores, __ATOMIC_RELAXED);
+}
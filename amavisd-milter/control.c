@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+
+/* Control reply */
+struct controlReply {
+    char       *r_buf;                  /* reply text */
+    size_t      r_size;                 /* reply buffer size */
+    size_t      r_len;                  /* reply length */
+    int         r_rc;                   /* -1 if the buffer is incomplete */
+    int         r_conns;                /* milter connections */
+    int         r_msgs;                 /* messages in progress */
+    struct      timespec r_now;         /* time of the reply */
+};
+
+/* Control listener */
+static struct   mlfiServer control_server;
+
+/* Graceful drain */
+static int      control_drain;          /* milter is draining */
+static int      control_drain_done;     /* milter was stopped */
+static time_t   control_drain_stop;     /* stop milter when it is idle */
+static time_t   control_drain_limit;    /* stop milter anyway */
+
+
+/*
+** CONTROL_COUNT - Count connection and message in progress
+*/
+static void
+control_count(const struct mlfiCtx *mlfi, void *arg)
+{
+    struct      controlReply *r = arg;
+
+    r->r_conns++;
+    if (__atomic_load_n(&mlfi->mlfi_phase, __ATOMIC_RELAXED) != PHASE_IDLE) {
+        r->r_msgs++;
+    }
+}
+
+
+/*
+** CONTROL_SHOW_CTX - Format transaction of the connection
+*/
+static void
+control_show_ctx(const struct mlfiCtx *mlfi, void *arg)
+{
+    struct      controlReply *r = arg;
+    struct      timespec start;
+    int         phase;
+
+    phase = __atomic_load_n(&mlfi->mlfi_phase, __ATOMIC_RELAXED);
+    start.tv_sec = __atomic_load_n(&mlfi->mlfi_phase_start.tv_sec,
+        __ATOMIC_RELAXED);
+    start.tv_nsec = __atomic_load_n(&mlfi->mlfi_phase_start.tv_nsec,
+        __ATOMIC_RELAXED);
+    r->r_rc |= server_printf(&r->r_buf, &r->r_size, &r->r_len,
+        "%-16s %-8s %8.1f %10ld %-4s %-12s %s\n",
+        phase != PHASE_IDLE && mlfi->mlfi_prev_qid[0] != '\0' ?
+            mlfi->mlfi_prev_qid : "-",
+        stats_phase_name(phase),
+        start.tv_sec != 0 ? clock_usec(&start, &r->r_now) / 1e6 : 0.0,
+        phase != PHASE_IDLE ?
+            __atomic_load_n(&mlfi->mlfi_size, __ATOMIC_RELAXED) : 0L,
+        __atomic_load_n(&mlfi->mlfi_max_sem_locked, __ATOMIC_RELAXED) ?
+            "yes" : "no",
+        phase != PHASE_IDLE ? admit_class_name(mlfi->mlfi_class) : "-",
+        mlfi->mlfi_client_host != NULL ? mlfi->mlfi_client_host : "-");
+}
+
+
+/*
+** CONTROL_SHOW - Format table of the transactions
+*/
+static void
+control_show(struct controlReply *r)
+{
+    r->r_rc |= server_printf(&r->r_buf, &r->r_size, &r->r_len,
+        "%-16s %-8s %8s %10s %-4s %-12s %s\n", "QID", "PHASE", "SECONDS",
+        "BYTES", "SLOT", "CLASS", "CLIENT");
+    mlfi_transactions(control_show_ctx, r);
+}
+
+
+/*
+** CONTROL_STATUS - Format settings and counters
+*/
+static void
+control_status(struct controlReply *r)
+{
+    static const char *states[] = { "closed", "open", "half-open" };
+    const char *name;
+    unsigned long opens, rejected;
+    int         limit = 0, used = 0, queued = 0, reserved, state, i;
+
+    mlfi_transactions(control_count, r);
+    if (admit_enabled()) {
+        admit_status(&limit, &used, &queued);
+    }
+    r->r_rc |= server_printf(&r->r_buf, &r->r_size, &r->r_len,
+        "connections %d\n"
+        "messages %d\n"
+        "max_conns %d\n"
+        "used_conns %d\n"
+        "queued %d\n"
+        "max_wait %d\n"
+        "debug %d\n"
+        "draining %s\n",
+        r->r_conns, r->r_msgs,
+        limit, used, queued,
+        __atomic_load_n(&max_wait, __ATOMIC_RELAXED),
+        __atomic_load_n(&debug_level, __ATOMIC_RELAXED) - LOG_WARNING,
+        control_draining() ? "yes" : "no");
+    if (breaker_enabled()) {
+        breaker_status(&state, &opens, &rejected);
+        r->r_rc |= server_printf(&r->r_buf, &r->r_size, &r->r_len,
+            "breaker %s\n", states[state]);
+    }
+    if (admit_class_name(1) == NULL) {
+        return;
+    }
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        admit_class_status(i, &reserved, &used, &queued);
+        r->r_rc |= server_printf(&r->r_buf, &r->r_size, &r->r_len,
+            "class %s reserved %d used %d queued %d\n", name, reserved, used,
+            queued);
+    }
+}
+
+
+/*
+** CONTROL_NUMBER - Convert command argument to non-negative number
+*/
+static int
+control_number(const char *arg, int *value)
+{
+    char       *p;
+    long        n;
+
+    if (arg == NULL) {
+        return -1;
+    }
+    errno = 0;
+    n = strtol(arg, &p, 10);
+    if (errno != 0 || *p != '\0' || p == arg || n < 0 || n > INT_MAX) {
+        return -1;
+    }
+    *value = (int)n;
+    return 0;
+}
+
+
+/*
+** CONTROL_SET - Change setting
+*/
+static const char *
+control_set(const char *name, const char *arg)
+{
+    int         value, min, max;
+    long        target, latency;
+
+    if (name == NULL) {
+        return "missing setting name";
+    }
+    if (control_number(arg, &value) == -1) {
+        return "invalid value";
+    }
+    if (strcmp(name, "max_conns") == 0) {
+        if (!admit_enabled()) {
+            return "max_conns can be changed only when set at startup";
+        }
+        if (adapt_enabled()) {
+            adapt_status(&min, &max, &target, &latency);
+            if (value < min || value > max) {
+                return "max_conns must be within the adaptive limits";
+            }
+        }
+        if (admit_resize(value) == -1) {
+            return "invalid value";
+        }
+    } else if (strcmp(name, "max_wait") == 0) {
+        __atomic_store_n(&max_wait, value, __ATOMIC_RELAXED);
+    } else if (strcmp(name, "debug") == 0) {
+        if (value > LOG_DEBUG - LOG_WARNING) {
+            return "invalid value";
+        }
+        __atomic_store_n(&debug_level, value + LOG_WARNING, __ATOMIC_RELAXED);
+    } else {
+        return "unknown setting";
+    }
+    logmsg(LOG_WARNING, "control: %s set to %d", name, value);
+    return NULL;
+}
+
+
+/*
+** CONTROL_DRAIN_START - Start graceful drain
+**
+** The health status is draining at once, so that the load balancers send
+** no new connections.  After the drain period, the milter is stopped
+** when no message is in progress, or at the latest when the messages
+** could time out.
+*/
+static const char *
+control_drain_start(const char *arg)
+{
+    time_t      now;
+    int         period = CONTROLDRAIN;
+
+    if (arg != NULL && control_number(arg, &period) == -1) {
+        return "invalid drain period";
+    }
+    now = time(NULL);
+    __atomic_store_n(&control_drain_stop, now + period, __ATOMIC_RELAXED);
+    __atomic_store_n(&control_drain_limit, now + period +
+        __atomic_load_n(&max_wait, __ATOMIC_RELAXED) + amavisd_timeout,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&control_drain, 1, __ATOMIC_RELEASE);
+    logmsg(LOG_WARNING, "control: draining, stopping in %d sec", period);
+    return NULL;
+}
+
+
+/*
+** CONTROL_IDLE - Stop milter at the end of the drain
+*/
+static void
+control_idle(void)
+{
+    struct      controlReply r;
+    time_t      now;
+
+    if (!control_draining() || control_drain_done) {
+        return;
+    }
+    now = time(NULL);
+    if (now < __atomic_load_n(&control_drain_stop, __ATOMIC_RELAXED)) {
+        return;
+    }
+    (void) memset(&r, '\0', sizeof(r));
+    mlfi_transactions(control_count, &r);
+    if (r.r_msgs > 0 &&
+        now < __atomic_load_n(&control_drain_limit, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    logmsg(LOG_WARNING, "control: drained, %d messages in progress",
+        r.r_msgs);
+    control_drain_done = 1;
+    (void) smfi_stop();
+}
+
+
+/*
+** CONTROL_SERVE - Execute control command
+**
+** The client sends one command line and reads the reply until the end of
+** the connection.  The reply of a failed command starts with "error:".
+*/
+static void
+control_serve(int sd)
+{
+    struct      controlReply r;
+    char        req[MAXLOGBUF];
+    const char *cmd, *err = NULL;
+    char       *last;
+
+    if (server_read(sd, req, sizeof(req), 1) == -1) {
+        return;
+    }
+    (void) memset(&r, '\0', sizeof(r));
+    r.r_size = 4096;
+    if ((r.r_buf = malloc(r.r_size)) == NULL) {
+        logmsg(LOG_ERR, "could not allocate memory");
+        return;
+    }
+    clock_now(&r.r_now);
+
+    cmd = strtok_r(req, " \t\r\n", &last);
+    if (cmd == NULL) {
+        err = "missing command";
+    } else if (strcmp(cmd, "show") == 0) {
+        control_show(&r);
+    } else if (strcmp(cmd, "status") == 0) {
+        control_status(&r);
+    } else if (strcmp(cmd, "set") == 0) {
+        cmd = strtok_r(NULL, " \t\r\n", &last);
+        err = control_set(cmd, strtok_r(NULL, " \t\r\n", &last));
+    } else if (strcmp(cmd, "drain") == 0) {
+        err = control_drain_start(strtok_r(NULL, " \t\r\n", &last));
+    } else {
+        err = "unknown command";
+    }
+
+    if (r.r_rc == -1) {
+        err = "could not format reply";
+    }
+    if (err != NULL) {
+        r.r_len = 0;
+        r.r_rc = server_printf(&r.r_buf, &r.r_size, &r.r_len, "error: %s\n",
+            err);
+    } else if (r.r_len == 0) {
+        r.r_rc = server_printf(&r.r_buf, &r.r_size, &r.r_len, "ok\n");
+    }
+    if (r.r_rc == 0) {
+        (void) write_sock(sd, r.r_buf, r.r_len, SERVER_TIMEOUT);
+    }
+    free(r.r_buf);
+}
+
+
+/*
+** CONTROL_DRAINING - Check if the milter is draining
+*/
+int
+control_draining(void)
+{
+    return __atomic_load_n(&control_drain, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+** CONTROL_OPEN - Open control socket
+*/
+int
+control_open(void)
+{
+    if (control_socket == NULL) {
+        return 0;
+    }
+    if (worker_enabled()) {
+        logmsg(LOG_ERR, "control socket cannot be used with workers");
+        return -1;
+    }
+    control_server.s_name = "control";
+    control_server.s_socket = control_socket;
+    control_server.s_handler = control_serve;
+    control_server.s_idle = control_idle;
+    return server_open(&control_server);
+}
+
+
+/*
+** CONTROL_START - Start accepting control commands
+*/
+int
+control_start(void)
+{
+    if (control_socket == NULL) {
+        return 0;
+    }
+    return server_start(&control_server);
+}
+
+
+/*
+** CONTROL_STOP - Stop accepting control commands
+*/
+void
+control_stop(void)
+{
+    if (control_socket != NULL) {
+        server_stop(&control_server);
+    }
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+
+/*
+** Dates and months abbreviations
+*/
+static const char *days[] =
+{
+    "Sun",
+    "Mon",
+    "Tue",
+    "Wed",
+    "Thu",
+    "Fri",
+    "Sat"
+};
+
+static const char *months[] =
+{
+    "Jan",
+    "Feb",
+    "Mar",
+    "Apr",
+    "May",
+    "Jun",
+    "Jul",
+    "Aug",
+    "Sep",
+    "Oct",
+    "Nov",
+    "Dec"
+};
+
+
+/* Cached date words */
+#define DATEWORDS       (MAXDATELEN / sizeof(unsigned long))
+
+/*
+** Cached date
+**
+** The date is a seqlock: the writer makes the sequence number odd, updates
+** the date and makes it even again.  Readers copy the date word by word and
+** retry when the sequence number was odd or has changed meanwhile.
+*/
+static struct {
+    unsigned long d_seq;                /* sequence number */
+    time_t      d_time;                 /* cached second */
+    time_t      d_tzcheck;              /* next timezone check */
+    int         d_gmtoff;               /* UTC offset in minutes */
+    unsigned long d_date[DATEWORDS];    /* formatted date */
+} date_cache;
+
+
+/*
+** DATE_REFRESH - Format the date of the given second into the cache
+**
+** Only one thread refreshes the cache, the others keep reading it
+*/
+static void
+date_refresh(time_t t, unsigned long seq)
+{
+    struct      tm gt, lt;
+    int         gmtoff;
+    unsigned long date[DATEWORDS];
+    unsigned int i;
+
+    /* Take the writer's side of the seqlock */
+    if (!__atomic_compare_exchange_n(&date_cache.d_seq, &seq, seq + 1, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    /* Reload timezone rules occasionally, localtime_r() does not do it */
+    if (t >= date_cache.d_tzcheck || t < date_cache.d_tzcheck - DATETZCHECK) {
+        tzset();
+        date_cache.d_tzcheck = t + DATETZCHECK;
+    }
+
+    /* Calculate UTC offset */
+    (void) gmtime_r(&t, &gt);
+    (void) localtime_r(&t, &lt);
+    gmtoff = (lt.tm_hour - gt.tm_hour) * 60 + lt.tm_min - gt.tm_min;
+    if (lt.tm_year < gt.tm_year) {
+        gmtoff -= 24 * 60;
+    } else if (lt.tm_year > gt.tm_year) {
+        gmtoff += 24 * 60;
+    } else if (lt.tm_yday < gt.tm_yday) {
+        gmtoff -= 24 * 60;
+    } else if (lt.tm_yday > gt.tm_yday) {
+        gmtoff += 24 * 60;
+    }
+    if (lt.tm_sec <= gt.tm_sec - 60) {
+        gmtoff -= 1;
+    } else if (lt.tm_sec >= gt.tm_sec + 60) {
+        gmtoff += 1;
+    }
+
+    /* Format date */
+    (void) memset(date, '\0', sizeof(date));
+    (void) snprintf((char *)date, sizeof(date),
+#ifdef HAVE_STRUCT_TM_TM_ZONE
+        "%s, %d %s %d %02d:%02d:%02d %+03d%02d (%s)",
+#else
+        "%s, %d %s %d %02d:%02d:%02d %+03d%02d",
+#endif
+        days[lt.tm_wday], lt.tm_mday, months[lt.tm_mon],
+        lt.tm_year + 1900, lt.tm_hour, lt.tm_min, lt.tm_sec,
+        (int) gmtoff / 60, (int) abs(gmtoff) % 60
+#ifdef HAVE_STRUCT_TM_TM_ZONE
+        , lt.tm_zone
+#endif
+        );
+
+    /* Publish the new date */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < DATEWORDS; i++) {
+        __atomic_store_n(&date_cache.d_date[i], date[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&date_cache.d_gmtoff, gmtoff, __ATOMIC_RELAXED);
+    __atomic_store_n(&date_cache.d_time, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&date_cache.d_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+** DATE_RFC2822 - Get current date in RFC 2822 format
+**
+** date_rfc2822() copies the cached date to the buffer, which must be at
+** least MAXDATELEN bytes long, and optionally returns the UTC offset in
+** minutes.  The cache is refreshed once per second.
+*/
+const char *
+date_rfc2822(char *buf, int *gmtoff)
+{
+    unsigned long seq;
+    unsigned long date[DATEWORDS];
+    time_t      t, now;
+    int         off;
+    unsigned int i;
+
+    now = time(NULL);
+    for (;;) {
+        seq = __atomic_load_n(&date_cache.d_seq, __ATOMIC_ACQUIRE);
+        if ((seq & 1) != 0) {
+            continue;
+        }
+        t = __atomic_load_n(&date_cache.d_time, __ATOMIC_RELAXED);
+        off = __atomic_load_n(&date_cache.d_gmtoff, __ATOMIC_RELAXED);
+        for (i = 0; i < DATEWORDS; i++) {
+            date[i] = __atomic_load_n(&date_cache.d_date[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&date_cache.d_seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        /* A thread which read the clock later may have refreshed it */
+        if (t < now || t > now + 1) {
+            date_refresh(now, seq);
+            continue;
+        }
+        break;
+    }
+
+    (void) memcpy(buf, date, MAXDATELEN);
+    buf[MAXDATELEN - 1] = '\0';
+    if (gmtoff != NULL) {
+        *gmtoff = off;
+    }
+    return buf;
+}
+
+
+/*
+** CLOCK_NOW - Get monotonic time
+*/
+void
+clock_now(struct timespec *ts)
+{
+    struct      timeval tv;
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    if (clock_gettime(CLOCK_MONOTONIC, ts) == 0) {
+        return;
+    }
+#endif
+    (void) gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+}
+
+
+/*
+** CLOCK_USEC - Get microseconds elapsed between two times
+*/
+long
+clock_usec(const struct timespec *start, const struct timespec *end)
+{
+    long        usec;
+
+    usec = (long)(end->tv_sec - start->tv_sec) * 1000000L +
+        (end->tv_nsec - start->tv_nsec) / 1000;
+    return usec > 0 ? usec : 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+
+/*
+** Early rejection at overload
+**
+** At MAIL FROM, the wait for an amavisd connection is predicted from the
+** free connections, the messages waiting in the queue and the recent scan
+** time, or the recent waits.  When the predicted wait exceeds early_enter
+** percent of max_wait, the new messages are rejected until it falls below
+** early_leave percent, so that the milter does not flap between the
+** states.  Messages which can use a free reserved connection of their
+** admission class are not rejected.
+*/
+static pthread_mutex_t early_lock = PTHREAD_MUTEX_INITIALIZER;
+static int      early_enter;            /* start rejecting in percent */
+static int      early_leave;            /* stop rejecting in percent */
+static const char *early_code = "451";  /* SMTP reply code */
+static int      early_overload;         /* messages are rejected */
+static long     early_wait;             /* last predicted wait in usec */
+static unsigned long early_rejected;    /* rejected messages */
+
+
+/*
+** EARLY_PARSE - Parse early rejection thresholds
+**
+** The thresholds are specified as enter[:leave[:code]] in percent of
+** max_wait, where code is 421 or 451.  early_parse() returns -1 when the
+** specification is not valid.
+*/
+int
+early_parse(const char *spec)
+{
+    long        enter, leave;
+    char       *end;
+
+    enter = strtol(spec, &end, 10);
+    if (end == spec || (*end != '\0' && *end != ':') || enter <= 0 ||
+        enter > 1000)
+    {
+        return -1;
+    }
+    leave = enter / 2;
+    if (*end == ':') {
+        spec = end + 1;
+        leave = strtol(spec, &end, 10);
+        if (end == spec || (*end != '\0' && *end != ':') || leave < 0 ||
+            leave > enter)
+        {
+            return -1;
+        }
+    }
+    if (*end == ':') {
+        spec = end + 1;
+        if (strcmp(spec, "421") == 0) {
+            early_code = "421";
+        } else if (strcmp(spec, "451") == 0) {
+            early_code = "451";
+        } else {
+            return -1;
+        }
+    }
+    early_enter = (int) enter;
+    early_leave = (int) leave;
+    return 0;
+}
+
+
+/*
+** EARLY_INIT - Check early rejection
+**
+** early_init() returns -1 when the number of amavisd connections is not
+** limited
+*/
+int
+early_init(void)
+{
+    if (early_enter != 0 && !admit_enabled()) {
+        logmsg(LOG_ERR, "early rejection requires max-conns");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** EARLY_ENABLED - Check if early rejection is enabled
+*/
+int
+early_enabled(void)
+{
+    return early_enter != 0;
+}
+
+
+/*
+** EARLY_PREDICT - Predict wait for amavisd connection in usec
+**
+** Without a free connection, the queue drains at limit / scan time
+** messages per second.  The recent waits are used only until a scan time
+** is known, because they lag behind the queue.
+*/
+static long
+early_predict(void)
+{
+    long        scan;
+    int         limit, used, queued;
+
+    admit_status(&limit, &used, &queued);
+    if (used < limit && queued == 0) {
+        return 0;
+    }
+    if ((scan = stats_scan_mean()) == 0 || limit == 0) {
+        return stats_wait_quantile(EARLYQUANTILE);
+    }
+    return (queued + 1) * scan / limit;
+}
+
+
+/*
+** EARLY_REJECT - Check if message should be rejected at overload
+*/
+int
+early_reject(struct mlfiCtx *mlfi)
+{
+    long        wait, limit;
+    int         overload, reserved, used, queued;
+
+    wait = early_predict();
+    limit = __atomic_load_n(&max_wait, __ATOMIC_RELAXED) * 1000000L;
+    (void) pthread_mutex_lock(&early_lock);
+    early_wait = wait;
+    if (!early_overload && wait > limit / 100 * early_enter) {
+        early_overload = 1;
+        logmsg(LOG_WARNING, "overload: predicted wait for amavisd connection "
+            "%ld ms, rejecting new messages", wait / 1000);
+    } else if (early_overload && wait < limit / 100 * early_leave) {
+        early_overload = 0;
+        logmsg(LOG_WARNING, "overload is over: predicted wait for amavisd "
+            "connection %ld ms", wait / 1000);
+    }
+    overload = early_overload;
+    (void) pthread_mutex_unlock(&early_lock);
+    if (!overload) {
+        return 0;
+    }
+
+    /* Free reserved connection of the admission class */
+    admit_class_status(mlfi->mlfi_class, &reserved, &used, &queued);
+    if (used < reserved) {
+        return 0;
+    }
+    __atomic_add_fetch(&early_rejected, 1, __ATOMIC_RELAXED);
+    logqidmsg(mlfi, LOG_NOTICE, "rejected at overload");
+    return 1;
+}
+
+
+/*
+** EARLY_REPLY_CODE - Get SMTP reply code of rejected messages
+*/
+const char *
+early_reply_code(void)
+{
+    return early_code;
+}
+
+
+/*
+** EARLY_STATUS - Get overload state, last predicted wait and rejected
+**                messages
+*/
+void
+early_status(int *overload, long *wait, unsigned long *rejected)
+{
+    (void) pthread_mutex_lock(&early_lock);
+    *overload = early_overload;
+    *wait = early_wait;
+    (void) pthread_mutex_unlock(&early_lock);
+    *rejected = __atomic_load_n(&early_rejected, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+
+
+/* Fairness rule keys */
+#define FAIR_CLIENT     1       /* client address or network */
+#define FAIR_DOMAIN     2       /* sender domain */
+
+/* Fairness rule */
+struct fairRule {
+    char       *f_name;                 /* rule key */
+    int         f_type;                 /* key type */
+    int         f_prefix4;              /* IPv4 prefix length */
+    int         f_prefix6;              /* IPv6 prefix length */
+    int         f_conns;                /* max messages in progress */
+    double      f_rate;                 /* messages per second */
+    double      f_burst;                /* bucket size */
+    unsigned long f_conns_throttled;    /* messages over f_conns */
+    unsigned long f_rate_throttled;     /* messages over f_rate */
+};
+
+/* Fairness table entry */
+struct fairEntry {
+    struct      fairEntry *e_next;      /* next entry in the bucket */
+    struct      fairEntry *e_older;     /* less recently used entry */
+    struct      fairEntry *e_newer;     /* more recently used entry */
+    unsigned int e_hash;                /* key hash */
+    int         e_inflight;             /* messages in progress */
+    double      e_tokens;               /* available tokens */
+    double      e_stamp;                /* last token refill */
+    size_t      e_keylen;               /* key length */
+    unsigned char e_key[FAIRKEYLEN];    /* rule and key */
+};
+
+/* Fairness table stripe */
+struct fairStripe {
+    pthread_mutex_t s_lock;             /* stripe lock */
+    struct      fairEntry *s_buckets[FAIRENTRIES / FAIRSTRIPES];
+    struct      fairEntry *s_newest;    /* most recently used entry */
+    struct      fairEntry *s_oldest;    /* least recently used entry */
+    struct      fairEntry *s_free;      /* unused entries */
+    int         s_used;                 /* used entries */
+};
+
+/*
+** Per-client and per-sender domain fairness
+**
+** Every rule limits the messages in progress and the message rate (token
+** bucket) per client network or per sender domain.  The keys are kept in
+** a hash table of FAIRENTRIES entries, which is split into FAIRSTRIPES
+** stripes with their own locks and LRU lists.  When a stripe is full, its
+** least recently used entry without messages in progress is reused.  When
+** there is no such entry, the message is not limited.
+*/
+static int      fair_nrules;            /* number of rules */
+static struct   fairRule fair_rules[FAIRRULES];
+static struct   fairStripe *fair_stripes; /* hash table stripes */
+static struct   fairEntry *fair_pool;   /* table entries */
+static int      fair_at = FAIR_FROM;    /* stage of the reply */
+static char    *fair_spec;              /* reply specification */
+static const char *fair_rcode = "451";  /* SMTP reply code */
+static const char *fair_xcode = "4.7.1"; /* extended reply code */
+static const char *fair_reason = "Too many messages, try again later";
+
+
+/*
+** FAIR_NOW - Get monotonic time in seconds
+*/
+static double
+fair_now(void)
+{
+    struct      timespec now;
+
+    clock_now(&now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+/*
+** FAIR_HASH - Compute FNV-1a hash of the key
+*/
+static unsigned int
+fair_hash(const unsigned char *key, size_t len)
+{
+    unsigned int h = 2166136261U;
+
+    while (len-- > 0) {
+        h = (h ^ *key++) * 16777619U;
+    }
+    return h;
+}
+
+
+/*
+** FAIR_UNLINK - Remove entry from the bucket and from the LRU list
+**
+** fair_unlink() must be called with the stripe locked
+*/
+static void
+fair_unlink(struct fairStripe *s, struct fairEntry *e)
+{
+    struct      fairEntry **p;
+
+    p = &s->s_buckets[(e->e_hash / FAIRSTRIPES) %
+        (FAIRENTRIES / FAIRSTRIPES)];
+    while (*p != e) {
+        p = &(*p)->e_next;
+    }
+    *p = e->e_next;
+    if (e->e_older != NULL) {
+        e->e_older->e_newer = e->e_newer;
+    } else {
+        s->s_oldest = e->e_newer;
+    }
+    if (e->e_newer != NULL) {
+        e->e_newer->e_older = e->e_older;
+    } else {
+        s->s_newest = e->e_older;
+    }
+    s->s_used--;
+}
+
+
+/*
+** FAIR_LOOKUP - Find or add entry for the key
+**
+** fair_lookup() must be called with the stripe locked.  It returns NULL
+** when the stripe is full of entries with messages in progress.
+*/
+static struct fairEntry *
+fair_lookup(struct fairStripe *s, unsigned int hash, const unsigned char *key,
+    size_t len, double burst, double now)
+{
+    struct      fairEntry **bucket, *e;
+
+    bucket = &s->s_buckets[(hash / FAIRSTRIPES) % (FAIRENTRIES / FAIRSTRIPES)];
+    for (e = *bucket; e != NULL; e = e->e_next) {
+        if (e->e_hash == hash && e->e_keylen == len &&
+            memcmp(e->e_key, key, len) == 0)
+        {
+            break;
+        }
+    }
+    if (e != NULL) {
+        fair_unlink(s, e);
+    } else {
+        /* Take free entry or reuse the least recently used idle one */
+        if ((e = s->s_free) != NULL) {
+            s->s_free = e->e_next;
+        } else {
+            for (e = s->s_oldest; e != NULL && e->e_inflight > 0;
+                e = e->e_newer)
+            {
+                continue;
+            }
+            if (e == NULL) {
+                return NULL;
+            }
+            fair_unlink(s, e);
+        }
+        e->e_hash = hash;
+        e->e_inflight = 0;
+        e->e_tokens = burst;
+        e->e_stamp = now;
+        e->e_keylen = len;
+        (void) memcpy(e->e_key, key, len);
+    }
+
+    /* Insert as the most recently used entry */
+    e->e_next = *bucket;
+    *bucket = e;
+    e->e_older = s->s_newest;
+    e->e_newer = NULL;
+    if (s->s_newest != NULL) {
+        s->s_newest->e_newer = e;
+    } else {
+        s->s_oldest = e;
+    }
+    s->s_newest = e;
+    s->s_used++;
+    return e;
+}
+
+
+/*
+** FAIR_PUT - Return message of the entry
+*/
+static void
+fair_put(struct fairEntry *e, int refund)
+{
+    struct      fairStripe *s = &fair_stripes[e->e_hash % FAIRSTRIPES];
+
+    (void) pthread_mutex_lock(&s->s_lock);
+    e->e_inflight--;
+    if (refund) {
+        e->e_tokens += 1;
+    }
+    (void) pthread_mutex_unlock(&s->s_lock);
+}
+
+
+/*
+** FAIR_KEY - Make key of the message for the rule
+**
+** fair_key() returns the key length or 0 when the rule does not apply
+*/
+static size_t
+fair_key(struct mlfiCtx *mlfi, int rule, unsigned char *key)
+{
+    const struct fairRule *f = &fair_rules[rule];
+    struct      mlfiNet net;
+    const char *p;
+    size_t      len = 0;
+
+    key[len++] = (unsigned char) rule;
+    if (f->f_type == FAIR_CLIENT) {
+        net = mlfi->mlfi_client_net;
+        switch (net.n_family) {
+        case AF_INET:
+            net_mask(&net, f->f_prefix4);
+            break;
+#if HAVE_DECL_AF_INET6 && HAVE_STRUCT_SOCKADDR_IN6
+        case AF_INET6:
+            net_mask(&net, f->f_prefix6);
+            break;
+#endif
+        default:
+            return 0;
+        }
+        key[len++] = (unsigned char) net.n_family;
+        (void) memcpy(key + len, net.n_addr, sizeof(net.n_addr));
+        return len + sizeof(net.n_addr);
+    }
+
+    /* Domain of <user@domain> */
+    if (mlfi->mlfi_from == NULL ||
+        (p = strrchr(mlfi->mlfi_from, '@')) == NULL)
+    {
+        return 0;
+    }
+    for (p++; *p != '\0' && *p != '>' && len < FAIRKEYLEN; p++) {
+        key[len++] = (unsigned char) tolower((unsigned char) *p);
+    }
+    return len > 1 ? len : 0;
+}
+
+
+/*
+** FAIR_ADD - Add fairness rule
+**
+** The rule is specified as key:conns[:rate[:burst]], where key is
+** client[/prefix4[/prefix6]] or domain, conns is the maximum number of
+** messages in progress and rate is the maximum number of messages per
+** second.  Zero means no limit.  fair_add() returns -1 when the
+** specification is not valid.
+*/
+int
+fair_add(const char *spec)
+{
+    struct      fairRule *f;
+    char       *name, *conns, *rate, *burst, *slash, *prefix, *end, *last;
+
+    if (fair_nrules >= FAIRRULES || (name = strdup(spec)) == NULL) {
+        return -1;
+    }
+    f = &fair_rules[fair_nrules];
+    (void) memset(f, '\0', sizeof(*f));
+    f->f_name = name;
+    name = strtok_r(name, ":", &last);
+    conns = strtok_r(NULL, ":", &last);
+    rate = strtok_r(NULL, ":", &last);
+    burst = strtok_r(NULL, "", &last);
+    if (name == NULL || conns == NULL) {
+        return -1;
+    }
+    f->f_prefix4 = 32;
+    f->f_prefix6 = 128;
+    if ((slash = strchr(name, '/')) != NULL) {
+        *slash = '\0';
+        prefix = slash + 1;
+        f->f_prefix4 = (int) strtol(prefix, &end, 10);
+        if (end == prefix || (*end != '\0' && *end != '/') ||
+            f->f_prefix4 < 0 || f->f_prefix4 > 32)
+        {
+            return -1;
+        }
+        if (*end == '/') {
+            prefix = end + 1;
+            f->f_prefix6 = (int) strtol(prefix, &end, 10);
+            if (end == prefix || *end != '\0' || f->f_prefix6 < 0 ||
+                f->f_prefix6 > 128)
+            {
+                return -1;
+            }
+        }
+    }
+    if (strcasecmp(name, "client") == 0) {
+        f->f_type = FAIR_CLIENT;
+    } else if (strcasecmp(name, "domain") == 0 && slash == NULL) {
+        f->f_type = FAIR_DOMAIN;
+    } else {
+        return -1;
+    }
+    f->f_conns = (int) strtol(conns, &end, 10);
+    if (end == conns || *end != '\0' || f->f_conns < 0) {
+        return -1;
+    }
+    if (rate != NULL) {
+        f->f_rate = strtod(rate, &end);
+        if (end == rate || *end != '\0' || !(f->f_rate >= 0)) {
+            return -1;
+        }
+    }
+    f->f_burst = MAX(f->f_rate, 1);
+    if (burst != NULL) {
+        f->f_burst = strtod(burst, &end);
+        if (end == burst || *end != '\0' || !(f->f_burst >= 1)) {
+            return -1;
+        }
+    }
+    if (f->f_conns == 0 && f->f_rate == 0) {
+        return -1;
+    }
+
+    /* Keep the rule key for statistics and logs */
+    if (slash != NULL) {
+        *slash = '/';
+    }
+    fair_nrules++;
+    return 0;
+}
+
+
+/*
+** FAIR_REPLY - Set stage and text of the reply to throttled messages
+**
+** The reply is specified as from|rcpt[:code xcode text], where code must
+** be 4XX.  fair_reply() returns -1 when the specification is not valid.
+*/
+int
+fair_reply(const char *spec)
+{
+    char       *stage, *rcode, *xcode, *reason, *last;
+
+    free(fair_spec);
+    if ((fair_spec = strdup(spec)) == NULL) {
+        return -1;
+    }
+    stage = strtok_r(fair_spec, ":", &last);
+    if (stage == NULL) {
+        return -1;
+    }
+    if (strcasecmp(stage, "from") == 0) {
+        fair_at = FAIR_FROM;
+    } else if (strcasecmp(stage, "rcpt") == 0) {
+        fair_at = FAIR_RCPT;
+    } else {
+        return -1;
+    }
+    if (*last == '\0') {
+        return 0;
+    }
+    rcode = strtok_r(NULL, " ", &last);
+    xcode = strtok_r(NULL, " ", &last);
+    reason = strtok_r(NULL, "", &last);
+    if (rcode == NULL || xcode == NULL || reason == NULL ||
+        rcode[0] != '4' || strlen(rcode) != 3 || xcode[0] != '4' ||
+        xcode[1] != '.')
+    {
+        return -1;
+    }
+    fair_rcode = rcode;
+    fair_xcode = xcode;
+    fair_reason = reason;
+    return 0;
+}
+
+
+/*
+** FAIR_INIT - Allocate fairness table
+**
+** fair_init() returns -1 when the rules cannot be used or the table cannot
+** be allocated.  The table is not shared by the worker processes.
+*/
+int
+fair_init(void)
+{
+    struct      fairStripe *s;
+    int         i, j, n = FAIRENTRIES / FAIRSTRIPES;
+
+    if (fair_nrules == 0) {
+        return 0;
+    }
+    if (worker_enabled()) {
+        logmsg(LOG_ERR, "fairness rules cannot be used with workers");
+        return -1;
+    }
+    if ((fair_stripes = calloc(FAIRSTRIPES, sizeof(*fair_stripes))) == NULL ||
+        (fair_pool = calloc(FAIRENTRIES, sizeof(*fair_pool))) == NULL)
+    {
+        logmsg(LOG_ERR, "could not allocate fairness table");
+        return -1;
+    }
+    for (i = 0; i < FAIRSTRIPES; i++) {
+        s = &fair_stripes[i];
+        (void) pthread_mutex_init(&s->s_lock, NULL);
+        for (j = n - 1; j >= 0; j--) {
+            fair_pool[i * n + j].e_next = s->s_free;
+            s->s_free = &fair_pool[i * n + j];
+        }
+    }
+    return 0;
+}
+
+
+/*
+** FAIR_FREE - Free fairness table and rules
+*/
+void
+fair_free(void)
+{
+    int         i;
+
+    if (fair_stripes != NULL) {
+        for (i = 0; i < FAIRSTRIPES; i++) {
+            (void) pthread_mutex_destroy(&fair_stripes[i].s_lock);
+        }
+    }
+    free(fair_stripes);
+    free(fair_pool);
+    fair_stripes = NULL;
+    fair_pool = NULL;
+    for (i = 0; i < fair_nrules; i++) {
+        free(fair_rules[i].f_name);
+    }
+    fair_nrules = 0;
+}
+
+
+/*
+** FAIR_ENABLED - Check if there are fairness rules
+*/
+int
+fair_enabled(void)
+{
+    return fair_stripes != NULL;
+}
+
+
+/*
+** FAIR_ACQUIRE - Count message of the client and sender domain
+**
+** fair_acquire() returns -1 when the message exceeds a rule, then the
+** message is not counted by any rule.
+*/
+int
+fair_acquire(struct mlfiCtx *mlfi)
+{
+    struct      fairRule *f;
+    struct      fairStripe *s;
+    struct      fairEntry *e;
+    struct      mlfiNet net;
+    unsigned char key[FAIRKEYLEN + 1];
+    char        buf[INET6_ADDRSTRLEN + 8];
+    unsigned int hash;
+    size_t      len;
+    double      now = fair_now();
+    int         i, inflight = 0, rc = 0;
+
+    for (i = 0; i < fair_nrules && rc == 0; i++) {
+        f = &fair_rules[i];
+        if ((len = fair_key(mlfi, i, key)) == 0) {
+            continue;
+        }
+        hash = fair_hash(key, len);
+        s = &fair_stripes[hash % FAIRSTRIPES];
+        (void) pthread_mutex_lock(&s->s_lock);
+        if ((e = fair_lookup(s, hash, key, len, f->f_burst, now)) != NULL) {
+            if (f->f_rate > 0) {
+                e->e_tokens = MIN(f->f_burst,
+                    e->e_tokens + (now - e->e_stamp) * f->f_rate);
+                e->e_stamp = now;
+            }
+            if (f->f_conns > 0 && e->e_inflight >= f->f_conns) {
+                inflight = e->e_inflight;
+                rc = -1;
+            } else if (f->f_rate > 0 && e->e_tokens < 1) {
+                rc = -1;
+            } else {
+                e->e_inflight++;
+                if (f->f_rate > 0) {
+                    e->e_tokens -= 1;
+                }
+                mlfi->mlfi_fair[i] = e;
+            }
+        }
+        (void) pthread_mutex_unlock(&s->s_lock);
+    }
+    if (rc == 0) {
+        return 0;
+    }
+
+    /* Throttled by rule i - 1 */
+    f = &fair_rules[--i];
+    if (inflight > 0) {
+        __atomic_add_fetch(&f->f_conns_throttled, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&f->f_rate_throttled, 1, __ATOMIC_RELAXED);
+    }
+    if (f->f_type == FAIR_CLIENT) {
+        net = mlfi->mlfi_client_net;
+        net_mask(&net, net.n_family == AF_INET ? f->f_prefix4 : f->f_prefix6);
+        (void) net_ntop(&net, buf, sizeof(buf));
+    } else {
+        key[len] = '\0';
+        (void) strlcpy(buf, (const char *)key + 1, sizeof(buf));
+    }
+    if (inflight > 0) {
+        logqidmsg(mlfi, LOG_WARNING,
+            "%s %s throttled: %d messages in progress", f->f_name, buf,
+            inflight);
+    } else {
+        logqidmsg(mlfi, LOG_WARNING,
+            "%s %s throttled: over %g messages per second", f->f_name, buf,
+            f->f_rate);
+    }
+    while (i-- > 0) {
+        if ((e = mlfi->mlfi_fair[i]) != NULL) {
+            fair_put(e, fair_rules[i].f_rate > 0);
+            mlfi->mlfi_fair[i] = NULL;
+        }
+    }
+    return -1;
+}
+
+
+/*
+** FAIR_RELEASE - Uncount message of the client and sender domain
+*/
+void
+fair_release(struct mlfiCtx *mlfi)
+{
+    int         i;
+
+    for (i = 0; i < fair_nrules; i++) {
+        if (mlfi->mlfi_fair[i] != NULL) {
+            fair_put(mlfi->mlfi_fair[i], 0);
+            mlfi->mlfi_fair[i] = NULL;
+        }
+    }
+}
+
+
+/*
+** FAIR_STAGE - Get stage of the reply to throttled messages
+*/
+int
+fair_stage(void)
+{
+    return fair_at;
+}
+
+
+/*
+** FAIR_REPLY_TEXT - Get reply to throttled messages
+*/
+void
+fair_reply_text(const char **rcode, const char **xcode, const char **reason)
+{
+    *rcode = fair_rcode;
+    *xcode = fair_xcode;
+    *reason = fair_reason;
+}
+
+
+/*
+** FAIR_RULE_NAME - Get key of the fairness rule or NULL
+*/
+const char *
+fair_rule_name(int rule)
+{
+    return rule >= 0 && rule < fair_nrules ? fair_rules[rule].f_name : NULL;
+}
+
+
+/*
+** FAIR_RULE_STATUS - Get messages throttled by the rule
+*/
+void
+fair_rule_status(int rule, unsigned long *conns, unsigned long *rate)
+{
+    *conns = __atomic_load_n(&fair_rules[rule].f_conns_throttled,
+        __ATOMIC_RELAXED);
+    *rate = __atomic_load_n(&fair_rules[rule].f_rate_throttled,
+        __ATOMIC_RELAXED);
+}
+
+
+/*
+** FAIR_ENTRIES - Get number of used fairness table entries
+*/
+int
+fair_entries(void)
+{
+    int         i, n = 0;
+
+    for (i = 0; i < FAIRSTRIPES; i++) {
+        (void) pthread_mutex_lock(&fair_stripes[i].s_lock);
+        n += fair_stripes[i].s_used;
+        (void) pthread_mutex_unlock(&fair_stripes[i].s_lock);
+    }
+    return n;
+}
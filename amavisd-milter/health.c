@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+#include <sys/socket.h>
+
+
+/* Health listener */
+static struct   mlfiServer health_server;
+
+
+/*
+** HEALTH_PROBE - Check if amavisd accepts connections
+**
+** The probe is used only when no message was sent to amavisd recently
+*/
+static void
+health_probe(void)
+{
+    struct      sockaddr_un sock;
+    int         sd;
+
+    (void) memset(&sock, '\0', sizeof(sock));
+    sock.sun_family = AF_UNIX;
+    (void) strlcpy(sock.sun_path, amavisd_socket, sizeof(sock.sun_path));
+    if ((sd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return;
+    }
+    stats_connect(connect(sd, (struct sockaddr *)&sock, sizeof(sock)) == 0);
+    (void) close(sd);
+}
+
+
+/*
+** HEALTH_SERVE - Serve health status to client
+**
+** The status is ready (200), degraded (429) when there is no free amavisd
+** connection or the recent wait for it is long, or unavailable (503) when
+** amavisd does not accept connections or the wait approaches max_wait.
+** While the milter is draining, the status is draining (503).
+*/
+static void
+health_serve(int sd)
+{
+    char        req[MAXLOGBUF];
+    char        body[256];
+    const char *status, *code;
+    time_t      ok, fail, now;
+    long        wait;
+    int         free_conns = -1, limit, used, queued, up, len;
+
+    if (server_read(sd, req, sizeof(req), 0) == -1) {
+        return;
+    }
+
+    /* Check amavisd */
+    now = time(NULL);
+    stats_connect_time(&ok, &fail);
+    if (now - MAX(ok, fail) >= HEALTHPROBE) {
+        health_probe();
+        stats_connect_time(&ok, &fail);
+    }
+    up = ok >= fail;
+
+    /* Check amavisd connections */
+    wait = stats_wait_quantile(99);
+    if (admit_enabled()) {
+        admit_status(&limit, &used, &queued);
+        free_conns = MAX(limit - used, 0);
+    }
+
+    if (control_draining()) {
+        status = "draining";
+        code = "503 Service Unavailable";
+    } else if (!up || (free_conns == 0 &&
+        wait >= __atomic_load_n(&max_wait, __ATOMIC_RELAXED) * 1000000L / 2))
+    {
+        status = "unavailable";
+        code = "503 Service Unavailable";
+    } else if (free_conns == 0 || wait >= HEALTHWAIT) {
+        status = "degraded";
+        code = "429 Too Many Requests";
+    } else {
+        status = "ready";
+        code = "200 OK";
+    }
+
+    len = snprintf(body, sizeof(body),
+        "%s amavisd=%s free_conns=%d wait_p99_ms=%ld\n", status,
+        up ? "up" : "down", free_conns, wait == LONG_MAX ? -1 : wait / 1000);
+    (void) server_http_reply(sd, code, "text/plain", body, len);
+}
+
+
+/*
+** HEALTH_OPEN - Open health socket
+*/
+int
+health_open(void)
+{
+    if (health_socket == NULL) {
+        return 0;
+    }
+    health_server.s_name = "health";
+    health_server.s_socket = health_socket;
+    health_server.s_handler = health_serve;
+    return server_open(&health_server);
+}
+
+
+/*
+** HEALTH_START - Start serving health status
+*/
+int
+health_start(void)
+{
+    if (health_socket == NULL) {
+        return 0;
+    }
+    return server_start(&health_server);
+}
+
+
+/*
+** HEALTH_STOP - Stop serving health status
+*/
+void
+health_stop(void)
+{
+    if (health_socket != NULL) {
+        server_stop(&health_server);
+    }
+}
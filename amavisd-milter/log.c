@@ -28,56 +28,538 @@
 
 #include "amavisd-milter.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <time.h>
 
 
 /*
-** LOGMSG - Print log message
+** Asynchronous log queue
+**
+** The queue is a bounded multi-producer ring.  A producer claims a record
+** by advancing log_head with compare-and-swap, formats the message into it
+** and publishes it by setting the record sequence number.  The only
+** consumer, the logger thread, writes published records in batches.
+**
+** log_writers counts the producers between the check of log_running and
+** the publication of their record.  When the queue is stopped, log_running
+** is cleared first and the logger thread exits only when there are no
+** producers left and all claimed records were written.
 */
-void
-logmsg(int priority, const char *fmt, ...)
+struct logRecord {
+    unsigned long r_seq;                /* record sequence number */
+    int         r_priority;             /* message priority */
+    char        r_msg[MAXLOGBUF];       /* formatted message */
+};
+
+static struct   logRecord log_ring[LOGQUEUE];
+static unsigned long log_head;          /* next record to claim */
+static unsigned long log_tail;          /* next record to write */
+static int      log_started;            /* logger thread is running */
+static int      log_running;            /* messages are queued */
+static int      log_stopping;           /* logger thread should stop */
+static int      log_waiting;            /* logger thread is sleeping */
+static int      log_writers;            /* producers queueing a message */
+static unsigned long log_dropped;       /* dropped messages */
+static sem_t    log_sem;                /* logger thread wakeup */
+static pthread_t log_thread;            /* logger thread */
+static FILE    *log_fp;                 /* log file */
+
+
+/*
+** Error log rate limiting
+**
+** Errors and warnings are rate limited per message template, i.e. per
+** format string.  Every template has a token bucket which allows LOGBURST
+** messages and gets a new token every LOGREFILL seconds.  The number of
+** suppressed messages is appended to the next message of the template
+** which is logged.  When no message follows, the logger thread reports it
+** at most once per LOGREFILL seconds.
+*/
+struct logLimit {
+    const char *l_fmt;                  /* message template */
+    time_t      l_time;                 /* last token refill */
+    time_t      l_reported;             /* last suppressed messages report */
+    int         l_tokens;               /* available tokens */
+    unsigned long l_suppressed;         /* suppressed messages */
+};
+
+static struct   logLimit log_limits[LOGLIMITS];
+static pthread_mutex_t log_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long log_suppressed;    /* all suppressed messages */
+
+
+/*
+** LOG_WRITE - Write message to log targets
+*/
+static void
+log_write(int priority, const char *msg)
+{
+    char        date[16];
+    time_t      t;
+    struct      tm tm;
+
+    /* Write message to syslog */
+    if (log_target == 0 || (log_target & LOGTARGET_SYSLOG) != 0) {
+        syslog(priority, "%s", msg);
+    }
+
+    /* Print message to terminal */
+    if ((log_target == 0 && !daemonized) ||
+        (log_target & LOGTARGET_STDOUT) != 0)
+    {
+        (void) fprintf(stdout, "%s\n", msg);
+    }
+
+    /* Write message to log file */
+    if (log_fp != NULL) {
+        t = time(NULL);
+        (void) localtime_r(&t, &tm);
+        (void) strftime(date, sizeof(date), "%b %e %H:%M:%S", &tm);
+        (void) fprintf(log_fp, "%s %s[%ld]: %s\n", date, PACKAGE,
+            (long) getpid(), msg);
+    }
+}
+
+
+/*
+** LOG_FLUSH - Flush buffered log targets
+*/
+static void
+log_flush(void)
+{
+    if ((log_target == 0 && !daemonized) ||
+        (log_target & LOGTARGET_STDOUT) != 0)
+    {
+        (void) fflush(stdout);
+    }
+    if (log_fp != NULL) {
+        (void) fflush(log_fp);
+    }
+}
+
+
+/*
+** LOG_WAKEUP - Wake up sleeping logger thread
+*/
+static void
+log_wakeup(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&log_waiting, 0, __ATOMIC_SEQ_CST) != 0) {
+        (void) sem_post(&log_sem);
+    }
+}
+
+
+/*
+** LOG_CLAIM - Claim free record in the log queue
+**
+** log_claim() returns NULL when the queue is full and the overflow policy
+** is drop.  With the block policy it waits until the logger thread frees
+** a record.
+*/
+static struct logRecord *
+log_claim(unsigned long *pos)
+{
+    struct      logRecord *r;
+    struct      timespec ts;
+    unsigned long seq;
+    long        diff;
+
+    *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    for (;;) {
+        r = &log_ring[*pos % LOGQUEUE];
+        seq = __atomic_load_n(&r->r_seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - *pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_head, pos, *pos + 1, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                return r;
+            }
+        } else if (diff < 0) {
+            /* Queue is full */
+            if (log_async != LOGASYNC_BLOCK) {
+                __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            log_wakeup();
+            ts.tv_sec = 0;
+            ts.tv_nsec = 1000000;
+            (void) nanosleep(&ts, NULL);
+            *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        } else {
+            *pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/*
+** LOG_LIMIT - Check the rate limit of message template
+**
+** log_limit() returns -1 when the message should be suppressed.  Otherwise
+** it returns 0 and the number of messages suppressed since the last logged
+** one in *suppressed.
+*/
+static int
+log_limit(int priority, const char *fmt, unsigned long *suppressed)
+{
+    struct      logLimit *l;
+    unsigned int i, n;
+    time_t      now;
+    int         rc = 0;
+
+    *suppressed = 0;
+    if (priority > LOG_WARNING) {
+        return 0;
+    }
+
+    now = time(NULL);
+    i = (unsigned int)(((unsigned long)fmt >> 3) % LOGLIMITS);
+    (void) pthread_mutex_lock(&log_limit_lock);
+    for (n = 0; n < LOGLIMITS; n++, i = (i + 1) % LOGLIMITS) {
+        l = &log_limits[i];
+        if (l->l_fmt == fmt) {
+            break;
+        }
+        if (l->l_fmt == NULL) {
+            l->l_fmt = fmt;
+            l->l_time = now;
+            l->l_reported = now;
+            l->l_tokens = LOGBURST;
+            break;
+        }
+    }
+    if (n < LOGLIMITS) {
+        /* Refill tokens */
+        if (now < l->l_time) {
+            l->l_time = now;
+        } else if (now - l->l_time >= LOGREFILL) {
+            l->l_tokens += (now - l->l_time) / LOGREFILL;
+            if (l->l_tokens > LOGBURST) {
+                l->l_tokens = LOGBURST;
+            }
+            l->l_time += (now - l->l_time) / LOGREFILL * LOGREFILL;
+        }
+
+        /* Take token */
+        if (l->l_tokens > 0) {
+            l->l_tokens--;
+            *suppressed = l->l_suppressed;
+            l->l_suppressed = 0;
+        } else {
+            l->l_suppressed++;
+            rc = -1;
+        }
+    }
+    (void) pthread_mutex_unlock(&log_limit_lock);
+
+    if (rc == -1) {
+        __atomic_add_fetch(&log_suppressed, 1, __ATOMIC_RELAXED);
+    }
+    return rc;
+}
+
+
+/*
+** LOG_FORMAT - Format log message
+*/
+static void
+log_format(char *buf, size_t len, const char *qid, unsigned long suppressed,
+    const char *fmt, va_list ap)
+{
+    int         n = 0;
+
+    if (qid != NULL) {
+        n = snprintf(buf, len, "%s: ", qid);
+        if (n < 0 || (size_t)n >= len) {
+            return;
+        }
+    }
+    n += vsnprintf(buf + n, len - n, fmt, ap);
+    if (suppressed > 0 && n >= 0 && (size_t)n < len) {
+        (void) snprintf(buf + n, len - n,
+            " (%lu similar messages suppressed)", suppressed);
+    }
+}
+
+
+/*
+** LOG_PRINT - Print formatted log message
+**
+** When the logger thread is running, the message is formatted directly into
+** the log queue.
+*/
+static void
+log_print(int priority, const char *qid, const char *fmt, va_list ap)
 {
     char        buf[MAXLOGBUF];
-    va_list     ap;
+    struct      logRecord *r;
+    unsigned long pos, suppressed;
 
-    if (priority <= debug_level || priority <= LOG_WARNING) {
+    /* Check rate limit */
+    if (log_limit(priority, fmt, &suppressed) == -1) {
+        return;
+    }
 
-        /* Format message */
-        va_start(ap, fmt);
-        (void) vsnprintf(buf, sizeof(buf), fmt, ap);
-        va_end(ap);
+    /* Queue message for the logger thread */
+    __atomic_add_fetch(&log_writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_running, __ATOMIC_SEQ_CST)) {
+        if ((r = log_claim(&pos)) != NULL) {
+            log_format(r->r_msg, sizeof(r->r_msg), qid, suppressed, fmt, ap);
+            r->r_priority = priority;
+            __atomic_store_n(&r->r_seq, pos + 1, __ATOMIC_RELEASE);
+            log_wakeup();
+        }
+        __atomic_sub_fetch(&log_writers, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+    __atomic_sub_fetch(&log_writers, 1, __ATOMIC_SEQ_CST);
+
+    /* Write message */
+    log_format(buf, sizeof(buf), qid, suppressed, fmt, ap);
+    log_write(priority, buf);
+    if (log_fp != NULL) {
+        (void) fflush(log_fp);
+    }
+}
 
-        /* Write message to syslog */
-        syslog(priority, "%s", buf);
 
-        /* Print message to terminal */
-        if (!daemonized) {
-            (void) fprintf(stdout, "%s\n", buf);
+/*
+** LOG_SUPPRESSED_REPORT - Report messages suppressed by the rate limit
+**
+** Only the templates which were not reported for LOGREFILL seconds are
+** reported, or all of them when all is set
+*/
+static void
+log_suppressed_report(int all)
+{
+    char        buf[MAXLOGBUF];
+    struct      logLimit *l;
+    unsigned long suppressed;
+    unsigned int i;
+    time_t      now = time(NULL);
+
+    for (i = 0; i < LOGLIMITS; i++) {
+        l = &log_limits[i];
+        (void) pthread_mutex_lock(&log_limit_lock);
+        suppressed = 0;
+        if (l->l_fmt != NULL && l->l_suppressed > 0 &&
+            (all || now < l->l_reported || now - l->l_reported >= LOGREFILL))
+        {
+            suppressed = l->l_suppressed;
+            l->l_suppressed = 0;
+            l->l_reported = now;
+        }
+        (void) pthread_mutex_unlock(&log_limit_lock);
+        if (suppressed > 0) {
+            (void) snprintf(buf, sizeof(buf),
+                "%lu messages suppressed like: %s", suppressed, l->l_fmt);
+            log_write(LOG_WARNING, buf);
         }
     }
 }
 
 
 /*
-** LOGQIDMSG - Log message with mail queue id
+** LOG_DRAIN - Logger thread
+**
+** Without asynchronous logging, the thread only reports the suppressed
+** messages.
+*/
+static void *
+log_drain(void *arg)
+{
+    struct      logRecord *r;
+    unsigned long dropped, reported = 0;
+    char        buf[64];
+    struct      timespec ts;
+
+    (void) arg;
+    for (;;) {
+        /* Write all published records */
+        for (;;) {
+            r = &log_ring[log_tail % LOGQUEUE];
+            if (__atomic_load_n(&r->r_seq, __ATOMIC_ACQUIRE) != log_tail + 1) {
+                break;
+            }
+            log_write(r->r_priority, r->r_msg);
+            __atomic_store_n(&r->r_seq, log_tail + LOGQUEUE, __ATOMIC_RELEASE);
+            log_tail++;
+        }
+
+        /* Report dropped messages */
+        dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            (void) snprintf(buf, sizeof(buf), "%lu log messages dropped",
+                dropped - reported);
+            log_write(LOG_WARNING, buf);
+            reported = dropped;
+        }
+        log_suppressed_report(0);
+        log_flush();
+
+        /* Sleep until a new record is published or a second passes */
+        __atomic_store_n(&log_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        r = &log_ring[log_tail % LOGQUEUE];
+        if (__atomic_load_n(&r->r_seq, __ATOMIC_ACQUIRE) == log_tail + 1) {
+            __atomic_store_n(&log_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&log_writers, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&log_head, __ATOMIC_SEQ_CST) == log_tail)
+        {
+            break;
+        }
+        (void) clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        while (sem_timedwait(&log_sem, &ts) != 0 && errno == EINTR) {
+            continue;
+        }
+        __atomic_store_n(&log_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+/*
+** LOG_OPEN - Open log file
+*/
+int
+log_open(void)
+{
+    if ((log_target & LOGTARGET_FILE) == 0) {
+        return 0;
+    }
+    if ((log_fp = fopen(log_file, "a")) == NULL) {
+        logmsg(LOG_ERR, "could not open log file %s: %s", log_file,
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** LOG_START - Start logger thread
+**
+** log_start() must be called after the process was daemonized
+*/
+int
+log_start(void)
+{
+    unsigned long i;
+    int         rc;
+
+    for (i = 0; i < LOGQUEUE; i++) {
+        log_ring[i].r_seq = i;
+    }
+    if (sem_init(&log_sem, 0, 0) == -1) {
+        logmsg(LOG_ERR, "could not initialize logger semaphore: %s",
+            strerror(errno));
+        return -1;
+    }
+    if ((rc = pthread_create(&log_thread, NULL, log_drain, NULL)) != 0) {
+        logmsg(LOG_ERR, "could not create logger thread: %s", strerror(rc));
+        (void) sem_destroy(&log_sem);
+        return -1;
+    }
+    __atomic_store_n(&log_started, 1, __ATOMIC_RELEASE);
+    if (log_async != LOGASYNC_OFF) {
+        __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+
+/*
+** LOG_STOP - Write queued messages and stop logger thread
+**
+** New messages are written directly, while the logger thread writes the
+** queued ones.  The semaphore is destroyed after the thread has exited,
+** when no producer can wake it up anymore.
 */
 void
-logqidmsg(struct mlfiCtx *mlfi, int priority, const char *fmt, ...)
+log_stop(void)
+{
+    if (__atomic_load_n(&log_started, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&log_running, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&log_stopping, 1, __ATOMIC_SEQ_CST);
+        (void) sem_post(&log_sem);
+        (void) pthread_join(log_thread, NULL);
+        (void) sem_destroy(&log_sem);
+        __atomic_store_n(&log_started, 0, __ATOMIC_RELEASE);
+    }
+
+    /* Report messages suppressed since the last logged one */
+    log_suppressed_report(1);
+    log_flush();
+
+    if (log_fp != NULL) {
+        (void) fclose(log_fp);
+        log_fp = NULL;
+    }
+}
+
+
+/*
+** LOG_DROPPED_COUNT - Get number of dropped log messages
+*/
+unsigned long
+log_dropped_count(void)
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+
+/*
+** LOG_SUPPRESSED_COUNT - Get number of rate limited log messages
+*/
+unsigned long
+log_suppressed_count(void)
+{
+    return __atomic_load_n(&log_suppressed, __ATOMIC_RELAXED);
+}
+
+
+/*
+** LOGMSG_PRINT - Print log message
+**
+** logmsg_print() is called through the logmsg() macro, which checks the
+** message priority
+*/
+void
+logmsg_print(int priority, const char *fmt, ...)
 {
-    char        buf[MAXLOGBUF];
-    const char *p;
     va_list     ap;
 
-    /* Format message */
     va_start(ap, fmt);
-    (void) vsnprintf(buf, sizeof(buf), fmt, ap);
+    log_print(priority, NULL, fmt, ap);
     va_end(ap);
+}
 
-    /* Print log message */
+
+/*
+** LOGQIDMSG_PRINT - Print log message with mail queue id
+**
+** logqidmsg_print() is called through the logqidmsg() macro, which checks
+** the message priority
+*/
+void
+logqidmsg_print(struct mlfiCtx *mlfi, int priority, const char *fmt, ...)
+{
+    const char *p;
+    va_list     ap;
+
+    /* Get message identification */
     if (mlfi != NULL) {
         if (mlfi->mlfi_qid != NULL) {
             p = mlfi->mlfi_qid;
-        } else if (mlfi->mlfi_prev_qid != NULL) {
+        } else if (mlfi->mlfi_prev_qid[0] != '\0') {
             p = mlfi->mlfi_prev_qid;
         } else if (mlfi->mlfi_client_host != NULL) {
             p = mlfi->mlfi_client_host;
@@ -87,5 +569,9 @@ logqidmsg(struct mlfiCtx *mlfi, int priority, const char *fmt, ...)
     } else {
         p = "NOQUEUE";
     }
-    logmsg(priority, "%s: %s", p, buf);
+
+    /* Print log message */
+    va_start(ap, fmt);
+    log_print(priority, p, fmt, ap);
+    va_end(ap);
 }
@@ -41,8 +41,6 @@ int             daemonized = 0;
 int             debug_level = LOG_WARNING;
 int             max_conns = 0;
 int             max_wait = 5 * 60;
-sem_t           max_sem_t;
-sem_t          *max_sem = NULL;
 const char     *pid_file = LOCAL_STATE_DIR "/" PACKAGE ".pid";
 char           *mlfi_socket = LOCAL_STATE_DIR "/" PACKAGE ".sock";
 #ifdef HAVE_SMFI_SETBACKLOG
@@ -52,9 +50,19 @@ long            mlfi_timeout = 600;
 const char     *amavisd_socket = LOCAL_STATE_DIR "/amavisd.sock";
 long            amavisd_timeout = 600;
 int             ignore_amavisd_error = 0;
+int             amavisd_ahead = 0;
+int             progress_interval = 0;
 const char     *working_dir = WORKING_DIR;
 const char     *delivery_care_of = "client";
 int             policybank_from_daemon_name = 0;
+int             log_target = 0;
+const char     *log_file = NULL;
+int             log_async = LOGASYNC_OFF;
+int             summary_format = SUMMARY_OFF;
+const char     *trace_file = NULL;
+const char     *stats_socket = NULL;
+const char     *health_socket = NULL;
+const char     *control_socket = NULL;
 
 
 /*
@@ -65,24 +73,46 @@ usage(const char *progname)
 {
     (void) fprintf(stdout, "\nUsage: %s [OPTIONS]\n", progname);
     (void) fprintf(stdout, "Options are:\n");
+    (void) fprintf(stdout, "    -a overflow             Asynchronous logging, when the queue is full\n                                drop or block messages\n");
+    (void) fprintf(stdout, "    -A min:max[:latency]    Adapt max-conns between min and max to\n                                the amavisd scan time\n");
+    (void) fprintf(stdout, "    -b breaker              Fail at once after amavisd failures,\n                                failures[:cooldown[:rate]]\n");
     (void) fprintf(stdout, "    -B                      Use daemon_name policy bank\n");
+    (void) fprintf(stdout, "    -c socket               Accept control commands on this socket\n");
+    (void) fprintf(stdout, "    -C name:slots:rules     Admission class with reserved amavisd\n                                connections\n");
     (void) fprintf(stdout, "    -d debug-level          Set debug level\n");
     (void) fprintf(stdout, "    -D delivery             Delivery care of server or client\n");
+    (void) fprintf(stdout, "    -e socket               Serve statistics on this socket\n");
+    (void) fprintf(stdout, "    -E enter[:leave[:code]] Reject new messages when the predicted\n                                wait exceeds enter %% of max-wait\n");
     (void) fprintf(stdout, "    -f                      Run in the foreground\n");
+    (void) fprintf(stdout, "    -F key:conns[:rate[:burst]]\n                                Limit messages per client or sender domain\n");
     (void) fprintf(stdout, "    -h                      Print this page\n");
+    (void) fprintf(stdout, "    -H socket               Serve health status on this socket\n");
+#ifdef HAVE_SMFI_PROGRESS
+    (void) fprintf(stdout, "    -k interval             Keep MTA informed during the amavisd\n                                scan every interval seconds\n");
+#endif
+    (void) fprintf(stdout, "    -L target               Log to syslog, stdout or /path/to/file\n");
     (void) fprintf(stdout, "    -m max-conns            Maximum amavisd connections \n");
     (void) fprintf(stdout, "    -M max-wait             Maximum wait for connection in seconds\n");
+#ifdef HAVE_SMFI_OPENSOCKET
+    (void) fprintf(stdout, "    -n workers              Run this number of worker processes\n");
+#endif
+    (void) fprintf(stdout, "    -O                      Connect to amavisd while the message body\n                                is received\n");
     (void) fprintf(stdout, "    -p pidfile              Use this pid file\n");
     (void) fprintf(stdout, "    -P                      When amavisd fails mail will be passed\n                                through unchecked\n");
 #ifdef HAVE_SMFI_SETBACKLOG
     (void) fprintf(stdout, "    -q backlog              Milter communication socket backlog\n");
 #endif
+    (void) fprintf(stdout, "    -Q order                Admission order fifo or size[:rate]\n");
+    (void) fprintf(stdout, "    -R stage[:reply]        Reply to messages over -F at from or rcpt\n");
     (void) fprintf(stdout, "    -s socket               Milter communication socket\n");
     (void) fprintf(stdout, "    -S socket               Amavisd communication socket\n");
     (void) fprintf(stdout, "    -t timeout              Milter connection timeout in seconds\n");
     (void) fprintf(stdout, "    -T timeout              Amavisd connection timeout in seconds\n");
     (void) fprintf(stdout, "    -v                      Report the version and exit\n");
-    (void) fprintf(stdout, "    -w directory            Set the working directory\n\n");
+    (void) fprintf(stdout, "    -V ttl[:entries]        Replay verdicts of repeated messages for\n                                ttl seconds\n");
+    (void) fprintf(stdout, "    -w directory            Set the working directory\n");
+    (void) fprintf(stdout, "    -x file                 Debug trace rules file\n");
+    (void) fprintf(stdout, "    -y format               Log message summary as kv or json\n\n");
 }
 
 
@@ -117,20 +147,65 @@ versioninfo(const char *progname)
 }
 
 
+/*
+** PIDFILE_CREATE - Create pid file
+*/
+static void
+pidfile_create(void)
+{
+    FILE       *fp;
+    mode_t      save_umask;
+
+    if (pid_file != NULL) {
+        save_umask = umask(022);
+        fp = fopen(pid_file, "w");
+        if (fp == NULL) {
+            logmsg(LOG_WARNING, "could not create pid file %s: %s",
+                pid_file, strerror(errno));
+        } else {
+            (void) fprintf(fp, "%ld\n", (long) getpid());
+            if (ferror(fp)) {
+                logmsg(LOG_WARNING, "could not write to pid file %s: %s",
+                    pid_file, strerror(errno));
+                clearerr(fp);
+                (void) fclose(fp);
+            } else if (fclose(fp) != 0) {
+                logmsg(LOG_WARNING, "could not close pid file %s: %s",
+                    pid_file, strerror(errno));
+            }
+        }
+        umask(save_umask);
+    }
+}
+
+
+/*
+** PIDFILE_REMOVE - Unlink pid file
+*/
+static void
+pidfile_remove(void)
+{
+    if (pid_file != NULL) {
+        if (unlink(pid_file) != 0) {
+            logmsg(LOG_WARNING, "could not unlink pid file %s: %s",
+                pid_file, strerror(errno));
+        }
+    }
+}
+
+
 /*
 ** MAIN - Main program loop
 */
 int
 main(int argc, char *argv[])
 {
-    static      const char *args = "Bd:D:fhm:M:p:Pq:s:S:t:T:vw:";
+    static      const char *args = "a:A:b:Bc:C:d:D:e:E:fF:hH:k:L:m:M:n:Op:Pq:Q:R:s:S:t:T:vV:w:x:y:";
 
     int         c, rstat;
     char       *p;
     const char *progname, *socket_name;
-    FILE       *fp;
     struct      stat st;
-    mode_t      save_umask;
     struct      sockaddr_un unix_addr;
 
     /* Program name */
@@ -147,6 +222,37 @@ main(int argc, char *argv[])
     /* Process command line options */
     while ((c = getopt(argc, argv, args)) != EOF) {
         switch (c) {
+        case 'a':               /* asynchronous logging */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (strcmp(optarg, "drop") == 0) {
+                log_async = LOGASYNC_DROP;
+            } else if (strcmp(optarg, "block") == 0) {
+                log_async = LOGASYNC_BLOCK;
+            } else {
+                usageerr(progname, "unknown log overflow policy '%s'", optarg);
+            }
+            break;
+        case 'A':               /* adaptive connection limit */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (adapt_parse(optarg) == -1) {
+                usageerr(progname, "invalid adaptive limit: %s", optarg);
+            }
+            break;
+        case 'b':               /* circuit breaker */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (breaker_parse(optarg) == -1) {
+                usageerr(progname, "invalid circuit breaker: %s", optarg);
+            }
+            break;
         case 'B':               /* use daemon_name policy bank */
             policybank_from_daemon_name = 1;
             break;
@@ -186,6 +292,26 @@ main(int argc, char *argv[])
             usage(progname);
             exit(EX_OK);
             break;
+        case 'L':               /* log target */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (strcmp(optarg, "syslog") == 0) {
+                log_target |= LOGTARGET_SYSLOG;
+            } else if (strcmp(optarg, "stdout") == 0) {
+                log_target |= LOGTARGET_STDOUT;
+            } else if (*optarg == '/') {
+                if (log_file != NULL) {
+                    usageerr(progname, "log file is already set: %s",
+                        log_file);
+                }
+                log_target |= LOGTARGET_FILE;
+                log_file = optarg;
+            } else {
+                usageerr(progname, "unknown log target '%s'", optarg);
+            }
+            break;
         case 'm':               /* maximum amavisd connections */
             max_conns = (int) strtol(optarg, &p, 10);
             if (p != NULL && *p != '\0') {
@@ -210,6 +336,20 @@ main(int argc, char *argv[])
                     max_wait);
             }
             break;
+#ifdef HAVE_SMFI_OPENSOCKET
+        case 'n':               /* worker processes */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (worker_parse(optarg) == -1) {
+                usageerr(progname, "invalid number of workers: %s", optarg);
+            }
+            break;
+#endif
+        case 'O':               /* connect to amavisd before EOM */
+            amavisd_ahead = 1;
+            break;
         case 'p':               /* pid file name */
             if (optarg == NULL || *optarg == '\0') {
                 usageerr(progname, "option requires an argument -- %c",
@@ -235,6 +375,24 @@ main(int argc, char *argv[])
             }
             break;
 #endif
+        case 'Q':               /* admission order */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (admit_order(optarg) == -1) {
+                usageerr(progname, "invalid admission order: %s", optarg);
+            }
+            break;
+        case 'R':               /* reply to throttled messages */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (fair_reply(optarg) == -1) {
+                usageerr(progname, "invalid throttling reply: %s", optarg);
+            }
+            break;
         case 's':               /* milter communication socket */
             if (optarg == NULL || *optarg == '\0') {
                 usageerr(progname, "option requires an argument -- %c",
@@ -300,22 +458,139 @@ main(int argc, char *argv[])
                     amavisd_timeout);
             }
             break;
+        case 'C':               /* admission class */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (admit_class_add(optarg) == -1) {
+                usageerr(progname, "invalid admission class: %s", optarg);
+            }
+            break;
+        case 'c':               /* control socket */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            control_socket = optarg;
+            break;
+        case 'e':               /* statistics socket */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            stats_socket = optarg;
+            break;
+        case 'E':               /* early rejection */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (early_parse(optarg) == -1) {
+                usageerr(progname, "invalid early rejection: %s", optarg);
+            }
+            break;
+        case 'F':               /* fairness rule */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (fair_add(optarg) == -1) {
+                usageerr(progname, "invalid fairness rule: %s", optarg);
+            }
+            break;
+        case 'H':               /* health status socket */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            health_socket = optarg;
+            break;
+#ifdef HAVE_SMFI_PROGRESS
+        case 'k':               /* keep MTA informed during scan */
+            progress_interval = (int) strtol(optarg, &p, 10);
+            if (p != NULL && *p != '\0') {
+                usageerr(progname,
+                    "progress interval is not valid number: %s", optarg);
+            }
+            if (progress_interval < 0) {
+                usageerr(progname, "negative progress interval: %d",
+                    progress_interval);
+            }
+            break;
+#endif
+        case 'V':               /* verdict cache */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (cache_parse(optarg) == -1) {
+                usageerr(progname, "invalid verdict cache: %s", optarg);
+            }
+            break;
+        case 'x':               /* debug trace rules file */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            trace_file = optarg;
+            break;
+        case 'y':               /* message summary format */
+            if (optarg == NULL || *optarg == '\0') {
+                usageerr(progname, "option requires an argument -- %c",
+                    (char)c);
+            }
+            if (strcmp(optarg, "kv") == 0) {
+                summary_format = SUMMARY_KV;
+            } else if (strcmp(optarg, "json") == 0) {
+                summary_format = SUMMARY_JSON;
+            } else {
+                usageerr(progname, "unknown summary format '%s'", optarg);
+            }
+            break;
         default:                /* unknown option */
             usageerr(progname, "illegal option -- %c", (char)c);
             break;
         }
     }
 
-    /* Create amavisd connections semaphore */
-    if (max_conns > 0) {
-        if (sem_init(&max_sem_t, 0, max_conns) == -1) {
-            logmsg(LOG_ERR,
-                "could not initialize amavisd connections semaphore: %s",
-                strerror(errno));
-            exit(EX_SOFTWARE);
-        } else {
-            max_sem = &max_sem_t;
-        }
+#ifdef DISABLE_DEBUG_LOGGING
+    /* Debug messages are not compiled in */
+    if (debug_level >= LOG_DEBUG) {
+        logmsg(LOG_WARNING, "debug messages are disabled at compile time");
+    }
+#endif
+
+    /* Limit amavisd connections */
+    if (admit_init(max_conns) == -1 || adapt_init(max_conns) == -1 ||
+        early_init() == -1)
+    {
+        exit(EX_USAGE);
+    }
+
+    /* Allocate statistics */
+    if (stats_init() == -1) {
+        exit(EX_OSERR);
+    }
+
+    /* Allocate fairness table */
+    if (fair_init() == -1) {
+        exit(EX_OSERR);
+    }
+
+    /* Allocate verdict cache */
+    if (cache_init() == -1) {
+        exit(EX_CONFIG);
+    }
+
+    /* Open log file */
+    if (log_open() == -1) {
+        exit(EX_CANTCREAT);
+    }
+
+    /* Load debug trace rules */
+    if (trace_init() == -1) {
+        exit(EX_CONFIG);
     }
 
     /* Check permissions on working directory */
@@ -393,6 +668,21 @@ main(int argc, char *argv[])
     }
 #endif
 
+    /* Open statistics socket */
+    if (stats_open() == -1) {
+        exit(EX_SOFTWARE);
+    }
+
+    /* Open health status socket */
+    if (health_open() == -1) {
+        exit(EX_SOFTWARE);
+    }
+
+    /* Open control socket */
+    if (control_open() == -1) {
+        exit(EX_SOFTWARE);
+    }
+
     /* Run in the background */
     if (daemonize) {
         if (daemon(1, 1) != -1) {
@@ -404,31 +694,45 @@ main(int argc, char *argv[])
         }
     }
 
+    /* Supervise worker processes */
+    if (worker_enabled()) {
+        pidfile_create();
+        if ((rstat = worker_start()) != 0) {
+            pidfile_remove();
+            log_stop();
+            return rstat == 1 ? MI_SUCCESS : MI_FAILURE;
+        }
+
+        /* The pid file belongs to the supervisor */
+        pid_file = NULL;
+    }
+
+    /* Start logger thread */
+    if (log_start() == -1) {
+        exit(EX_OSERR);
+    }
+
+    /* Start serving statistics */
+    if (stats_start() == -1) {
+        exit(EX_OSERR);
+    }
+
+    /* Start serving health status */
+    if (health_start() == -1) {
+        exit(EX_OSERR);
+    }
+
+    /* Start accepting control commands */
+    if (control_start() == -1) {
+        exit(EX_OSERR);
+    }
+
     /* Greetings message */
     logmsg(LOG_WARNING, "starting %s %s on socket %s", progname, VERSION,
         mlfi_socket);
 
     /* Create pid file */
-    if (pid_file != NULL) {
-        save_umask = umask(022);
-        fp = fopen(pid_file, "w");
-        if (fp == NULL) {
-            logmsg(LOG_WARNING, "could not create pid file %s: %s",
-                pid_file, strerror(errno));
-        } else {
-            (void) fprintf(fp, "%ld\n", (long) getpid());
-            if (ferror(fp)) {
-                logmsg(LOG_WARNING, "could not write to pid file %s: %s",
-                    pid_file, strerror(errno));
-                clearerr(fp);
-                (void) fclose(fp);
-            } else if (fclose(fp) != 0) {
-                logmsg(LOG_WARNING, "could not close pid file %s: %s",
-                    pid_file, strerror(errno));
-            }
-        }
-        umask(save_umask);
-    }
+    pidfile_create();
 
     /* Run milter */
     if ((rstat = smfi_main()) != MI_SUCCESS) {
@@ -438,20 +742,35 @@ main(int argc, char *argv[])
             mlfi_socket);
     }
 
+    /* Stop serving statistics */
+    stats_stop();
+
+    /* Stop serving health status */
+    health_stop();
+
+    /* Stop accepting control commands */
+    control_stop();
+
+    /* Free recycled connection contexts */
+    mlfi_free_contexts();
+
+    /* Free debug trace rules */
+    trace_free();
+
+    /* Free admission classes */
+    admit_free();
+
+    /* Free fairness table */
+    fair_free();
+
+    /* Free verdict cache */
+    cache_free();
+
     /* Unlink pid file */
-    if (pid_file != NULL) {
-        if (unlink(pid_file) != 0) {
-            logmsg(LOG_WARNING, "could not unlink pid file %s: %s",
-                pid_file, strerror(errno));
-        }
-    }
+    pidfile_remove();
 
-    /* Destroy amavisd connections semaphore */
-    if (max_sem != NULL && sem_destroy(max_sem) == -1) {
-        logmsg(errno == EBUSY ? LOG_ERR : LOG_WARNING,
-            "%s: could not destroy amavisd connections semaphore: %s",
-            progname, strerror(errno));
-    }
+    /* Stop logger thread */
+    log_stop();
 
     return rstat;
 }
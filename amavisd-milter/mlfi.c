@@ -30,7 +30,6 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <stdarg.h>
 
 
 /*
@@ -62,51 +61,423 @@ struct smfiDesc smfilter =
 
 
 /*
-** Dates and months abbreviations
+** MLFI_APPEND - Append string to buffer
+**
+** mlfi_append() copies the string as far as it fits into the buffer, always
+** terminates the buffer and returns the end of the copied string
 */
-static const char *days[] =
+static char *
+mlfi_append(char *b, const char *end, const char *s)
 {
-    "Sun",
-    "Mon",
-    "Tue",
-    "Wed",
-    "Thu",
-    "Fri",
-    "Sat"
-};
+    while (*s != '\0' && b < end - 1) {
+        *b++ = *s++;
+    }
+    *b = '\0';
+    return b;
+}
 
-static const char *months[] =
+
+/*
+** MLFI_RCPT_HASHVAL - Compute recipient hash value (FNV-1a)
+*/
+static unsigned int
+mlfi_rcpt_hashval(const char *rcpt)
 {
-    "Jan",
-    "Feb",
-    "Mar",
-    "Apr",
-    "May",
-    "Jun",
-    "Jul",
-    "Aug",
-    "Sep",
-    "Oct",
-    "Nov",
-    "Dec"
-};
+    unsigned int h = 2166136261U;
+
+    while (*rcpt != '\0') {
+        h ^= (unsigned char)*rcpt++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+
+/*
+** MLFI_RCPT_LOOKUP - Find recipient hash set slot
+**
+** mlfi_rcpt_lookup() returns the slot which holds the recipient or the empty
+** slot where the recipient should be stored.  The hash set has twice as many
+** slots as the recipient array, so there is always an empty slot.
+*/
+static unsigned int *
+mlfi_rcpt_lookup(struct mlfiCtx *mlfi, const char *rcpt)
+{
+    unsigned int mask = mlfi->mlfi_rcpt_size * 2 - 1;
+    unsigned int i = mlfi_rcpt_hashval(rcpt) & mask;
+    unsigned int *slot;
+
+    while (*(slot = &mlfi->mlfi_rcpt_hash[i]) != 0) {
+        if (strcmp(mlfi->mlfi_rcpt[*slot - 1], rcpt) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return slot;
+}
+
+
+/*
+** MLFI_RCPT_GROW - Reallocate recipient array and hash set
+*/
+static int
+mlfi_rcpt_grow(struct mlfiCtx *mlfi)
+{
+    char      **rcpt;
+    unsigned int *hash;
+    unsigned int i, size;
+
+    /* Allocate new arrays from the message arena */
+    size = mlfi->mlfi_rcpt_size == 0 ? RCPTCHUNK : mlfi->mlfi_rcpt_size * 2;
+    rcpt = arena_alloc(&mlfi->mlfi_msg_arena, size * sizeof(*rcpt));
+    hash = arena_alloc(&mlfi->mlfi_msg_arena, size * 2 * sizeof(*hash));
+    if (rcpt == NULL || hash == NULL) {
+        return -1;
+    }
+    if (mlfi->mlfi_rcpt_count > 0) {
+        (void) memcpy(rcpt, mlfi->mlfi_rcpt,
+            mlfi->mlfi_rcpt_count * sizeof(*rcpt));
+    }
+    (void) memset(hash, '\0', size * 2 * sizeof(*hash));
+    mlfi->mlfi_rcpt = rcpt;
+    mlfi->mlfi_rcpt_size = size;
+    mlfi->mlfi_rcpt_hash = hash;
+
+    /* Rebuild hash set */
+    for (i = 0; i < mlfi->mlfi_rcpt_count; i++) {
+        *mlfi_rcpt_lookup(mlfi, rcpt[i]) = i + 1;
+    }
+    return 0;
+}
+
+
+/*
+** MLFI_PATH - Get absolute path of the file in the working directory
+*/
+static char *
+mlfi_path(char *buf, size_t size, const char *name)
+{
+    (void) snprintf(buf, size, "%s/%s", working_dir, name);
+    return buf;
+}
+
+
+/*
+** MLFI_ALLOC_AMABUF - Allocate amavisd communication buffer
+**
+** The buffer is allocated on the first use, so connections without
+** any message do not need it
+*/
+static int
+mlfi_alloc_amabuf(struct mlfiCtx *mlfi)
+{
+    if (mlfi->mlfi_amabuf != NULL) {
+        return 0;
+    }
+    if ((mlfi->mlfi_amabuf = malloc(AMABUFCHUNK)) == NULL) {
+        logqidmsg(mlfi, LOG_ERR,
+            "could not allocate amavisd communication buffer");
+        return -1;
+    }
+    mlfi->mlfi_amabuf_length = AMABUFCHUNK;
+#ifndef NDEBUG
+    mlfi->mlfi_nalloc++;
+#endif
+    return 0;
+}
+
+
+/*
+** MLFI_RECEIVED - Render connection part of the synthesized Received header
+**
+** The helo name, the client, the authentication and the protocol do not
+** change within the SMTP session, so the prefix of the header is rendered
+** once and only the message part is appended to it for every message:
+**
+** Received: from <hello> (<rdns> [<ip>]) (authenticated bits=<bits>)
+**          by <hostname> (<package>)
+**          with <protocol> (authenticated as <user>)
+*/
+static int
+mlfi_received(SMFICTX *ctx, struct mlfiCtx *mlfi, const char *auth_type)
+{
+    char       *b = mlfi->mlfi_amabuf;
+    const char *end = mlfi->mlfi_amabuf + mlfi->mlfi_amabuf_length;
+    const char *auth_ssf, *auth_authen;
+
+    b = mlfi_append(b, end, "Received: from ");
+    b = mlfi_append(b, end, mlfi->mlfi_helo != NULL &&
+        *mlfi->mlfi_helo != '\0' ? mlfi->mlfi_helo : "unknown");
+    if ((mlfi->mlfi_client_name != NULL && *mlfi->mlfi_client_name != '\0')
+        || (mlfi->mlfi_client_addr != NULL && *mlfi->mlfi_client_addr != '\0'))
+    {
+        b = mlfi_append(b, end, " (");
+        if (mlfi->mlfi_client_name != NULL && *mlfi->mlfi_client_name != '\0') {
+            b = mlfi_append(b, end, mlfi->mlfi_client_name);
+        }
+        b = mlfi_append(b, end, " ");
+        if (mlfi->mlfi_client_addr != NULL && *mlfi->mlfi_client_addr != '\0') {
+            b = mlfi_append(b, end, "[");
+            b = mlfi_append(b, end, mlfi->mlfi_client_addr);
+            b = mlfi_append(b, end, "]");
+        }
+        b = mlfi_append(b, end, ")");
+    }
+    if (auth_type != NULL) {
+        b = mlfi_append(b, end, " (authenticated");
+        auth_ssf = smfi_getsymval(ctx, "{auth_ssf}");
+        if (auth_ssf != NULL && *auth_ssf != '\0') {
+            b = mlfi_append(b, end, " bits=");
+            b = mlfi_append(b, end, auth_ssf);
+        }
+        b = mlfi_append(b, end, ")");
+    }
+    b = mlfi_append(b, end, "\n\tby ");
+    b = mlfi_append(b, end, mlfi->mlfi_hostname != NULL &&
+        *mlfi->mlfi_hostname != '\0' ? mlfi->mlfi_hostname : "localhost");
+    b = mlfi_append(b, end, " (" PACKAGE ")");
+    if (mlfi->mlfi_protocol != NULL && *mlfi->mlfi_protocol != '\0') {
+        b = mlfi_append(b, end, " with ");
+        b = mlfi_append(b, end, mlfi->mlfi_protocol);
+    }
+    auth_authen = smfi_getsymval(ctx, "{auth_authen}");
+    if (auth_type != NULL && auth_authen != NULL && *auth_authen != '\0' ) {
+        b = mlfi_append(b, end, " (authenticated as ");
+        b = mlfi_append(b, end, auth_authen);
+        b = mlfi_append(b, end, ")");
+    }
+
+    /* Save rendered prefix */
+    if ((mlfi->mlfi_received = arena_strdup(&mlfi->mlfi_conn_arena,
+        mlfi->mlfi_amabuf)) == NULL)
+    {
+        logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+        return -1;
+    }
+    mlfi->mlfi_received_auth = auth_type != NULL;
+    return 0;
+}
+
+
+/*
+** Registry of active connections
+**
+** The control socket lists the registered connections.  The list and the
+** queue ids saved in mlfi_prev_qid are changed under mlfi_registry_lock,
+** the other fields shown are changed with atomic stores.
+*/
+static struct   mlfiCtx *mlfi_registry;
+static pthread_mutex_t mlfi_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+** MLFI_REGISTER - Add connection context to the registry
+*/
+static void
+mlfi_register(struct mlfiCtx *mlfi)
+{
+    (void) pthread_mutex_lock(&mlfi_registry_lock);
+    mlfi->mlfi_reg_next = mlfi_registry;
+    mlfi->mlfi_reg_pprev = &mlfi_registry;
+    if (mlfi_registry != NULL) {
+        mlfi_registry->mlfi_reg_pprev = &mlfi->mlfi_reg_next;
+    }
+    mlfi_registry = mlfi;
+    (void) pthread_mutex_unlock(&mlfi_registry_lock);
+}
+
+
+/*
+** MLFI_UNREGISTER - Remove connection context from the registry
+*/
+static void
+mlfi_unregister(struct mlfiCtx *mlfi)
+{
+    if (mlfi->mlfi_reg_pprev == NULL) {
+        return;
+    }
+    (void) pthread_mutex_lock(&mlfi_registry_lock);
+    *mlfi->mlfi_reg_pprev = mlfi->mlfi_reg_next;
+    if (mlfi->mlfi_reg_next != NULL) {
+        mlfi->mlfi_reg_next->mlfi_reg_pprev = mlfi->mlfi_reg_pprev;
+    }
+    mlfi->mlfi_reg_next = NULL;
+    mlfi->mlfi_reg_pprev = NULL;
+    (void) pthread_mutex_unlock(&mlfi_registry_lock);
+}
+
+
+/*
+** MLFI_SAVE_QID - Save queue id for logging and for the registry
+*/
+static void
+mlfi_save_qid(struct mlfiCtx *mlfi)
+{
+    if (mlfi->mlfi_qid == NULL) {
+        return;
+    }
+    (void) pthread_mutex_lock(&mlfi_registry_lock);
+    (void) strlcpy(mlfi->mlfi_prev_qid, mlfi->mlfi_qid,
+        sizeof(mlfi->mlfi_prev_qid));
+    (void) pthread_mutex_unlock(&mlfi_registry_lock);
+}
+
+
+/*
+** MLFI_TRANSACTIONS - Call function for every registered connection
+**
+** The function is called with the registry locked, so it must not block
+** and can read only the fields changed under the lock or atomically.
+*/
+void
+mlfi_transactions(void (*func)(const struct mlfiCtx *, void *), void *arg)
+{
+    const struct mlfiCtx *mlfi;
+
+    (void) pthread_mutex_lock(&mlfi_registry_lock);
+    for (mlfi = mlfi_registry; mlfi != NULL; mlfi = mlfi->mlfi_reg_next) {
+        func(mlfi, arg);
+    }
+    (void) pthread_mutex_unlock(&mlfi_registry_lock);
+}
+
+
+/*
+** MLFI_SPOOLED - Account bytes written to the message file
+*/
+static void
+mlfi_spooled(struct mlfiCtx *mlfi, long n)
+{
+    if (n > 0) {
+        __atomic_store_n(&mlfi->mlfi_size, mlfi->mlfi_size + n,
+            __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+** Recycled connection contexts
+**
+** A slot is taken and filled with atomic operations, so the freelist needs
+** no lock and a context is never handed out to two connections.
+*/
+static struct   mlfiCtx *free_ctx[MAXFREECTX];
+static unsigned int free_ctx_hint;
 
 
 /*
-** SNPRINTFCAT - Append formatted string
+** MLFI_GET_CONTEXT - Get connection context from the freelist
+**
+** mlfi_get_context() returns a recycled context with its buffers retained
+** or allocates a new one when the freelist is empty
 */
-static size_t
-snprintfcat(size_t length, char *buf, size_t size, const char *fmt, ...)
+static struct mlfiCtx *
+mlfi_get_context(void)
 {
-    va_list     ap;
+    struct      mlfiCtx *mlfi;
+    unsigned int i, slot;
+
+    slot = __atomic_load_n(&free_ctx_hint, __ATOMIC_RELAXED);
+    for (i = 0; i < MAXFREECTX; i++, slot++) {
+        slot %= MAXFREECTX;
+        if (__atomic_load_n(&free_ctx[slot], __ATOMIC_RELAXED) != NULL &&
+            (mlfi = __atomic_exchange_n(&free_ctx[slot], NULL,
+            __ATOMIC_ACQUIRE)) != NULL)
+        {
+            __atomic_store_n(&free_ctx_hint, slot, __ATOMIC_RELAXED);
+            return mlfi;
+        }
+    }
 
-    va_start(ap, fmt);
-    if ((length += vsnprintf(buf + length, size - length, fmt, ap)) >= size) {
-        length = size -1;
+    /* Allocate new context */
+    if ((mlfi = malloc(sizeof(*mlfi))) == NULL) {
+        return NULL;
+    }
+    (void) memset(mlfi, '\0', sizeof(*mlfi));
+    mlfi->mlfi_amasd = -1;
+    arena_init(&mlfi->mlfi_conn_arena, CONNARENACHUNK);
+    arena_init(&mlfi->mlfi_msg_arena, MSGARENACHUNK);
+#ifndef NDEBUG
+    mlfi->mlfi_nalloc++;
+#endif
+    return mlfi;
+}
+
+
+/*
+** MLFI_PUT_CONTEXT - Return connection context to the freelist
+**
+** mlfi_put_context() resets the context and keeps the default sized buffers
+** for the next connection.  When the freelist is full, the context is freed.
+*/
+static void
+mlfi_put_context(struct mlfiCtx *mlfi)
+{
+    struct      mlfiArena conn_arena, msg_arena;
+    char       *amabuf;
+    unsigned int i, slot;
+    struct      mlfiCtx *empty;
+
+    /* Drop buffers which grew over the default size */
+    if (mlfi->mlfi_amabuf_length != AMABUFCHUNK) {
+        free(mlfi->mlfi_amabuf);
+        mlfi->mlfi_amabuf = NULL;
+    }
+    arena_trim(&mlfi->mlfi_conn_arena);
+    arena_trim(&mlfi->mlfi_msg_arena);
+
+    /* Reset context */
+    amabuf = mlfi->mlfi_amabuf;
+    conn_arena = mlfi->mlfi_conn_arena;
+    msg_arena = mlfi->mlfi_msg_arena;
+    (void) memset(mlfi, '\0', sizeof(*mlfi));
+    mlfi->mlfi_amasd = -1;
+    if ((mlfi->mlfi_amabuf = amabuf) != NULL) {
+        mlfi->mlfi_amabuf_length = AMABUFCHUNK;
+    }
+    mlfi->mlfi_conn_arena = conn_arena;
+    mlfi->mlfi_msg_arena = msg_arena;
+
+    /* Store context to the first empty slot */
+    slot = __atomic_load_n(&free_ctx_hint, __ATOMIC_RELAXED);
+    for (i = 0; i < MAXFREECTX; i++, slot++) {
+        slot %= MAXFREECTX;
+        empty = NULL;
+        if (__atomic_load_n(&free_ctx[slot], __ATOMIC_RELAXED) == NULL &&
+            __atomic_compare_exchange_n(&free_ctx[slot], &empty, mlfi, 0,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&free_ctx_hint, slot, __ATOMIC_RELAXED);
+            return;
+        }
     }
-    va_end(ap);
 
-    return length;
+    /* Freelist is full */
+    free(mlfi->mlfi_amabuf);
+    arena_free(&mlfi->mlfi_msg_arena);
+    arena_free(&mlfi->mlfi_conn_arena);
+    free(mlfi);
+}
+
+
+/*
+** MLFI_FREE_CONTEXTS - Free all recycled connection contexts
+*/
+void
+mlfi_free_contexts(void)
+{
+    struct      mlfiCtx *mlfi;
+    unsigned int i;
+
+    for (i = 0; i < MAXFREECTX; i++) {
+        mlfi = __atomic_exchange_n(&free_ctx[i], NULL, __ATOMIC_ACQUIRE);
+        if (mlfi != NULL) {
+            free(mlfi->mlfi_amabuf);
+            arena_free(&mlfi->mlfi_msg_arena);
+            arena_free(&mlfi->mlfi_conn_arena);
+            free(mlfi);
+        }
+    }
 }
 
 
@@ -122,7 +493,7 @@ mlfi_cleanup_message(struct mlfiCtx *mlfi)
     FTS        *fts;
     FTSENT     *ftsent;
     char       *wrkdir[] = { NULL, NULL };
-    struct      mlfiAddress *rcpt;
+    char        path[MAXPATHLEN];
 
     logqidmsg(mlfi, LOG_DEBUG, "CLEANUP MESSAGE CONTEXT");
 
@@ -138,22 +509,23 @@ mlfi_cleanup_message(struct mlfiCtx *mlfi)
     /* Close the message file */
     if (mlfi->mlfi_fp != NULL) {
         if (fclose(mlfi->mlfi_fp) != 0 && errno != EBADF) {
-            logqidmsg(mlfi, LOG_WARNING, "could not close message file %s: %s",
-                mlfi->mlfi_fname, strerror(errno));
+            logqidmsg(mlfi, LOG_WARNING,
+                "could not close message file %s/%s: %s",
+                working_dir, mlfi->mlfi_fname, strerror(errno));
         } else {
-            logqidmsg(mlfi, LOG_DEBUG, "close message file %s",
-                mlfi->mlfi_fname);
+            logqidmsg(mlfi, LOG_DEBUG, "close message file %s/%s",
+                working_dir, mlfi->mlfi_fname);
         }
         mlfi->mlfi_fp = NULL;
     }
 
     /* Remove working directory */
-    if (mlfi->mlfi_wrkdir[0] != '\0') {
-        wrkdir[0] = mlfi->mlfi_wrkdir;
+    if (mlfi->mlfi_wrkdir != NULL) {
+        wrkdir[0] = mlfi_path(path, sizeof(path), mlfi->mlfi_wrkdir);
         fts = fts_open(wrkdir, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
         if (fts == NULL) {
             logqidmsg(mlfi, LOG_WARNING, "could not open file hierarchy %s: %s",
-                mlfi->mlfi_wrkdir, strerror(errno));
+                path, strerror(errno));
         } else {
             while ((ftsent = fts_read(fts)) != NULL) {
                 switch (ftsent->fts_info) {
@@ -220,35 +592,54 @@ mlfi_cleanup_message(struct mlfiCtx *mlfi)
             if (fts_close(fts) != 0) {
                 logqidmsg(mlfi, LOG_WARNING,
                     "could not close file hirerachy %s: %s",
-                    mlfi->mlfi_wrkdir, strerror(errno));
+                    path, strerror(errno));
             }
         }
-        mlfi->mlfi_wrkdir[0] = '\0';
+        mlfi->mlfi_wrkdir = NULL;
     }
+    mlfi->mlfi_fname = NULL;
+
+    /* Uncount message of the client and sender domain */
+    fair_release(mlfi);
+    mlfi->mlfi_throttled = 0;
 
     /* Reset CRLF detection flag */
     mlfi->mlfi_cr_flag = 0;
 
-    /* Free memory */
-    free(mlfi->mlfi_prev_qid);
-    mlfi->mlfi_prev_qid = mlfi->mlfi_qid;
+    /* Save queue id for logging */
+    mlfi_save_qid(mlfi);
+
+#ifndef NDEBUG
+    /* Report allocator calls since the last cleanup */
+    logqidmsg(mlfi, LOG_DEBUG, "allocator calls: %lu", mlfi->mlfi_nalloc +
+        mlfi->mlfi_conn_arena.a_nalloc + mlfi->mlfi_msg_arena.a_nalloc);
+    mlfi->mlfi_nalloc = 0;
+    mlfi->mlfi_conn_arena.a_nalloc = 0;
+    mlfi->mlfi_msg_arena.a_nalloc = 0;
+#endif
+
+    /* Release message memory */
     mlfi->mlfi_qid = NULL;
-    free(mlfi->mlfi_from);
     mlfi->mlfi_from = NULL;
-    free(mlfi->mlfi_policy_bank);
     mlfi->mlfi_policy_bank = NULL;
-    while(mlfi->mlfi_rcpt != NULL) {
-        rcpt = mlfi->mlfi_rcpt;
-        mlfi->mlfi_rcpt = rcpt->q_next;
-        free(rcpt);
-    }
+    mlfi->mlfi_log_id = NULL;
+    mlfi->mlfi_rcpt = NULL;
+    mlfi->mlfi_rcpt_count = 0;
+    mlfi->mlfi_rcpt_size = 0;
+    mlfi->mlfi_rcpt_hash = NULL;
+    arena_reset(&mlfi->mlfi_msg_arena);
+    stats_phase(mlfi, PHASE_IDLE);
+
+    /* Restore connection debug trace level */
+    mlfi->mlfi_trace = mlfi->mlfi_trace_conn;
 }
 
 
 /*
 ** MLFI_CLEANUP - Cleanup connection context
 **
-** mlfi_cleanup() cleanup message context and relese connection context
+** mlfi_cleanup() cleanup message context and return connection context
+** to the freelist
 */
 static void
 mlfi_cleanup(struct mlfiCtx *mlfi)
@@ -265,19 +656,9 @@ mlfi_cleanup(struct mlfiCtx *mlfi)
 
     logqidmsg(mlfi, LOG_DEBUG, "CLEANUP CONNECTION CONTEXT");
 
-    /* Cleanup the connection context */
-    free(mlfi->mlfi_daemon_name);
-    free(mlfi->mlfi_hostname);
-    free(mlfi->mlfi_client_addr);
-    free(mlfi->mlfi_client_host);
-    free(mlfi->mlfi_client_name);
-    free(mlfi->mlfi_helo);
-    free(mlfi->mlfi_protocol);
-    free(mlfi->mlfi_amabuf);
-    free(mlfi->mlfi_prev_qid);
-
-    /* Free context */
-    free(mlfi);
+    /* Return context to the freelist */
+    mlfi_unregister(mlfi);
+    mlfi_put_context(mlfi);
 }
 
 
@@ -302,6 +683,39 @@ mlfi_setreply_tempfail(SMFICTX *ctx)
 }
 
 
+/*
+** MLFI_SETREPLY_CODE - Set reply code and text
+*/
+static void
+mlfi_setreply_code(SMFICTX *ctx, const char *rcode, const char *xcode,
+    const char *reason)
+{
+    struct      mlfiCtx *mlfi = MLFICTX(ctx);
+
+    if (smfi_setreply(ctx, (char *)rcode, (char *)xcode, (char *)reason) !=
+        MI_SUCCESS)
+    {
+        logqidmsg(mlfi, LOG_WARNING, "could not set SMTP reply: %s %s %s",
+            rcode, xcode, reason);
+    } else {
+        logqidmsg(mlfi, LOG_DEBUG, "set reply %s %s %s", rcode, xcode, reason);
+    }
+}
+
+
+/*
+** MLFI_SETREPLY_THROTTLED - Set reply to message exceeding fairness rule
+*/
+static void
+mlfi_setreply_throttled(SMFICTX *ctx)
+{
+    const char *rcode, *xcode, *reason;
+
+    fair_reply_text(&rcode, &xcode, &reason);
+    mlfi_setreply_code(ctx, rcode, xcode, reason);
+}
+
+
 /*
 ** MLFI_CONNECT - Handle incomming connection
 **
@@ -326,23 +740,30 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
 
     logmsg(LOG_DEBUG, "%s: CONNECT", client_host);
 
-    /* Allocate memory for private data */
-    mlfi = malloc(sizeof(*mlfi));
-    if (mlfi == NULL) {
+    /* Get private data */
+    if ((mlfi = mlfi_get_context()) == NULL) {
         logmsg(LOG_ERR, "%s: could not allocate private data", client_host);
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
-    /* Initialize context */
-    (void) memset(mlfi, '\0', sizeof(*mlfi));
-    mlfi->mlfi_amasd = -1;
+    /* Enable debug tracing of the connection */
+    mlfi->mlfi_trace_conn = trace_connect(hostaddr,
+        smfi_getsymval(ctx, "{daemon_name}"));
+    mlfi->mlfi_trace = mlfi->mlfi_trace_conn;
+
+    /* Select admission class of the client */
+    mlfi->mlfi_class_conn = admit_class_client(hostaddr);
+    (void) net_addr(&mlfi->mlfi_client_net, hostaddr);
 
     /* Save client hostname (Reverse DNS or IP addresss in square bracket) */
-    if ((mlfi->mlfi_client_host = strdup(client_host)) == NULL) {
+    if ((mlfi->mlfi_client_host = arena_strdup(&mlfi->mlfi_conn_arena,
+        client_host)) == NULL)
+    {
         logmsg(LOG_ERR, "%s: could not allocate memory", client_host);
-         mlfi_setreply_tempfail(ctx);
-         return SMFIS_TEMPFAIL;
+        mlfi_setreply_tempfail(ctx);
+        mlfi_cleanup(mlfi);
+        return SMFIS_TEMPFAIL;
     }
 
     /*
@@ -367,9 +788,12 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
         client_name = "unknown";
     }
     logqidmsg(mlfi, LOG_DEBUG, "client name: %s", client_name);
-    if ((mlfi->mlfi_client_name = strdup(client_name)) == NULL) {
+    if ((mlfi->mlfi_client_name = arena_strdup(&mlfi->mlfi_conn_arena,
+        client_name)) == NULL)
+    {
         logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
         mlfi_setreply_tempfail(ctx);
+        mlfi_cleanup(mlfi);
         return SMFIS_TEMPFAIL;
     }
 
@@ -398,9 +822,12 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
         }
     }
     if (addr != NULL) {
-        if ((mlfi->mlfi_client_addr = malloc(len + plen)) == NULL) {
+        if ((mlfi->mlfi_client_addr = arena_alloc(&mlfi->mlfi_conn_arena,
+            len + plen)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
+            mlfi_cleanup(mlfi);
             return SMFIS_TEMPFAIL;
         }
         if (prefix != NULL) {
@@ -409,7 +836,6 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
         if (inet_ntop(hostaddr->sa_family, addr, mlfi->mlfi_client_addr + plen,
             len) == NULL)
         {
-            free(mlfi->mlfi_client_addr);
             mlfi->mlfi_client_addr = NULL;
             logqidmsg(mlfi, LOG_WARNING, "could not convert host address to "
                 "string for host %s", client_host);
@@ -422,7 +848,9 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
     /* Save daemon name */
     if ((daemon_name = smfi_getsymval(ctx, "{daemon_name}")) != NULL) {
         logqidmsg(mlfi, LOG_INFO, "Daemon name: %s", daemon_name);
-        if ((mlfi->mlfi_daemon_name = strdup(daemon_name)) == NULL) {
+        if ((mlfi->mlfi_daemon_name = arena_strdup(&mlfi->mlfi_conn_arena,
+            daemon_name)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             mlfi_cleanup(mlfi);
@@ -430,16 +858,6 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
         }
     }
 
-    /* Allocate amavisd communication buffer */
-    mlfi->mlfi_amabuf_length = AMABUFCHUNK;
-    if ((mlfi->mlfi_amabuf = malloc(mlfi->mlfi_amabuf_length)) == NULL) {
-        logqidmsg(mlfi, LOG_ERR,
-            "could not allocate amavisd communication buffer");
-        mlfi_setreply_tempfail(ctx);
-        mlfi_cleanup(mlfi);
-        return SMFIS_TEMPFAIL;
-    }
-
     /* Save private data */
     if (smfi_setpriv(ctx, mlfi) != MI_SUCCESS) {
         logqidmsg(mlfi, LOG_ERR, "could not set milter context");
@@ -447,10 +865,13 @@ mlfi_connect(SMFICTX *ctx, char *client_host, _SOCK_ADDR * hostaddr)
         mlfi_cleanup(mlfi);
         return SMFIS_TEMPFAIL;
     }
+    mlfi_register(mlfi);
 
     /* Save hostname */
     if ((hostname = smfi_getsymval(ctx, "j")) != NULL) {
-        if ((mlfi->mlfi_hostname = strdup(hostname)) == NULL) {
+        if ((mlfi->mlfi_hostname = arena_strdup(&mlfi->mlfi_conn_arena,
+            hostname)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
@@ -482,10 +903,14 @@ mlfi_helo(SMFICTX *ctx, char* helohost)
 
     logqidmsg(mlfi, LOG_DEBUG, "HELO: %s", helohost);
 
+    /* Render the Received header again with the new helo */
+    mlfi->mlfi_received = NULL;
+
     /* Save helo hostname */
     if (helohost != NULL && *helohost != '\0') {
-        free(mlfi->mlfi_helo);
-        if ((mlfi->mlfi_helo = strdup(helohost)) == NULL) {
+        if ((mlfi->mlfi_helo = arena_strdup(&mlfi->mlfi_conn_arena,
+            helohost)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
@@ -507,16 +932,16 @@ sfsistat
 mlfi_envfrom(SMFICTX *ctx, char **envfrom)
 {
     struct      mlfiCtx *mlfi = MLFICTX(ctx);
-    char        buf[64];
-    const char *auth_type, *auth_authen, *auth_ssf;
-    const char *date, *qid, *wrkdir;
+    char        buf[MAXDATELEN];
+    char        path[MAXPATHLEN];
+    char       *b;
+    const char *end;
+    const char *auth_type, *auth_ssf;
+    const char *date, *qid;
     const char *from;
     const char *protocol = NULL;
     const char *daemon_name;
-    size_t      l;
-    time_t      t;
-    struct      tm gt, lt;
-    int         gmtoff;
+    int         tmpdir;
 
     /* Check milter private data */
     if (mlfi == NULL) {
@@ -531,7 +956,9 @@ mlfi_envfrom(SMFICTX *ctx, char **envfrom)
         (protocol = smfi_getsymval(ctx, "r")) != NULL)
     {
         logqidmsg(mlfi, LOG_DEBUG, "protocol: %s", protocol);
-        if ((mlfi->mlfi_protocol = strdup(protocol)) == NULL) {
+        if ((mlfi->mlfi_protocol = arena_strdup(&mlfi->mlfi_conn_arena,
+            protocol)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
@@ -540,14 +967,28 @@ mlfi_envfrom(SMFICTX *ctx, char **envfrom)
 
     /* Cleanup message data */
     mlfi_cleanup_message(mlfi);
+    clock_now(&mlfi->mlfi_start);
+    __atomic_store_n(&mlfi->mlfi_size, 0, __ATOMIC_RELAXED);
+    mlfi->mlfi_wait_usec = 0;
+    mlfi->mlfi_connect_usec = 0;
+    mlfi->mlfi_scan_usec = 0;
+    mlfi->mlfi_cached = 0;
+    stats_phase(mlfi, PHASE_SPOOL);
+
+    /* Hash the message for the verdict cache */
+    if (cache_enabled()) {
+        cache_start(mlfi);
+    }
 
     /* Save queue id */
     if ((qid = smfi_getsymval(ctx, "i")) != NULL) {
-        if ((mlfi->mlfi_qid = strdup(qid)) == NULL) {
+        if ((mlfi->mlfi_qid = arena_strdup(&mlfi->mlfi_msg_arena, qid)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
         }
+        mlfi_save_qid(mlfi);
     }
 
     /* An empty sender must always be enclosed in angle brackets */
@@ -557,201 +998,190 @@ mlfi_envfrom(SMFICTX *ctx, char **envfrom)
         from = "<>";
     }
 
+    /* Enable debug tracing of the message */
+    mlfi->mlfi_trace = MAX(mlfi->mlfi_trace_conn, trace_message(from));
+
     logqidmsg(mlfi, LOG_DEBUG, "MAIL FROM: %s", from);
 
     /* Save from mail address */
-    if ((mlfi->mlfi_from = strdup(from)) == NULL) {
+    if ((mlfi->mlfi_from = arena_strdup(&mlfi->mlfi_msg_arena, from)) == NULL) {
         logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
+    /* Daemon name */
+    if (mlfi->mlfi_daemon_name == NULL) {
+        if ((daemon_name = smfi_getsymval(ctx, "{daemon_name}")) != NULL) {
+            logqidmsg(mlfi, LOG_INFO, "Daemon name: %s", daemon_name);
+            if ((mlfi->mlfi_daemon_name = arena_strdup(&mlfi->mlfi_conn_arena,
+                daemon_name)) == NULL)
+            {
+                logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+                mlfi_setreply_tempfail(ctx);
+                return SMFIS_TEMPFAIL;
+            }
+        }
+    }
+
+    /* Admission class */
+    auth_type = smfi_getsymval(ctx, "{auth_type}");
+    mlfi->mlfi_class = admit_class(mlfi->mlfi_class_conn,
+        mlfi->mlfi_daemon_name, auth_type);
+    logqidmsg(mlfi, LOG_DEBUG, "admission class: %s",
+        admit_class_name(mlfi->mlfi_class));
+
+    /* Reject message when amavisd is overloaded */
+    if (early_enabled() && early_reject(mlfi)) {
+        mlfi_setreply_code(ctx, early_reply_code(), "4.3.2",
+            "Service busy, try again later");
+        stats_phase(mlfi, PHASE_IDLE);
+        return SMFIS_TEMPFAIL;
+    }
+
+    /* Limit messages of the client and sender domain */
+    if (fair_enabled() && fair_acquire(mlfi) == -1) {
+        if (fair_stage() == FAIR_FROM) {
+            mlfi_setreply_throttled(ctx);
+            stats_phase(mlfi, PHASE_IDLE);
+            return SMFIS_TEMPFAIL;
+        }
+        mlfi->mlfi_throttled = 1;
+    }
+
     /* Create working directory */
+    path[0] = '\0';
     if (mlfi->mlfi_qid != NULL) {
-        (void) snprintf(mlfi->mlfi_wrkdir, sizeof(mlfi->mlfi_wrkdir) - 1,
-            "%s/af%s", working_dir, mlfi->mlfi_qid);
-        if (mkdir(mlfi->mlfi_wrkdir, S_IRWXU|S_IRGRP|S_IXGRP) != 0) {
-            mlfi->mlfi_wrkdir[0] = '\0';
-        }
-    }
-    if (mlfi->mlfi_wrkdir[0] == '\0') {
-        (void) snprintf(mlfi->mlfi_wrkdir, sizeof(mlfi->mlfi_wrkdir) - 1,
-            "%s/afXXXXXXXXXX", working_dir);
-        if ((wrkdir = mkdtemp(mlfi->mlfi_wrkdir)) != NULL) {
-            (void) strlcpy(mlfi->mlfi_wrkdir, wrkdir,
-                sizeof(mlfi->mlfi_wrkdir));
-        } else {
+        (void) snprintf(path, sizeof(path) - 1, "%s/af%s", working_dir,
+            mlfi->mlfi_qid);
+        if (mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP) != 0) {
+            path[0] = '\0';
+        }
+    }
+    tmpdir = path[0] == '\0';
+    if (tmpdir) {
+        (void) snprintf(path, sizeof(path) - 1, "%s/afXXXXXXXXXX",
+            working_dir);
+        if (mkdtemp(path) == NULL) {
             logqidmsg(mlfi, LOG_ERR, "could not create working directory: %s",
                 strerror(errno));
-            mlfi->mlfi_wrkdir[0] = '\0';
-            mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
-        }
-        if (chmod(mlfi->mlfi_wrkdir, S_IRWXU|S_IRGRP|S_IXGRP) == -1) {
-            logqidmsg(mlfi, LOG_ERR,
-                "could not change mode of directory %s: %s",
-                mlfi->mlfi_wrkdir, strerror(errno));
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
         }
     }
-    logqidmsg(mlfi, LOG_DEBUG, "create working directory %s", mlfi->mlfi_wrkdir);
 
-    /* Open file to store this message */
-    (void) snprintf(mlfi->mlfi_fname, sizeof(mlfi->mlfi_fname) - 1,
-        "%s/email.txt", mlfi->mlfi_wrkdir);
-    if ((mlfi->mlfi_fp = fopen(mlfi->mlfi_fname, "w+")) == NULL) {
-        logqidmsg(mlfi, LOG_ERR, "could not create message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+    /* Save working directory name relative to working_dir */
+    if ((mlfi->mlfi_wrkdir = arena_strdup(&mlfi->mlfi_msg_arena,
+        path + strlen(working_dir) + 1)) == NULL)
+    {
+        logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+        (void) rmdir(path);
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
-    if (fchmod(fileno(mlfi->mlfi_fp), S_IRUSR|S_IWUSR|S_IRGRP) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not change mode of file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+    if (tmpdir && chmod(path, S_IRWXU|S_IRGRP|S_IXGRP) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not change mode of directory %s: %s",
+            path, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
-    logqidmsg(mlfi, LOG_DEBUG, "create message file %s", mlfi->mlfi_fname);
+    logqidmsg(mlfi, LOG_DEBUG, "create working directory %s", path);
 
-    /* Get transaction date */
+    /* Open file to store this message */
+    (void) snprintf(path, sizeof(path) - 1, "%s/email.txt", mlfi->mlfi_wrkdir);
+    if ((mlfi->mlfi_fname = arena_strdup(&mlfi->mlfi_msg_arena, path)) == NULL)
+    {
+        logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+    if ((mlfi->mlfi_fp = fopen(mlfi_path(path, sizeof(path), mlfi->mlfi_fname),
+        "w+")) == NULL)
+    {
+        logqidmsg(mlfi, LOG_ERR, "could not create message file %s: %s",
+            path, strerror(errno));
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+    if (fchmod(fileno(mlfi->mlfi_fp), S_IRUSR|S_IWUSR|S_IRGRP) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not change mode of file %s: %s",
+            path, strerror(errno));
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+    logqidmsg(mlfi, LOG_DEBUG, "create message file %s", path);
+
+    /* Allocate amavisd communication buffer */
+    if (mlfi_alloc_amabuf(mlfi) == -1) {
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+    end = mlfi->mlfi_amabuf + mlfi->mlfi_amabuf_length;
+
+    /* Get transaction date */
     if ((date = smfi_getsymval(ctx, "b")) == NULL) {
-        (void) time(&t);
-        gt = *gmtime(&t);
-        lt = *localtime(&t);
-        gmtoff = (lt.tm_hour - gt.tm_hour) * 60 + lt.tm_min - gt.tm_min;
-        if (lt.tm_year < gt.tm_year) {
-            gmtoff -= 24 * 60;
-        } else if (lt.tm_year > gt.tm_year) {
-            gmtoff += 24 * 60;
-        } else if (lt.tm_yday < gt.tm_yday) {
-            gmtoff -= 24 * 60;
-        } else if (lt.tm_yday > gt.tm_yday) {
-            gmtoff += 24 * 60;
-        }
-        if (lt.tm_sec <= gt.tm_sec - 60) {
-            gmtoff -= 1;
-        } else if (lt.tm_sec >= gt.tm_sec + 60) {
-            gmtoff += 1;
-        }
-        if (snprintf(buf, sizeof(buf),
-#ifdef HAVE_STRUCT_TM_TM_ZONE
-            "%s, %d %s %d %02d:%02d:%02d %+03d%02d (%s)",
-#else
-            "%s, %d %s %d %02d:%02d:%02d %+03d%02d",
-#endif
-            days[lt.tm_wday], lt.tm_mday, months[lt.tm_mon],
-            lt.tm_year + 1900, lt.tm_hour, lt.tm_min, lt.tm_sec,
-            (int) gmtoff / 60, (int) abs(gmtoff) % 60
-#ifdef HAVE_STRUCT_TM_TM_ZONE
-            , lt.tm_zone
-#endif
-            ) < sizeof(buf))
-        {
-            date = buf;
-        }
+        date = date_rfc2822(buf, NULL);
     }
 
     /* Write synthesized received header to the file as the first header:*/
-    /* Received: from <hello> (<rdns> [<ip>]) (authenticated bits=<bits>)*/
-    /*          by <hostname> (<rdns> [<ip>])                            */
-    /*          with <protocol> (authenticated as <user>) id <qid>;      */
+    /* <connection prefix> id <qid>;                                     */
     /*          <date>                                                   */
     /*          (envelope-from <sender>)                                 */
-    *mlfi->mlfi_amabuf = '\0';
-    l = snprintfcat(0, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-        "Received: from %s", mlfi->mlfi_helo != NULL && *mlfi->mlfi_helo != '\0'
-            ? mlfi->mlfi_helo : "unknown");
-    if ((mlfi->mlfi_client_name != NULL && *mlfi->mlfi_client_name != '\0')
-        || (mlfi->mlfi_client_addr != NULL && *mlfi->mlfi_client_addr != '\0'))
+    if ((mlfi->mlfi_received == NULL ||
+        mlfi->mlfi_received_auth != (auth_type != NULL)) &&
+        mlfi_received(ctx, mlfi, auth_type) == -1)
     {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, " (");
-        if (mlfi->mlfi_client_name != NULL && *mlfi->mlfi_client_name != '\0') {
-            l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-                "%s", mlfi->mlfi_client_name);
-        }
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, " ");
-        if (mlfi->mlfi_client_addr != NULL && *mlfi->mlfi_client_addr != '\0') {
-            l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-                "[%s]", mlfi->mlfi_client_addr);
-        }
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, ")");
-    }
-    if ((auth_type = smfi_getsymval(ctx, "{auth_type}")) != NULL) {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            " (authenticated");
-        auth_ssf = smfi_getsymval(ctx, "{auth_ssf}");
-        if (auth_ssf != NULL && *auth_ssf != '\0') {
-            l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-                " bits=%s", auth_ssf);
-        }
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, ")");
-    }
-    l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-        "\n\tby %s (" PACKAGE ")",
-        mlfi->mlfi_hostname != NULL && *mlfi->mlfi_hostname != '\0'
-            ? mlfi->mlfi_hostname : "localhost");
-    if (mlfi->mlfi_protocol != NULL && *mlfi->mlfi_protocol != '\0') {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            " with %s", mlfi->mlfi_protocol);
-    }
-    auth_authen = smfi_getsymval(ctx, "{auth_authen}");
-    if (auth_type != NULL && auth_authen != NULL && *auth_authen != '\0' ) {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            " (authenticated as %s)", auth_authen);
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
     }
+    b = mlfi_append(mlfi->mlfi_amabuf, end, mlfi->mlfi_received);
     if (mlfi->mlfi_qid != NULL && *mlfi->mlfi_qid != '\0') {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            " id %s", mlfi->mlfi_qid);
+        b = mlfi_append(b, end, " id ");
+        b = mlfi_append(b, end, mlfi->mlfi_qid);
     }
-    l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, ";\n");
+    b = mlfi_append(b, end, ";\n");
     if (date != NULL && *date != '\0') {
-        l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            "\t%s\n", date);
+        b = mlfi_append(b, end, "\t");
+        b = mlfi_append(b, end, date);
+        b = mlfi_append(b, end, "\n");
     }
-    l = snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-        "\t(envelope-from %s)\n", mlfi->mlfi_from);
+    b = mlfi_append(b, end, "\t(envelope-from ");
+    b = mlfi_append(b, end, mlfi->mlfi_from);
+    b = mlfi_append(b, end, ")\n");
     logqidmsg(mlfi, LOG_DEBUG, "ADDHDR: %s", mlfi->mlfi_amabuf);
-    (void) fputs(mlfi->mlfi_amabuf, mlfi->mlfi_fp);
+    mlfi_spooled(mlfi, fwrite(mlfi->mlfi_amabuf, 1, b - mlfi->mlfi_amabuf,
+        mlfi->mlfi_fp));
     if (ferror(mlfi->mlfi_fp)) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s/%s: %s",
+            working_dir, mlfi->mlfi_fname, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
-    /* Daemon name */
-    if (mlfi->mlfi_daemon_name == NULL) {
-        if ((daemon_name = smfi_getsymval(ctx, "{daemon_name}")) != NULL) {
-            logqidmsg(mlfi, LOG_INFO, "Daemon name: %s", daemon_name);
-            if ((mlfi->mlfi_daemon_name = strdup(daemon_name)) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-        }
-    }
-
     /* Policy bank names */
-    l = 0;
-    *mlfi->mlfi_amabuf = '\0';
+    b = mlfi->mlfi_amabuf;
+    *b = '\0';
     if ((policybank_from_daemon_name == 1) && (mlfi->mlfi_daemon_name != NULL)) {
-        l += snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            "%s", mlfi->mlfi_daemon_name);
+        b = mlfi_append(b, end, mlfi->mlfi_daemon_name);
     }
     if (auth_type != NULL) {
-        if (l > 0) {
-            l += snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length, ",");
+        if (b > mlfi->mlfi_amabuf) {
+            b = mlfi_append(b, end, ",");
         }
-        l += snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-            "SMTP_AUTH,SMTP_AUTH_%s", auth_type);
+        b = mlfi_append(b, end, "SMTP_AUTH,SMTP_AUTH_");
+        b = mlfi_append(b, end, auth_type);
+        auth_ssf = smfi_getsymval(ctx, "{auth_ssf}");
         if (auth_ssf != NULL && *auth_ssf != '\0') {
-            l += snprintfcat(l, mlfi->mlfi_amabuf, mlfi->mlfi_amabuf_length,
-                ",SMTP_AUTH_%s_%s", auth_type, auth_ssf);
+            b = mlfi_append(b, end, ",SMTP_AUTH_");
+            b = mlfi_append(b, end, auth_type);
+            b = mlfi_append(b, end, "_");
+            b = mlfi_append(b, end, auth_ssf);
         }
     }
-    if (l > 0) {
-        if ((mlfi->mlfi_policy_bank = strdup(mlfi->mlfi_amabuf)) == NULL) {
+    if (b > mlfi->mlfi_amabuf) {
+        if ((mlfi->mlfi_policy_bank = arena_strdup(&mlfi->mlfi_msg_arena,
+            mlfi->mlfi_amabuf)) == NULL)
+        {
             logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
             mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
@@ -773,8 +1203,7 @@ sfsistat
 mlfi_envrcpt(SMFICTX *ctx, char **envrcpt)
 {
     struct      mlfiCtx *mlfi = MLFICTX(ctx);
-    struct      mlfiAddress *rcpt, *r;
-    int         rcptlen;
+    unsigned int *slot;
 
     /* Check milter private data */
     if (mlfi == NULL) {
@@ -785,24 +1214,37 @@ mlfi_envrcpt(SMFICTX *ctx, char **envrcpt)
 
     logqidmsg(mlfi, LOG_DEBUG, "RCPT TO: %s",  *envrcpt);
 
+    /* Reject recipients of throttled message */
+    if (mlfi->mlfi_throttled) {
+        mlfi_setreply_throttled(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+
+    /* Skip duplicate recipient */
+    if (mlfi->mlfi_rcpt_count > 0 &&
+        *(slot = mlfi_rcpt_lookup(mlfi, *envrcpt)) != 0)
+    {
+        logqidmsg(mlfi, LOG_DEBUG, "duplicate recipient %s", *envrcpt);
+        return SMFIS_CONTINUE;
+    }
+
     /* Store recipient address */
-    rcptlen = strlen(*envrcpt);
-    if ((rcpt = malloc(sizeof(*rcpt) + rcptlen)) == NULL) {
+    if (mlfi->mlfi_rcpt_count == mlfi->mlfi_rcpt_size &&
+        mlfi_rcpt_grow(mlfi) == -1)
+    {
         logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
-    (void) strlcpy(rcpt->q_paddr, *envrcpt, rcptlen + 1);
-    rcpt->q_next = NULL;
-    if (mlfi->mlfi_rcpt == NULL) {
-        mlfi->mlfi_rcpt = rcpt;
-    } else {
-        r = mlfi->mlfi_rcpt;
-        while (r->q_next != NULL) {
-            r = r->q_next;
-        }
-        r->q_next = rcpt;
+    slot = mlfi_rcpt_lookup(mlfi, *envrcpt);
+    if ((mlfi->mlfi_rcpt[mlfi->mlfi_rcpt_count] =
+        arena_strdup(&mlfi->mlfi_msg_arena, *envrcpt)) == NULL)
+    {
+        logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
     }
+    *slot = ++mlfi->mlfi_rcpt_count;
 
     /* Continue processing */
     return SMFIS_CONTINUE;
@@ -830,19 +1272,248 @@ mlfi_header(SMFICTX *ctx, char *headerf, char *headerv)
     logqidmsg(mlfi, LOG_DEBUG, "HEADER: %s: %s", headerf, headerv);
 
     /* Write the header to the message file */
-    (void) fprintf(mlfi->mlfi_fp, "%s: %s\n", headerf, headerv);
+    mlfi_spooled(mlfi, fprintf(mlfi->mlfi_fp, "%s: %s\n", headerf, headerv));
     if (ferror(mlfi->mlfi_fp)) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s/%s: %s",
+            working_dir, mlfi->mlfi_fname, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
+    cache_header(mlfi, headerf, headerv);
 
     /* Continue processing */
     return SMFIS_CONTINUE;
 }
 
 
+/*
+** MLFI_LATE_QID - Get queue id
+**
+** Postfix does give information about the queue-number only after the
+** RCPT-TO-phase
+*/
+static int
+mlfi_late_qid(SMFICTX *ctx, struct mlfiCtx *mlfi)
+{
+    const char *qid;
+
+    if (mlfi->mlfi_qid == NULL && (qid = smfi_getsymval(ctx, "i")) != NULL) {
+        if ((mlfi->mlfi_qid = arena_strdup(&mlfi->mlfi_msg_arena, qid))
+            == NULL)
+        {
+            logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
+            return -1;
+        }
+        mlfi_save_qid(mlfi);
+    }
+    return 0;
+}
+
+
+/*
+** MLFI_REQUEST - Write amavisd request without the message file
+**
+** All attributes except the message file are known after the headers, so
+** they can be written before the body is received.
+*/
+static int
+mlfi_request(struct mlfiCtx *mlfi)
+{
+    unsigned int r;
+    char        path[MAXPATHLEN];
+
+    /* AM.PDP protocol prologue */
+    logqidmsg(mlfi, LOG_DEBUG, "request=AM.PDP");
+    if (amavisd_request(mlfi, "request", "AM.PDP") == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* MTA queue id */
+    if (mlfi->mlfi_qid != NULL) {
+        logqidmsg(mlfi, LOG_DEBUG, "queue_id=%s", mlfi->mlfi_qid);
+        if (amavisd_request(mlfi, "queue_id", mlfi->mlfi_qid) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Communication protocol */
+    if (mlfi->mlfi_protocol != NULL) {
+        logqidmsg(mlfi, LOG_DEBUG, "protocol_name=%s", mlfi->mlfi_protocol);
+        if (amavisd_request(mlfi, "protocol_name", mlfi->mlfi_protocol) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Envelope sender address */
+    logqidmsg(mlfi, LOG_DEBUG, "sender=%s", mlfi->mlfi_from);
+    if (amavisd_request(mlfi, "sender", mlfi->mlfi_from) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* Envelope recipient addresses */
+    for (r = 0; r < mlfi->mlfi_rcpt_count; r++) {
+        logqidmsg(mlfi, LOG_DEBUG, "recipient=%s", mlfi->mlfi_rcpt[r]);
+        if (amavisd_request(mlfi, "recipient", mlfi->mlfi_rcpt[r]) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Working directory */
+    (void) mlfi_path(path, sizeof(path), mlfi->mlfi_wrkdir);
+    logqidmsg(mlfi, LOG_DEBUG, "tempdir=%s", path);
+    if (amavisd_request(mlfi, "tempdir", path) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* Who is responsible for removing the working directory */
+    logqidmsg(mlfi, LOG_DEBUG, "tempdir_removed_by=client");
+    if (amavisd_request(mlfi, "tempdir_removed_by", "client") == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* Who is responsible for forwarding the message */
+    logqidmsg(mlfi, LOG_DEBUG, "delivery_care_of=%s", delivery_care_of);
+    if (amavisd_request(mlfi, "delivery_care_of", delivery_care_of) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* IP address of the original SMTP client */
+    logqidmsg(mlfi, LOG_DEBUG, "client_address=%s", mlfi->mlfi_client_addr);
+    if (amavisd_request(mlfi, "client_address", mlfi->mlfi_client_addr) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* DNS name of the original SMTP client */
+    if (mlfi->mlfi_client_host != NULL) {
+        logqidmsg(mlfi, LOG_DEBUG, "client_name=%s", mlfi->mlfi_client_host);
+        if (amavisd_request(mlfi, "client_name", mlfi->mlfi_client_host) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* The value of the HELO or EHLO specified by the original SMTP client */
+    if (mlfi->mlfi_helo != NULL) {
+        logqidmsg(mlfi, LOG_DEBUG, "helo_name=%s", mlfi->mlfi_helo);
+        if (amavisd_request(mlfi, "helo_name", mlfi->mlfi_helo) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Policy bank names */
+    if (mlfi->mlfi_policy_bank != NULL) {
+        logqidmsg(mlfi, LOG_DEBUG, "policy_bank=%s", mlfi->mlfi_policy_bank);
+        if (amavisd_request(mlfi, "policy_bank", mlfi->mlfi_policy_bank) == -1) {
+            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+                amavisd_socket, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+** MLFI_REQUEST_FILE - Write message file and end of amavisd request
+*/
+static int
+mlfi_request_file(struct mlfiCtx *mlfi)
+{
+    char        path[MAXPATHLEN];
+
+    /* File containing the original mail */
+    (void) mlfi_path(path, sizeof(path), mlfi->mlfi_fname);
+    logqidmsg(mlfi, LOG_DEBUG, "mail_file=%s", path);
+    if (amavisd_request(mlfi, "mail_file", path) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+
+    /* End of amavisd request */
+    if (amavisd_request(mlfi, NULL, NULL) == -1) {
+        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
+            amavisd_socket, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** MLFI_CONNECT_AHEAD - Connect to amavisd while the body is received
+**
+** mlfi_connect_ahead() takes a free amavisd connection without waiting for
+** it, connects to amavisd and writes the request without the message file,
+** so that only the rest of the request is left at the end of the message.
+** The connection is idle until the end of the message, so it is taken
+** only while less than half of the amavisd connections are used.  When no
+** connection is taken or amavisd fails, amavisd is connected at the end of
+** the message as usual.
+*/
+static void
+mlfi_connect_ahead(SMFICTX *ctx, struct mlfiCtx *mlfi)
+{
+    struct      sockaddr_un amavisd_sock;
+    unsigned long opens, rejected;
+    int         state, limit, used, queued;
+
+    /* Do not hold amavisd connections needed by other messages */
+    if (admit_enabled()) {
+        admit_status(&limit, &used, &queued);
+        if (queued > 0 || used >= limit / 2) {
+            return;
+        }
+    }
+
+    /* Do not hold a probe of the circuit breaker */
+    if (breaker_enabled()) {
+        breaker_status(&state, &opens, &rejected);
+        if (state != BREAKER_CLOSED) {
+            return;
+        }
+    }
+    if (mlfi_alloc_amabuf(mlfi) == -1 || mlfi_late_qid(ctx, mlfi) == -1) {
+        return;
+    }
+
+    /* A timeout which has already passed does not wait */
+    if (amavisd_connect(mlfi, &amavisd_sock, time(NULL), NULL, NULL) == -1) {
+        amavisd_disconnect(mlfi);
+        stats_phase(mlfi, PHASE_SPOOL);
+        return;
+    }
+    stats_phase(mlfi, PHASE_REQUEST);
+    logqidmsg(mlfi, LOG_DEBUG, "AMAVISD REQUEST AHEAD");
+    if (mlfi_request(mlfi) == -1 || amavisd_flush(mlfi) == -1) {
+        amavisd_disconnect(mlfi);
+    }
+    stats_phase(mlfi, PHASE_SPOOL);
+}
+
+
 /*
 ** MLFI_EOH - Handle the end of message headers
 **
@@ -863,14 +1534,19 @@ mlfi_eoh(SMFICTX *ctx)
     logqidmsg(mlfi, LOG_DEBUG, "MESSAGE BODY");
 
     /* Write the blank line between the header and the body */
-    (void) fprintf(mlfi->mlfi_fp, "\n");
+    mlfi_spooled(mlfi, fprintf(mlfi->mlfi_fp, "\n"));
     if (ferror(mlfi->mlfi_fp)) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s/%s: %s",
+            working_dir, mlfi->mlfi_fname, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
+    /* Connect to amavisd while the body is received */
+    if (amavisd_ahead) {
+        mlfi_connect_ahead(ctx, mlfi);
+    }
+
     /* Continue processing */
     return SMFIS_CONTINUE;
 }
@@ -900,13 +1576,15 @@ mlfi_body(SMFICTX *ctx, unsigned char * bodyp, size_t bodylen)
     if (mlfi->mlfi_cr_flag != 0) {
         mlfi->mlfi_cr_flag = 0;
         if (*bodyp != '\n') {
-            (void) fprintf(mlfi->mlfi_fp, "\r");
+            mlfi_spooled(mlfi, fprintf(mlfi->mlfi_fp, "\r"));
             if (ferror(mlfi->mlfi_fp)) {
                 logqidmsg(mlfi, LOG_ERR, "could not write to message file "
-                    "%s: %s", mlfi->mlfi_fname, strerror(errno));
+                    "%s/%s: %s", working_dir, mlfi->mlfi_fname,
+                    strerror(errno));
                 mlfi_setreply_tempfail(ctx);
                 return SMFIS_TEMPFAIL;
             }
+            cache_body(mlfi, (const unsigned char *) "\r", 1);
         }
     }
 
@@ -933,11 +1611,13 @@ mlfi_body(SMFICTX *ctx, unsigned char * bodyp, size_t bodylen)
 
     /* Write the body chunk to the message file */
     if (fwrite(bodyp, bodylen, 1, mlfi->mlfi_fp) < 1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
+        logqidmsg(mlfi, LOG_ERR, "could not write to message file %s/%s: %s",
+            working_dir, mlfi->mlfi_fname, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
+    mlfi_spooled(mlfi, bodylen);
+    cache_body(mlfi, bodyp, bodylen);
 
     /* Continue processing */
     return SMFIS_CONTINUE;
@@ -945,308 +1625,453 @@ mlfi_body(SMFICTX *ctx, unsigned char * bodyp, size_t bodylen)
 
 
 /*
-** MLFI_EOM - Handle the end of a message
-**
-** mlfi_eom() is called once after all calls to mlfi_body()
-** for a given message
+** MLFI_WAIT_PROGRESS - Keep MTA waiting for amavisd connection
 */
-sfsistat
-mlfi_eom(SMFICTX *ctx)
+static int
+mlfi_wait_progress(void *arg)
 {
-    int         i;
-    char       *idx, *header, *rcode, *xcode, *name, *value;
-    const char *qid;
-    sfsistat    rstat;
+    SMFICTX    *ctx = arg;
     struct      mlfiCtx *mlfi = MLFICTX(ctx);
-    struct      mlfiAddress *rcpt;
-    struct      sockaddr_un amavisd_sock;
-    time_t      start_counter;
-    int         wait_counter;
+    struct      timespec now;
+    int         waited;
 
-    /* Check milter private data */
-    if (mlfi == NULL) {
-        logqidmsg(mlfi, LOG_ERR, "mlfi_eom: context is not set");
-        mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
+    clock_now(&now);
+    waited = (int)(clock_usec(&mlfi->mlfi_phase_start, &now) / 1000000);
+#ifdef HAVE_SMFI_PROGRESS
+    logqidmsg(mlfi, LOG_DEBUG,
+        "amavisd connection is not available for %d sec, triggering sendmail",
+        waited);
+    if (smfi_progress(ctx) != MI_SUCCESS) {
+        logqidmsg(mlfi, LOG_ERR,
+           "could not notify MTA that an operation is still in progress");
+        return -1;
     }
+#else
+    logqidmsg(mlfi, LOG_DEBUG,
+        "amavisd connection not available for %d sec, waiting", waited);
+#endif
+    return 0;
+}
 
-    logqidmsg(mlfi, LOG_DEBUG, "CONTENT CHECK");
 
-    /* Close the message file */
-    if (mlfi->mlfi_fp == NULL) {
-        logqidmsg(mlfi, LOG_ERR, "message file %s is not opened",
-            mlfi->mlfi_fname);
-        mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
+#ifdef HAVE_SMFI_PROGRESS
+/*
+** MLFI_SCAN_PROGRESS - Keep MTA waiting for amavisd response
+*/
+static int
+mlfi_scan_progress(void *arg)
+{
+    SMFICTX    *ctx = arg;
+    struct      mlfiCtx *mlfi = MLFICTX(ctx);
+    struct      timespec now;
+
+    clock_now(&now);
+    logqidmsg(mlfi, LOG_DEBUG,
+        "amavisd is scanning the message for %d sec, triggering sendmail",
+        (int)(clock_usec(&mlfi->mlfi_phase_start, &now) / 1000000));
+    if (smfi_progress(ctx) != MI_SUCCESS) {
+        logqidmsg(mlfi, LOG_ERR,
+           "could not notify MTA that an operation is still in progress");
+        return -1;
     }
-    if (fclose(mlfi->mlfi_fp) == -1) {
-        mlfi->mlfi_fp = NULL;
-        logqidmsg(mlfi, LOG_ERR, "could not close message file %s: %s",
-            mlfi->mlfi_fname, strerror(errno));
-        mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
-    }
-    mlfi->mlfi_fp = NULL;
-    logqidmsg(mlfi, LOG_DEBUG, "close message file %s", mlfi->mlfi_fname);
-
-    /* Connect to amavisd */
-    if (max_sem != NULL) {
-        start_counter = time(NULL);
-        wait_counter = MIN(SMFI_PROGRESS_TRIGGER, max_wait);
-        while (amavisd_connect(mlfi, &amavisd_sock,
-            start_counter + wait_counter) == -1)
-        {
-            if (errno != AMAVISD_CONNECT_TIMEDOUT_ERRNO) {
-                if (ignore_amavisd_error) {
-                    return SMFIS_CONTINUE;
-                }
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            if (wait_counter >= max_wait) {
-                logqidmsg(mlfi, LOG_WARNING,
-                    "amavisd connection is not available for %d sec, giving up",
-                    wait_counter);
-                if (ignore_amavisd_error) {
-                    return SMFIS_CONTINUE;
-                }
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-#ifdef HAVE_SMFI_PROGRESS
-            logqidmsg(mlfi, LOG_DEBUG,
-                "amavisd connection is not available for %d sec, "
-                "triggering sendmail", wait_counter);
-            if (smfi_progress(ctx) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR,
-                   "could not notify MTA that an operation is still in "
-                   "progress");
-                if (ignore_amavisd_error) {
-                    return SMFIS_CONTINUE;
-                }
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-#else
-            logqidmsg(mlfi, LOG_DEBUG,
-                "amavisd connection not available for %d sec, waiting",
-                wait_counter);
+    return 0;
+}
 #endif
-            wait_counter += MIN(SMFI_PROGRESS_TRIGGER, max_wait - wait_counter);
+
+
+/*
+** MLFI_RESPONSE - Apply amavisd response line
+**
+** mlfi_response() returns -1 when the line is not valid or could not be
+** applied, the reply is set to tempfail then
+*/
+static int
+mlfi_response(SMFICTX *ctx, struct mlfiCtx *mlfi, char *name, char *value,
+    sfsistat *rstat)
+{
+    int         i;
+    char       *idx, *header, *rcode, *xcode;
+
+    /* AM.PDP protocol version */
+    /* version_server=<value> */
+    if (strcmp(name, "version_server") == 0) {
+        logqidmsg(mlfi, LOG_DEBUG, "%s=%s", name, value);
+        i = (int) strtol(value, &header, 10);
+        if (header != NULL && *header != '\0') {
+            logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s", name, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
         }
-        logqidmsg(mlfi, LOG_DEBUG, "got amavisd connection for %d sec",
-            (int)(time(NULL) - start_counter));
-#ifdef HAVE_SMFI_PROGRESS
-        if (smfi_progress(ctx) != MI_SUCCESS) {
+        if (i > AMPDP_VERSION) {
             logqidmsg(mlfi, LOG_ERR,
-                "could not notify MTA that an operation is still in progress");
-            amavisd_close(mlfi);
+               "incompatible AM.PDP protocol version %s", value);
             mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
+            return -1;
         }
+
+    /* Add recipient */
+    /* addrcpt=<value> */
+    } else if (strcmp(name, "addrcpt") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        if (smfi_addrcpt(ctx, value) != MI_SUCCESS) {
+            logqidmsg(mlfi, LOG_ERR, "could not add recipient %s", value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+
+    /* Delete recipient */
+    /* delrcpt=<value> */
+    } else if (strcmp(name, "delrcpt") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        if (smfi_delrcpt(ctx, value) != MI_SUCCESS) {
+            logqidmsg(mlfi, LOG_ERR, "could not delete recipient %s",
+                value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+
+    /* Append header */
+    /* addheader=<header> <value> */
+    } else if (strcmp(name, "addheader") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        header = value;
+        if ((value = strchr(header, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, header);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+#ifdef HAVE_SMFI_INSHEADER
+        if (smfi_insheader(ctx, INT_MAX, header, value) != MI_SUCCESS) {
+#else
+        if (smfi_addheader(ctx, header, value) != MI_SUCCESS) {
 #endif
-    } else {
-        if (amavisd_connect(mlfi, &amavisd_sock, 0) == -1) {
-            logqidmsg(mlfi, LOG_ERR,
-                "could not connect to amavisd socket %s: %s",
-                amavisd_socket, strerror(errno));
-                if (ignore_amavisd_error) {
-                    return SMFIS_CONTINUE;
-                }
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
+            logqidmsg(mlfi, LOG_ERR, "could not append header %s: %s",
+                header, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
         }
-    }
 
-    logqidmsg(mlfi, LOG_DEBUG, "AMAVISD REQUEST");
+    /* Insert header */
+    /* insheader=<index> <header> <value> */
+    } else if (strcmp(name, "insheader") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        idx = value;
+        if ((value = strchr(idx, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+        i = (int) strtol(idx, &header, 10);
+        if (header != NULL && *header != '\0') {
+            logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
+                name, idx, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        header = value;
+        if ((value = strchr(header, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
+                name, idx, header);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+#ifdef HAVE_SMFI_INSHEADER
+        if (smfi_insheader(ctx, i, header, value) != MI_SUCCESS) {
+#else
+        if (smfi_addheader(ctx, header, value) != MI_SUCCESS) {
+#endif
+            logqidmsg(mlfi, LOG_ERR, "could not insert header %s %s: %s",
+                idx, header, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
 
-    /* AM.PDP protocol prologue */
-    logqidmsg(mlfi, LOG_DEBUG, "request=AM.PDP");
-    if (amavisd_request(mlfi, "request", "AM.PDP") == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
+    /* Change header */
+    /* chgheader=<index> <header> <value> */
+    } else if (strcmp(name, "chgheader") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        idx = value;
+        if ((value = strchr(idx, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+        i = (int) strtol(idx, &header, 10);
+        if (header != NULL && *header != '\0') {
+            logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
+                name, idx, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        header = value;
+        if ((value = strchr(header, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
+                name, idx, header);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+        if (smfi_chgheader(ctx, header, i, value) != MI_SUCCESS) {
+            logqidmsg(mlfi, LOG_ERR, "could not change header %s %s: %s",
+                idx, header, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
         }
-        mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
-    }
 
-    /* Get queue id (Postfix does give information about */
-    /* the queue-number only after the RCPT-TO-phase */
-    if (mlfi->mlfi_qid == NULL) {
-        if ((qid = smfi_getsymval(ctx, "i")) != NULL) {
-            if ((mlfi->mlfi_qid = strdup(qid)) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "could not allocate memory");
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
+    /* Delete header */
+    /* delheader=<index> <header> */
+    } else if (strcmp(name, "delheader") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        idx = value;
+        if ((value = strchr(idx, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+        i = (int) strtol(idx, &header, 10);
+        if (header != NULL && *header != '\0') {
+            logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
+                name, idx, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        if (smfi_chgheader(ctx, value, i, NULL) != MI_SUCCESS) {
+            logqidmsg(mlfi, LOG_ERR, "could not delete header %s %s:",
+                idx, value);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
         }
-    }
 
-    /* MTA queue id */
-    if (mlfi->mlfi_qid != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "queue_id=%s", mlfi->mlfi_qid);
-        if (amavisd_request(mlfi, "queue_id", mlfi->mlfi_qid) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
-            amavisd_close(mlfi);
-            if (ignore_amavisd_error) {
-                return SMFIS_CONTINUE;
-            }
+#ifdef HAVE_SMFI_QUARANTINE
+    /* Quarantine message */
+    /* quarantine=<reason> */
+    } else if (strcmp(name, "quarantine") == 0) {
+        logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
+        if (smfi_quarantine(ctx, value) != MI_SUCCESS) {
+            logqidmsg(mlfi, LOG_ERR, "could not quarantine message (%s)",
+                value);
             mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
+            return -1;
         }
-    }
+#endif
 
-    /* Communication protocol */
-    if (mlfi->mlfi_protocol != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "protocol_name=%s", mlfi->mlfi_protocol);
-        if (amavisd_request(mlfi, "protocol_name", mlfi->mlfi_protocol) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
-            amavisd_close(mlfi);
-            if (ignore_amavisd_error) {
-                return SMFIS_CONTINUE;
-            }
+    /* Set response code */
+    /* return_value=<value> */
+    } else if (strcmp(name, "return_value") == 0) {
+        logqidmsg(mlfi, LOG_NOTICE, "%s=%s", name, value);
+        if (strcmp(value, "continue") == 0) {
+            *rstat = SMFIS_CONTINUE;
+        } else if (strcmp(value, "accept") == 0) {
+            *rstat = SMFIS_ACCEPT;
+        } else if (strcmp(value, "reject") == 0) {
+            *rstat = SMFIS_REJECT;
+        } else if (strcmp(value, "discard") == 0) {
+            *rstat = SMFIS_DISCARD;
+        } else if (strcmp(value, "tempfail") == 0) {
+            *rstat = SMFIS_TEMPFAIL;
+        } else {
+            logqidmsg(mlfi, LOG_ERR, "unknown return value %s", value);
             mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
+            return -1;
         }
-    }
 
-    /* Envelope sender address */
-    logqidmsg(mlfi, LOG_DEBUG, "sender=%s", mlfi->mlfi_from);
-    if (amavisd_request(mlfi, "sender", mlfi->mlfi_from) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
+    /* Set SMTP reply */
+    /* setreply=<rcode> <xcode> <value> */
+    } else if (strcmp(name, "setreply") == 0) {
+        rcode = value;
+        if ((value = strchr(rcode, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s",
+                name, rcode);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
         }
+        *value++ = '\0';
+        xcode = value;
+        if ((value = strchr(xcode, ' ')) == NULL) {
+            logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
+                name, rcode, xcode);
+            mlfi_setreply_tempfail(ctx);
+            return -1;
+        }
+        *value++ = '\0';
+        /* smfi_setreply accept only 4xx and 5XX codes */
+        if (*rcode == '4' || *rcode == '5') {
+            logqidmsg(mlfi, LOG_INFO, "%s=%s %s %s", name, rcode, xcode,
+                value);
+            if (smfi_setreply(ctx, rcode, xcode, value) != MI_SUCCESS) {
+                logqidmsg(mlfi, LOG_ERR, "could not set reply %s %s %s",
+                    rcode, xcode, value);
+                mlfi_setreply_tempfail(ctx);
+                return -1;
+            }
+        } else {
+            logqidmsg(mlfi, LOG_DEBUG, "%s=%s %s %s", name, rcode, xcode,
+                value);
+        }
+
+    /* Amavisd log id */
+    /* log_id=<value> */
+    } else if (strcmp(name, "log_id") == 0) {
+        logqidmsg(mlfi, LOG_NOTICE, "%s=%s", name, value);
+        mlfi->mlfi_log_id = arena_strdup(&mlfi->mlfi_msg_arena, value);
+
+    /* Exit code */
+    /* exit_code=<value> */
+    } else if (strcmp(name, "exit_code") == 0) {
+        /* ignore legacy exit_code */
+        logqidmsg(mlfi, LOG_DEBUG, "%s=%s", name, value);
+
+    /* Unknown response */
+    } else {
+        logqidmsg(mlfi, LOG_ERR, "unknown amavisd response %s=%s",
+            name, value);
         mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
+        return -1;
     }
+    return 0;
+}
 
-    /* Envelope recipient addresses */
-    rcpt = mlfi->mlfi_rcpt;
-    while (rcpt != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "recipient=%s", rcpt->q_paddr);
-        if (amavisd_request(mlfi, "recipient", rcpt->q_paddr) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
-            amavisd_close(mlfi);
-            if (ignore_amavisd_error) {
-                return SMFIS_CONTINUE;
-            }
-            mlfi_setreply_tempfail(ctx);
+
+/*
+** MLFI_REPLAY - Apply response lines of the cached verdict
+*/
+static sfsistat
+mlfi_replay(SMFICTX *ctx, struct mlfiCtx *mlfi, char *verdict, int len,
+    sfsistat rstat)
+{
+    char       *name, *value, *next, *end = verdict + len;
+
+    /* The value is split while the line is applied */
+    for (name = verdict; name < end; name = next) {
+        value = name + strlen(name) + 1;
+        next = value + strlen(value) + 1;
+        if (mlfi_response(ctx, mlfi, name, value, &rstat) == -1) {
             return SMFIS_TEMPFAIL;
         }
-        rcpt = rcpt->q_next;
     }
+    return rstat;
+}
 
-    /* Working directory */
-    logqidmsg(mlfi, LOG_DEBUG, "tempdir=%s", mlfi->mlfi_wrkdir);
-    if (amavisd_request(mlfi, "tempdir", mlfi->mlfi_wrkdir) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
-        }
+
+/*
+** MLFI_CONTENT_CHECK - Send the message to amavisd and apply its response
+*/
+static sfsistat
+mlfi_content_check(SMFICTX *ctx, struct mlfiCtx *mlfi)
+{
+    char       *name, *value;
+    char        verdict[CACHEVERDICT];
+    sfsistat    rstat;
+    struct      sockaddr_un amavisd_sock;
+    time_t      start_counter;
+    int         wait_limit, recorded;
+    uint64_t    key = 0;
+
+    logqidmsg(mlfi, LOG_DEBUG, "CONTENT CHECK");
+
+    /* Close the message file */
+    if (mlfi->mlfi_fp == NULL) {
+        logqidmsg(mlfi, LOG_ERR, "message file is not opened");
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
-
-    /* Who is responsible for removing the working directory */
-    logqidmsg(mlfi, LOG_DEBUG, "tempdir_removed_by=client");
-    if (amavisd_request(mlfi, "tempdir_removed_by", "client") == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
-        }
+    __atomic_store_n(&mlfi->mlfi_size, ftell(mlfi->mlfi_fp), __ATOMIC_RELAXED);
+    if (fclose(mlfi->mlfi_fp) == -1) {
+        mlfi->mlfi_fp = NULL;
+        logqidmsg(mlfi, LOG_ERR, "could not close message file %s/%s: %s",
+            working_dir, mlfi->mlfi_fname, strerror(errno));
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
+    mlfi->mlfi_fp = NULL;
+    logqidmsg(mlfi, LOG_DEBUG, "close message file %s/%s", working_dir,
+        mlfi->mlfi_fname);
 
-    /* File containing the original mail */
-    logqidmsg(mlfi, LOG_DEBUG, "mail_file=%s", mlfi->mlfi_fname);
-    if (amavisd_request(mlfi, "mail_file", mlfi->mlfi_fname) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
-        }
+    /* Allocate amavisd communication buffer */
+    if (mlfi_alloc_amabuf(mlfi) == -1) {
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
-    /* Who is responsible for forwarding the message */
-    logqidmsg(mlfi, LOG_DEBUG, "delivery_care_of=%s", delivery_care_of);
-    if (amavisd_request(mlfi, "delivery_care_of", delivery_care_of) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
-        }
+    /* Get queue id */
+    if (mlfi_late_qid(ctx, mlfi) == -1) {
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
 
-    /* IP address of the original SMTP client */
-    logqidmsg(mlfi, LOG_DEBUG, "client_address=%s", mlfi->mlfi_client_addr);
-    if (amavisd_request(mlfi, "client_address", mlfi->mlfi_client_addr) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
-        amavisd_close(mlfi);
-        if (ignore_amavisd_error) {
-            return SMFIS_CONTINUE;
+    /* Replay the verdict of the same message */
+    recorded = -1;
+    if (cache_enabled()) {
+        key = cache_key(mlfi);
+        if ((recorded = cache_lookup(key, verdict, sizeof(verdict), &rstat)) !=
+            -1)
+        {
+            logqidmsg(mlfi, LOG_INFO, "verdict replayed from cache");
+            amavisd_close(mlfi);
+            mlfi->mlfi_cached = 1;
+            return mlfi_replay(ctx, mlfi, verdict, recorded, rstat);
         }
-        mlfi_setreply_tempfail(ctx);
-        return SMFIS_TEMPFAIL;
+        recorded = 0;
     }
 
-    /* DNS name of the original SMTP client */
-    if (mlfi->mlfi_client_host != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "client_name=%s", mlfi->mlfi_client_host);
-        if (amavisd_request(mlfi, "client_name", mlfi->mlfi_client_host) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
-            amavisd_close(mlfi);
-            if (ignore_amavisd_error) {
-                return SMFIS_CONTINUE;
-            }
-            mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
+    /* Finish the request on the connection opened ahead */
+    if (mlfi->mlfi_amasd != -1) {
+        stats_phase(mlfi, PHASE_REQUEST);
+        logqidmsg(mlfi, LOG_DEBUG, "AMAVISD REQUEST");
+        if (mlfi_request_file(mlfi) == -1) {
+            logqidmsg(mlfi, LOG_NOTICE,
+                "amavisd connection opened ahead failed, reconnecting");
+            amavisd_disconnect(mlfi);
         }
     }
 
-    /* The value of the HELO or EHLO specified by the original SMTP client */
-    if (mlfi->mlfi_helo != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "helo_name=%s", mlfi->mlfi_helo);
-        if (amavisd_request(mlfi, "helo_name", mlfi->mlfi_helo) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
-            amavisd_close(mlfi);
-            if (ignore_amavisd_error) {
-                return SMFIS_CONTINUE;
+    /* Connect to amavisd */
+    if (mlfi->mlfi_amasd == -1) {
+        if (admit_enabled()) {
+            start_counter = time(NULL);
+            wait_limit = __atomic_load_n(&max_wait, __ATOMIC_RELAXED);
+            if (amavisd_connect(mlfi, &amavisd_sock,
+                start_counter + wait_limit, mlfi_wait_progress, ctx) == -1)
+            {
+                if (errno == ETIMEDOUT) {
+                    logqidmsg(mlfi, LOG_WARNING, "amavisd connection is not "
+                        "available for %d sec, giving up", wait_limit);
+                }
+                if (ignore_amavisd_error) {
+                    return SMFIS_CONTINUE;
+                }
+                mlfi_setreply_tempfail(ctx);
+                return SMFIS_TEMPFAIL;
+            }
+            logqidmsg(mlfi, LOG_DEBUG, "got amavisd connection for %d sec",
+                (int)(time(NULL) - start_counter));
+#ifdef HAVE_SMFI_PROGRESS
+            if (smfi_progress(ctx) != MI_SUCCESS) {
+                logqidmsg(mlfi, LOG_ERR, "could not notify MTA that an "
+                    "operation is still in progress");
+                amavisd_close(mlfi);
+                mlfi_setreply_tempfail(ctx);
+                return SMFIS_TEMPFAIL;
+            }
+#endif
+        } else {
+            if (amavisd_connect(mlfi, &amavisd_sock, 0, NULL, NULL) == -1) {
+                if (ignore_amavisd_error) {
+                    return SMFIS_CONTINUE;
+                }
+                mlfi_setreply_tempfail(ctx);
+                return SMFIS_TEMPFAIL;
             }
-            mlfi_setreply_tempfail(ctx);
-            return SMFIS_TEMPFAIL;
         }
-    }
 
-    /* Policy bank names */
-    if (mlfi->mlfi_policy_bank != NULL) {
-        logqidmsg(mlfi, LOG_DEBUG, "policy_bank=%s", mlfi->mlfi_policy_bank);
-        if (amavisd_request(mlfi, "policy_bank", mlfi->mlfi_policy_bank) == -1) {
-            logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-                amavisd_socket, strerror(errno));
+        stats_phase(mlfi, PHASE_REQUEST);
+        logqidmsg(mlfi, LOG_DEBUG, "AMAVISD REQUEST");
+        if (mlfi_request(mlfi) == -1 || mlfi_request_file(mlfi) == -1) {
             amavisd_close(mlfi);
             if (ignore_amavisd_error) {
                 return SMFIS_CONTINUE;
@@ -1256,10 +2081,19 @@ mlfi_eom(SMFICTX *ctx)
         }
     }
 
-    /* End of amavisd request */
-    if (amavisd_request(mlfi, NULL, NULL) == -1) {
-        logqidmsg(mlfi, LOG_ERR, "could not write to socket %s: %s",
-            amavisd_socket, strerror(errno));
+    logqidmsg(mlfi, LOG_DEBUG, "AMAVISD RESPONSE");
+
+    /* Process response from amavisd */
+    stats_phase(mlfi, PHASE_RESPONSE);
+#ifdef HAVE_SMFI_PROGRESS
+    if (progress_interval > 0 && amavisd_wait(mlfi, progress_interval,
+        mlfi_scan_progress, ctx) == -1)
+    {
+        if (errno != ECANCELED) {
+            logqidmsg(mlfi, LOG_ERR,
+                "could not read from amavisd socket %s: %s",
+                amavisd_socket, strerror(errno));
+        }
         amavisd_close(mlfi);
         if (ignore_amavisd_error) {
             return SMFIS_CONTINUE;
@@ -1267,17 +2101,18 @@ mlfi_eom(SMFICTX *ctx)
         mlfi_setreply_tempfail(ctx);
         return SMFIS_TEMPFAIL;
     }
-
-    logqidmsg(mlfi, LOG_DEBUG, "AMAVISD RESPONSE");
-
-    /* Process response from amavisd */
+#endif
     rstat = SMFIS_TEMPFAIL;
     while (amavisd_response(mlfi) != -1) {
         name = mlfi->mlfi_amabuf;
 
         /* Last response */
         if (*name == '\0') {
+            stats_phase(mlfi, PHASE_DONE);
             amavisd_close(mlfi);
+            if (recorded != -1) {
+                cache_store(key, rstat, verdict, recorded);
+            }
             return rstat;
         }
 
@@ -1291,267 +2126,12 @@ mlfi_eom(SMFICTX *ctx)
         }
         *value++ = '\0';
 
-        /* AM.PDP protocol version */
-        /* version_server=<value> */
-        if (strcmp(name, "version_server") == 0) {
-            logqidmsg(mlfi, LOG_DEBUG, "%s=%s", name, value);
-            i = (int) strtol(value, &header, 10);
-            if (header != NULL && *header != '\0') {
-                logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s", name, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            if (i > AMPDP_VERSION) {
-                logqidmsg(mlfi, LOG_ERR,
-                   "incompatible AM.PDP protocol version %s", value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Add recipient */
-        /* addrcpt=<value> */
-        } else if (strcmp(name, "addrcpt") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            if (smfi_addrcpt(ctx, value) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR, "could not add recipient %s", value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Delete recipient */
-        /* delrcpt=<value> */
-        } else if (strcmp(name, "delrcpt") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            if (smfi_delrcpt(ctx, value) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR, "could not delete recipient %s",
-                    value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Append header */
-        /* addheader=<header> <value> */
-        } else if (strcmp(name, "addheader") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            header = value;
-            if ((value = strchr(header, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, header);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-#ifdef HAVE_SMFI_INSHEADER
-            if (smfi_insheader(ctx, INT_MAX, header, value) != MI_SUCCESS) {
-#else
-            if (smfi_addheader(ctx, header, value) != MI_SUCCESS) {
-#endif
-                logqidmsg(mlfi, LOG_ERR, "could not append header %s: %s",
-                    header, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Insert header */
-        /* insheader=<index> <header> <value> */
-        } else if (strcmp(name, "insheader") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            idx = value;
-            if ((value = strchr(idx, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            i = (int) strtol(idx, &header, 10);
-            if (header != NULL && *header != '\0') {
-                logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
-                    name, idx, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            header = value;
-            if ((value = strchr(header, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
-                    name, idx, header);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-#ifdef HAVE_SMFI_INSHEADER
-            if (smfi_insheader(ctx, i, header, value) != MI_SUCCESS) {
-#else
-            if (smfi_addheader(ctx, header, value) != MI_SUCCESS) {
-#endif
-                logqidmsg(mlfi, LOG_ERR, "could not insert header %s %s: %s",
-                    idx, header, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Change header */
-        /* chgheader=<index> <header> <value> */
-        } else if (strcmp(name, "chgheader") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            idx = value;
-            if ((value = strchr(idx, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            i = (int) strtol(idx, &header, 10);
-            if (header != NULL && *header != '\0') {
-                logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
-                    name, idx, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            header = value;
-            if ((value = strchr(header, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
-                    name, idx, header);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            if (smfi_chgheader(ctx, header, i, value) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR, "could not change header %s %s: %s",
-                    idx, header, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Delete header */
-        /* delheader=<index> <header> */
-        } else if (strcmp(name, "delheader") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            idx = value;
-            if ((value = strchr(idx, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s", name, idx);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            i = (int) strtol(idx, &header, 10);
-            if (header != NULL && *header != '\0') {
-                logqidmsg(mlfi, LOG_ERR, "malformed line %s=%s %s",
-                    name, idx, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            if (smfi_chgheader(ctx, value, i, NULL) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR, "could not delete header %s %s:",
-                    idx, value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-#ifdef HAVE_SMFI_QUARANTINE
-        /* Quarantine message */
-        /* quarantine=<reason> */
-        } else if (strcmp(name, "quarantine") == 0) {
-            logqidmsg(mlfi, LOG_INFO, "%s=%s", name, value);
-            if (smfi_quarantine(ctx, value) != MI_SUCCESS) {
-                logqidmsg(mlfi, LOG_ERR, "could not quarantine message (%s)",
-                    value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-#endif
-
-        /* Set response code */
-        /* return_value=<value> */
-        } else if (strcmp(name, "return_value") == 0) {
-            logqidmsg(mlfi, LOG_NOTICE, "%s=%s", name, value);
-            if (strcmp(value, "continue") == 0) {
-                rstat = SMFIS_CONTINUE;
-            } else if (strcmp(value, "accept") == 0) {
-                rstat = SMFIS_ACCEPT;
-            } else if (strcmp(value, "reject") == 0) {
-                rstat = SMFIS_REJECT;
-            } else if (strcmp(value, "discard") == 0) {
-                rstat = SMFIS_DISCARD;
-            } else if (strcmp(value, "tempfail") == 0) {
-                rstat = SMFIS_TEMPFAIL;
-            } else {
-                logqidmsg(mlfi, LOG_ERR, "unknown return value %s", value);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-
-        /* Set SMTP reply */
-        /* setreply=<rcode> <xcode> <value> */
-        } else if (strcmp(name, "setreply") == 0) {
-            rcode = value;
-            if ((value = strchr(rcode, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s",
-                    name, rcode);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            xcode = value;
-            if ((value = strchr(xcode, ' ')) == NULL) {
-                logqidmsg(mlfi, LOG_ERR, "malformed line: %s=%s %s",
-                    name, rcode, xcode);
-                amavisd_close(mlfi);
-                mlfi_setreply_tempfail(ctx);
-                return SMFIS_TEMPFAIL;
-            }
-            *value++ = '\0';
-            /* smfi_setreply accept only 4xx and 5XX codes */
-            if (*rcode == '4' || *rcode == '5') {
-                logqidmsg(mlfi, LOG_INFO, "%s=%s %s %s", name, rcode, xcode,
-                    value);
-                if (smfi_setreply(ctx, rcode, xcode, value) != MI_SUCCESS) {
-                    logqidmsg(mlfi, LOG_ERR, "could not set reply %s %s %s",
-                        rcode, xcode, value);
-                    amavisd_close(mlfi);
-                    mlfi_setreply_tempfail(ctx);
-                    return SMFIS_TEMPFAIL;
-                }
-            } else {
-                logqidmsg(mlfi, LOG_DEBUG, "%s=%s %s %s", name, rcode, xcode,
-                    value);
-            }
-
-        /* Amavisd log id */
-        /* log_id=<value> */
-        } else if (strcmp(name, "log_id") == 0) {
-            logqidmsg(mlfi, LOG_NOTICE, "%s=%s", name, value);
-
-        /* Exit code */
-        /* exit_code=<value> */
-        } else if (strcmp(name, "exit_code") == 0) {
-            /* ignore legacy exit_code */
-            logqidmsg(mlfi, LOG_DEBUG, "%s=%s", name, value);
+        /* Record the response for the verdict cache */
+        recorded = cache_record(verdict, sizeof(verdict), recorded, name,
+            value);
 
-        /* Unknown response */
-        } else {
-            logqidmsg(mlfi, LOG_ERR, "unknown amavisd response %s=%s",
-                name, value);
+        if (mlfi_response(ctx, mlfi, name, value, &rstat) == -1) {
             amavisd_close(mlfi);
-            mlfi_setreply_tempfail(ctx);
             return SMFIS_TEMPFAIL;
         }
     }
@@ -1569,6 +2149,192 @@ mlfi_eom(SMFICTX *ctx)
 }
 
 
+/*
+** MLFI_JSON_STRING - Append JSON string to buffer
+*/
+static char *
+mlfi_json_string(char *b, const char *end, const char *s)
+{
+    char        esc[8];
+
+    b = mlfi_append(b, end, "\"");
+    for (; *s != '\0' && b < end - 1; s++) {
+        if (*s == '"' || *s == '\\') {
+            esc[0] = '\\';
+            esc[1] = *s;
+            esc[2] = '\0';
+            b = mlfi_append(b, end, esc);
+        } else if ((unsigned char)*s < 0x20) {
+            (void) snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+            b = mlfi_append(b, end, esc);
+        } else {
+            *b++ = *s;
+            *b = '\0';
+        }
+    }
+    return mlfi_append(b, end, "\"");
+}
+
+
+/*
+** MLFI_SUMMARY - Log one line summary of the message
+**
+** The summary contains the message identification, the verdict and the
+** durations of the message phases in milliseconds:
+**
+** spool    MAIL FROM to the end of the message
+** wait     waiting for a free amavisd connection
+** connect  connecting to amavisd
+** scan     amavisd request and response
+** cleanup  removing the working directory
+** total    MAIL FROM to the end of the cleanup
+*/
+static void
+mlfi_summary(struct mlfiCtx *mlfi, sfsistat rstat, const char *qid,
+    const char *log_id, unsigned int rcpts, const struct timespec *eom,
+    const struct timespec *scanned, const struct timespec *done)
+{
+    char        buf[MAXLOGBUF];
+    char        num[64];
+    char       *b = buf;
+    const char *end = buf + sizeof(buf);
+    const char *verdict;
+    long        scan;
+    int         json = summary_format == SUMMARY_JSON;
+    struct {
+        const char *name;
+        long        usec;
+    } phase[6];
+    unsigned int i;
+
+    switch (rstat) {
+    case SMFIS_CONTINUE:
+        verdict = "continue";
+        break;
+    case SMFIS_ACCEPT:
+        verdict = "accept";
+        break;
+    case SMFIS_REJECT:
+        verdict = "reject";
+        break;
+    case SMFIS_DISCARD:
+        verdict = "discard";
+        break;
+    default:
+        verdict = "tempfail";
+        break;
+    }
+
+    scan = clock_usec(eom, scanned) - mlfi->mlfi_wait_usec -
+        mlfi->mlfi_connect_usec;
+    phase[0].name = "spool_ms";
+    phase[0].usec = clock_usec(&mlfi->mlfi_start, eom);
+    phase[1].name = "wait_ms";
+    phase[1].usec = mlfi->mlfi_wait_usec;
+    phase[2].name = "connect_ms";
+    phase[2].usec = mlfi->mlfi_connect_usec;
+    phase[3].name = "scan_ms";
+    phase[3].usec = scan > 0 ? scan : 0;
+    phase[4].name = "cleanup_ms";
+    phase[4].usec = clock_usec(scanned, done);
+    phase[5].name = "total_ms";
+    phase[5].usec = clock_usec(&mlfi->mlfi_start, done);
+
+    /* Message identification and verdict */
+    if (json) {
+        b = mlfi_append(b, end, "{\"qid\":");
+        b = *qid != '\0' ? mlfi_json_string(b, end, qid) :
+            mlfi_append(b, end, "null");
+        b = mlfi_append(b, end, ",\"log_id\":");
+        b = *log_id != '\0' ? mlfi_json_string(b, end, log_id) :
+            mlfi_append(b, end, "null");
+        b = mlfi_append(b, end, ",\"verdict\":\"");
+        b = mlfi_append(b, end, verdict);
+        b = mlfi_append(b, end, "\"");
+    } else {
+        b = mlfi_append(b, end, "qid=");
+        b = mlfi_append(b, end, *qid != '\0' ? qid : "-");
+        b = mlfi_append(b, end, " log_id=");
+        b = mlfi_append(b, end, *log_id != '\0' ? log_id : "-");
+        b = mlfi_append(b, end, " verdict=");
+        b = mlfi_append(b, end, verdict);
+    }
+
+    /* Recipients and size */
+    (void) snprintf(num, sizeof(num), json ? ",\"rcpts\":%u,\"size\":%ld" :
+        " rcpts=%u size=%ld", rcpts, mlfi->mlfi_size);
+    b = mlfi_append(b, end, num);
+
+    /* Phase durations */
+    for (i = 0; i < sizeof(phase) / sizeof(phase[0]); i++) {
+        (void) snprintf(num, sizeof(num), json ? ",\"%s\":%ld.%03ld" :
+            " %s=%ld.%03ld", phase[i].name, phase[i].usec / 1000,
+            phase[i].usec % 1000);
+        b = mlfi_append(b, end, num);
+    }
+    if (json) {
+        b = mlfi_append(b, end, "}");
+    }
+
+    logmsg_print(LOG_NOTICE, "%s", buf);
+}
+
+
+/*
+** MLFI_EOM - Handle the end of a message
+**
+** mlfi_eom() is called once after all calls to mlfi_body()
+** for a given message
+*/
+sfsistat
+mlfi_eom(SMFICTX *ctx)
+{
+    struct      mlfiCtx *mlfi = MLFICTX(ctx);
+    struct      timespec eom, scanned, done;
+    char        qid[MAXQIDLEN];
+    char        log_id[MAXQIDLEN];
+    unsigned int rcpts;
+    int         phase;
+    sfsistat    rstat;
+
+    /* Check milter private data */
+    if (mlfi == NULL) {
+        logqidmsg(mlfi, LOG_ERR, "mlfi_eom: context is not set");
+        mlfi_setreply_tempfail(ctx);
+        return SMFIS_TEMPFAIL;
+    }
+
+    /* Check message content */
+    clock_now(&eom);
+    rstat = mlfi_content_check(ctx, mlfi);
+    clock_now(&scanned);
+    phase = mlfi->mlfi_phase;
+
+    /* Keep message data for the summary */
+    qid[0] = '\0';
+    if (mlfi->mlfi_qid != NULL) {
+        (void) strlcpy(qid, mlfi->mlfi_qid, sizeof(qid));
+    }
+    log_id[0] = '\0';
+    if (mlfi->mlfi_log_id != NULL) {
+        (void) strlcpy(log_id, mlfi->mlfi_log_id, sizeof(log_id));
+    }
+    rcpts = mlfi->mlfi_rcpt_count;
+
+    /* Remove working directory as soon as the message is checked */
+    mlfi_cleanup_message(mlfi);
+    clock_now(&done);
+    stats_message(mlfi, rstat, phase, &eom, &done);
+
+    /* Log message summary */
+    if (summary_format != SUMMARY_OFF) {
+        mlfi_summary(mlfi, rstat, qid, log_id, rcpts, &eom, &scanned, &done);
+    }
+
+    return rstat;
+}
+
+
 /*
 ** MLFI_ABORT - Handle the current message's being aborted
 **
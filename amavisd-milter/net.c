@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+
+/*
+** NET_PARSE - Parse network address[/prefix]
+**
+** The prefix separator in value is overwritten
+*/
+int
+net_parse(struct mlfiNet *net, char *value)
+{
+    char       *p;
+    char       *end;
+    int         max;
+
+    if ((p = strchr(value, '/')) != NULL) {
+        *p++ = '\0';
+    }
+    if (inet_pton(AF_INET, value, net->n_addr) == 1) {
+        net->n_family = AF_INET;
+        max = 32;
+#if HAVE_DECL_AF_INET6 && HAVE_STRUCT_SOCKADDR_IN6
+    } else if (inet_pton(AF_INET6, value, net->n_addr) == 1) {
+        net->n_family = AF_INET6;
+        max = 128;
+#endif
+    } else {
+        return -1;
+    }
+    net->n_prefix = max;
+    if (p != NULL) {
+        net->n_prefix = (int) strtol(p, &end, 10);
+        if (*p == '\0' || *end != '\0' || net->n_prefix < 0 ||
+            net->n_prefix > max)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** NET_MATCH - Check if client address is in the network
+*/
+int
+net_match(const struct mlfiNet *net, const _SOCK_ADDR *hostaddr)
+{
+    const unsigned char *addr;
+    int         bytes, bits;
+
+    if (hostaddr == NULL || hostaddr->sa_family != net->n_family) {
+        return 0;
+    }
+    switch (net->n_family) {
+    case AF_INET:
+        addr = (const unsigned char *)
+            &((const struct sockaddr_in *)hostaddr)->sin_addr;
+        break;
+#if HAVE_DECL_AF_INET6 && HAVE_STRUCT_SOCKADDR_IN6
+    case AF_INET6:
+        addr = (const unsigned char *)
+            &((const struct sockaddr_in6 *)hostaddr)->sin6_addr;
+        break;
+#endif
+    default:
+        return 0;
+    }
+    bytes = net->n_prefix / 8;
+    bits = net->n_prefix % 8;
+    if (memcmp(addr, net->n_addr, bytes) != 0) {
+        return 0;
+    }
+    return bits == 0 ||
+        ((addr[bytes] ^ net->n_addr[bytes]) & (0xff00 >> bits) & 0xff) == 0;
+}
+
+
+/*
+** NET_ADDR - Get address of the client
+**
+** net_addr() returns -1 when the client address is not IPv4 or IPv6
+*/
+int
+net_addr(struct mlfiNet *net, const _SOCK_ADDR *hostaddr)
+{
+    (void) memset(net, '\0', sizeof(*net));
+    if (hostaddr == NULL) {
+        return -1;
+    }
+    switch (hostaddr->sa_family) {
+    case AF_INET:
+        (void) memcpy(net->n_addr,
+            &((const struct sockaddr_in *)hostaddr)->sin_addr, 4);
+        net->n_prefix = 32;
+        break;
+#if HAVE_DECL_AF_INET6 && HAVE_STRUCT_SOCKADDR_IN6
+    case AF_INET6:
+        (void) memcpy(net->n_addr,
+            &((const struct sockaddr_in6 *)hostaddr)->sin6_addr, 16);
+        net->n_prefix = 128;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    net->n_family = hostaddr->sa_family;
+    return 0;
+}
+
+
+/*
+** NET_MASK - Shorten network prefix
+*/
+void
+net_mask(struct mlfiNet *net, int prefix)
+{
+    int         bytes, bits;
+
+    if (prefix >= net->n_prefix) {
+        return;
+    }
+    bytes = prefix / 8;
+    bits = prefix % 8;
+    if (bits != 0) {
+        net->n_addr[bytes++] &= (0xff00 >> bits) & 0xff;
+    }
+    (void) memset(net->n_addr + bytes, '\0', sizeof(net->n_addr) - bytes);
+    net->n_prefix = prefix;
+}
+
+
+/*
+** NET_NTOP - Format network as address/prefix
+*/
+const char *
+net_ntop(const struct mlfiNet *net, char *buf, size_t size)
+{
+    size_t      len;
+
+    if (inet_ntop(net->n_family, net->n_addr, buf, size) == NULL) {
+        (void) strlcpy(buf, "unknown", size);
+        return buf;
+    }
+    len = strlen(buf);
+    (void) snprintf(buf + len, size - len, "/%d", net->n_prefix);
+    return buf;
+}
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+#include <netdb.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+
+
+/*
+** SERVER_UNIX_PATH - Get path of unix domain socket or NULL
+*/
+static const char *
+server_unix_path(const char *name)
+{
+    if (name[0] == '/') {
+        return name;
+    }
+    if (strncmp(name, "unix:", 5) == 0) {
+        return name + 5;
+    }
+    if (strncmp(name, "local:", 6) == 0) {
+        return name + 6;
+    }
+    return NULL;
+}
+
+
+/*
+** SERVER_LISTEN - Create listening socket
+**
+** The socket name has the same format as the milter socket:
+** {unix|local}:/path/to/file, inet:port@host or inet6:port@host.  When
+** the host is omitted, the socket listens on the loopback address.
+*/
+static int
+server_listen(struct mlfiServer *s)
+{
+    struct      sockaddr_un sun;
+    struct      addrinfo hints, *ai, *res;
+    const char *path;
+    char        port[NI_MAXSERV];
+    const char *host;
+    const char *p;
+    int         sd, rc, on = 1;
+
+    /* Unix domain socket */
+    if ((path = server_unix_path(s->s_socket)) != NULL) {
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+            logmsg(LOG_ERR, "%s socket name %s is too long", s->s_name, path);
+            return -1;
+        }
+        if (unlink(path) == -1 && errno != ENOENT) {
+            logmsg(LOG_ERR, "could not unlink old %s socket %s: %s",
+                s->s_name, path, strerror(errno));
+            return -1;
+        }
+        (void) memset(&sun, '\0', sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        (void) strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+        if ((sd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+            logmsg(LOG_ERR, "could not create %s socket: %s", s->s_name,
+                strerror(errno));
+            return -1;
+        }
+        if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+            listen(sd, SOMAXCONN) == -1)
+        {
+            logmsg(LOG_ERR, "could not listen on %s socket %s: %s",
+                s->s_name, path, strerror(errno));
+            (void) close(sd);
+            return -1;
+        }
+        return sd;
+    }
+
+    /* Internet socket */
+    (void) memset(&hints, '\0', sizeof(hints));
+    if (strncmp(s->s_socket, "inet:", 5) == 0) {
+        hints.ai_family = AF_INET;
+        p = s->s_socket + 5;
+    } else if (strncmp(s->s_socket, "inet6:", 6) == 0) {
+        hints.ai_family = AF_INET6;
+        p = s->s_socket + 6;
+    } else {
+        logmsg(LOG_ERR, "unknown %s socket type %s", s->s_name, s->s_socket);
+        return -1;
+    }
+    if ((host = strchr(p, '@')) != NULL) {
+        (void) snprintf(port, sizeof(port), "%.*s", (int)(host - p), p);
+        host++;
+    } else {
+        (void) strlcpy(port, p, sizeof(port));
+    }
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+        logmsg(LOG_ERR, "could not resolve %s socket %s: %s", s->s_name,
+            s->s_socket, gai_strerror(rc));
+        return -1;
+    }
+    sd = -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((sd = socket(ai->ai_family, ai->ai_socktype,
+            ai->ai_protocol)) == -1)
+        {
+            continue;
+        }
+        (void) setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(sd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(sd, SOMAXCONN) == 0)
+        {
+            break;
+        }
+        (void) close(sd);
+        sd = -1;
+    }
+    if (sd == -1) {
+        logmsg(LOG_ERR, "could not listen on %s socket %s: %s", s->s_name,
+            s->s_socket, strerror(errno));
+    }
+    freeaddrinfo(res);
+    return sd;
+}
+
+
+/*
+** SERVER_ACCEPT - Listener thread
+**
+** The clients are served one after another by the listener thread
+*/
+static void *
+server_accept(void *arg)
+{
+    struct      mlfiServer *s = arg;
+    struct      timeval tv;
+    fd_set      rfds;
+    int         sd, rc;
+
+    while (!__atomic_load_n(&s->s_stopping, __ATOMIC_ACQUIRE)) {
+        /* Check the stop flag every second */
+        FD_ZERO(&rfds);
+        FD_SET((unsigned int)s->s_fd, &rfds);
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        rc = select(s->s_fd + 1, &rfds, NULL, NULL, &tv);
+        if (s->s_idle != NULL) {
+            s->s_idle();
+        }
+        if (rc <= 0) {
+            if (rc == -1 && errno != EINTR) {
+                logmsg(LOG_ERR, "could not wait for %s connection: %s",
+                    s->s_name, strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        /* Serve client */
+        if ((sd = accept(s->s_fd, NULL, NULL)) == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                logmsg(LOG_ERR, "could not accept %s connection: %s",
+                    s->s_name, strerror(errno));
+            }
+            continue;
+        }
+        if (sd >= (int) FD_SETSIZE) {
+            /* sd is larger than FD_SETSIZE */
+            logmsg(LOG_ERR, "could not serve %s connection: %s", s->s_name,
+                strerror(EBADF));
+            (void) close(sd);
+            continue;
+        }
+        s->s_handler(sd);
+        (void) close(sd);
+    }
+    return NULL;
+}
+
+
+/*
+** SERVER_OPEN - Open listening socket
+**
+** server_open() should be called before the process is daemonized, so
+** that errors are reported to the terminal
+*/
+int
+server_open(struct mlfiServer *s)
+{
+    if ((s->s_fd = server_listen(s)) == -1) {
+        return -1;
+    }
+    if (s->s_fd >= (int) FD_SETSIZE) {
+        /* s_fd is larger than FD_SETSIZE */
+        logmsg(LOG_ERR, "could not listen on %s socket %s: %s", s->s_name,
+            s->s_socket, strerror(EBADF));
+        server_stop(s);
+        return -1;
+    }
+    logmsg(LOG_INFO, "%s listening on socket %s", s->s_name, s->s_socket);
+    return 0;
+}
+
+
+/*
+** SERVER_START - Start listener thread
+*/
+int
+server_start(struct mlfiServer *s)
+{
+    int         rc;
+
+    s->s_stopping = 0;
+    if ((rc = pthread_create(&s->s_thread, NULL, server_accept, s)) != 0) {
+        logmsg(LOG_ERR, "could not create %s thread: %s", s->s_name,
+            strerror(rc));
+        return -1;
+    }
+    s->s_running = 1;
+    return 0;
+}
+
+
+/*
+** SERVER_STOP - Stop listener thread and close listening socket
+*/
+void
+server_stop(struct mlfiServer *s)
+{
+    const char *path;
+
+    if (s->s_running) {
+        __atomic_store_n(&s->s_stopping, 1, __ATOMIC_RELEASE);
+        (void) pthread_join(s->s_thread, NULL);
+        s->s_running = 0;
+    }
+    if (s->s_fd != -1) {
+        (void) close(s->s_fd);
+        s->s_fd = -1;
+        if ((path = server_unix_path(s->s_socket)) != NULL &&
+            unlink(path) == -1)
+        {
+            logmsg(LOG_WARNING, "could not unlink %s socket %s: %s",
+                s->s_name, path, strerror(errno));
+        }
+    }
+}
+
+
+/*
+** SERVER_READ - Read request from client
+**
+** server_read() reads until the end of the request, i.e. an empty line
+** or the first line in line mode, or until the buffer is full.  It
+** returns the request length or -1.
+*/
+ssize_t
+server_read(int sd, char *buf, size_t len, int line)
+{
+    struct      timeval tv;
+    fd_set      rfds;
+    size_t      n = 0;
+    ssize_t     m;
+    int         rc;
+
+    if (sd >= (int) FD_SETSIZE) {
+        /* sd is larger than FD_SETSIZE */
+        errno = EBADF;
+        return -1;
+    }
+    while (n < len - 1) {
+        FD_ZERO(&rfds);
+        FD_SET((unsigned int)sd, &rfds);
+        tv.tv_sec = SERVER_TIMEOUT;
+        tv.tv_usec = 0;
+        if ((rc = select(sd + 1, &rfds, NULL, NULL, &tv)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (rc == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if ((m = read(sd, buf + n, len - 1 - n)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (m == 0) {
+            break;
+        }
+        n += m;
+        buf[n] = '\0';
+        if (line ? strchr(buf, '\n') != NULL :
+            strstr(buf, "\r\n\r\n") != NULL || strstr(buf, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+
+/*
+** SERVER_PRINTF - Append formatted text to buffer
+**
+** server_printf() returns -1 when the buffer could not be reallocated
+*/
+int
+server_printf(char **buf, size_t *size, size_t *len, const char *fmt, ...)
+{
+    char       *b;
+    va_list     ap;
+    int         n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return -1;
+        }
+        if (*len + n < *size) {
+            *len += n;
+            return 0;
+        }
+        if ((b = realloc(*buf, *size * 2)) == NULL) {
+            return -1;
+        }
+        *buf = b;
+        *size *= 2;
+    }
+}
+
+
+/*
+** SERVER_HTTP_REPLY - Write HTTP response to client
+*/
+int
+server_http_reply(int sd, const char *status, const char *type,
+    const char *body, size_t len)
+{
+    char        hdr[256];
+    int         n;
+
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %lu\r\n"
+        "Connection: close\r\n\r\n", status, type, (unsigned long)len);
+    if (write_sock(sd, hdr, n, SERVER_TIMEOUT) == -1 ||
+        (len > 0 && write_sock(sd, (void *)body, len, SERVER_TIMEOUT) == -1))
+    {
+        return -1;
+    }
+    return 0;
+}
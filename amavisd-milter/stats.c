@@ -0,0 +1,877 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+
+/* Histogram buckets */
+#define STATSMINSHIFT   6       /* first bucket is up to 64 usec */
+#define STATSOCTAVES    26      /* powers of two above the first bucket */
+#define STATSSUB        4       /* buckets per power of two */
+#define STATSBUCKETS    (1 + STATSOCTAVES * STATSSUB + 1)
+
+/* Message verdicts */
+#define STATSVERDICTS   5
+
+/* Recent amavisd connection wait */
+#define STATSWINDOW     10      /* seconds per window */
+#define STATSWINDOWS    6       /* recent windows */
+
+/* Recent amavisd scan time */
+#define STATSSMOOTH     8       /* weight of the recent scan time */
+
+/*
+** Latency histogram
+**
+** The buckets are log-linear: every power of two is split into STATSSUB
+** buckets, so the relative error of a quantile is at most 25%.  The last
+** bucket counts values over the range.
+*/
+struct statsHist {
+    unsigned long h_bucket[STATSBUCKETS];/* values in bucket */
+    unsigned long h_sum;                /* sum of values in usec */
+};
+
+/*
+** Statistics shard
+**
+** Every thread updates its own shard with relaxed atomic operations and
+** the shards are summed when the statistics are read.
+*/
+struct statsShard {
+    struct      statsHist s_hist[STATS_HISTOGRAMS];/* latency histograms */
+    unsigned long s_verdict[STATSVERDICTS];/* messages by verdict */
+    unsigned long s_bytes;              /* message bytes */
+    unsigned long s_tempfail[PHASES];   /* tempfails by phase */
+    unsigned long s_passthrough[PHASES];/* pass-throughs by phase */
+};
+
+/*
+** Recent amavisd connection wait
+**
+** The wait times of the last STATSWINDOWS * STATSWINDOW seconds are
+** counted in a ring of windows.  The first thread in a new window clears
+** it, concurrent updates may be lost meanwhile.
+*/
+struct statsWindow {
+    time_t      w_slot;                 /* window time / STATSWINDOW */
+    unsigned long w_bucket[STATSBUCKETS];/* values in bucket */
+};
+
+/*
+** Statistics data
+**
+** With worker processes, the data are kept in the shared memory, so that
+** every worker serves the statistics of all of them.  The messages in
+** progress are counted per worker, because a worker may die with them.
+*/
+struct statsData {
+    struct      statsShard d_shards[STATSHARDS];/* statistics shards */
+    struct      statsWindow d_windows[STATSWINDOWS];/* recent waits */
+    time_t      d_connect_ok;           /* last successful amavisd connect */
+    time_t      d_connect_fail;         /* last failed amavisd connect */
+    long        d_inflight[WORKERS];    /* messages in progress */
+    long        d_scan_recent;          /* moving average of scan time */
+    struct      statsHist d_class_wait[ADMITCLASSES];/* wait by class */
+};
+
+static struct   statsData stats_local;  /* data of the single process */
+static struct   statsData *stats_data = &stats_local;/* data in use */
+static unsigned int stats_next_shard;   /* next shard to assign */
+static __thread struct statsShard *stats_shard;/* shard of the thread */
+
+/* Histogram names */
+static const char *stats_hist_name[STATS_HISTOGRAMS][2] =
+{
+    { "wait", "Time waiting for a free amavisd connection" },
+    { "spool", "Time from MAIL FROM to the end of the message" },
+    { "scan", "Time from the amavisd request to the end of the response" },
+    { "eom", "Time of the end of message processing" },
+    { "cache_hit", "Time of the end of message processing replayed from "
+        "the verdict cache" }
+};
+
+/* Verdict names, indexed by sfsistat */
+static const char *stats_verdict_name[STATSVERDICTS] =
+{
+    "continue",
+    "reject",
+    "discard",
+    "accept",
+    "tempfail"
+};
+
+/* Phase names */
+static const char *stats_phase_names[PHASES] =
+{
+    "idle",
+    "spool",
+    "wait",
+    "connect",
+    "request",
+    "response",
+    "done"
+};
+
+/* Statistics listener */
+static struct   mlfiServer stats_server;
+
+
+/*
+** STATS_INIT - Allocate statistics shared by the workers
+*/
+int
+stats_init(void)
+{
+    struct      statsData *d;
+
+    if (worker_enabled()) {
+        if ((d = worker_alloc(sizeof(*d))) == NULL) {
+            return -1;
+        }
+        stats_data = d;
+    }
+    return 0;
+}
+
+
+/*
+** STATS_RECLAIM - Forget messages in progress of a worker which has died
+*/
+void
+stats_reclaim(int worker)
+{
+    __atomic_store_n(&stats_data->d_inflight[worker], 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_INFLIGHT - Get number of messages in progress
+*/
+static long
+stats_inflight(void)
+{
+    long        n = 0;
+    int         i;
+
+    for (i = 0; i < WORKERS; i++) {
+        n += __atomic_load_n(&stats_data->d_inflight[i], __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+
+/*
+** STATS_GET_SHARD - Get statistics shard of the thread
+*/
+static struct statsShard *
+stats_get_shard(void)
+{
+    if (stats_shard == NULL) {
+        stats_shard = &stats_data->d_shards[(worker_id() +
+            __atomic_fetch_add(&stats_next_shard, 1, __ATOMIC_RELAXED)) %
+            STATSHARDS];
+    }
+    return stats_shard;
+}
+
+
+/*
+** STATS_BUCKET - Get histogram bucket of value in usec
+**
+** The bucket of value v counts values in (lower, upper], see stats_upper()
+*/
+static unsigned int
+stats_bucket(unsigned long usec)
+{
+    unsigned int shift;
+
+    if (usec > 0) {
+        usec--;
+    }
+    if (usec < (1UL << STATSMINSHIFT)) {
+        return 0;
+    }
+    for (shift = STATSMINSHIFT; (usec >> shift) > 1; shift++) {
+        continue;
+    }
+    if (shift >= STATSMINSHIFT + STATSOCTAVES) {
+        return STATSBUCKETS - 1;
+    }
+    return 1 + (shift - STATSMINSHIFT) * STATSSUB +
+        ((usec >> (shift - 2)) & (STATSSUB - 1));
+}
+
+
+/*
+** STATS_UPPER - Get upper bound of histogram bucket in usec
+*/
+static unsigned long
+stats_upper(unsigned int bucket)
+{
+    unsigned int octave, sub;
+
+    if (bucket == 0) {
+        return 1UL << STATSMINSHIFT;
+    }
+    octave = (bucket - 1) / STATSSUB;
+    sub = (bucket - 1) % STATSSUB;
+    return (1UL << (STATSMINSHIFT + octave)) +
+        (sub + 1) * (1UL << (STATSMINSHIFT + octave - 2));
+}
+
+
+/*
+** STATS_HIST_ADD - Add value to histogram
+*/
+static void
+stats_hist_add(struct statsHist *h, long usec)
+{
+    if (usec < 0) {
+        usec = 0;
+    }
+    __atomic_add_fetch(&h->h_bucket[stats_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->h_sum, usec, __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_OBSERVE - Add value to latency histogram
+*/
+void
+stats_observe(int hist, long usec)
+{
+    stats_hist_add(&stats_get_shard()->s_hist[hist], usec);
+}
+
+
+/*
+** STATS_RECENT_WAIT - Add amavisd connection wait to recent windows
+*/
+static void
+stats_recent_wait(long usec)
+{
+    struct      statsWindow *w;
+    time_t      slot, old;
+    unsigned int i;
+
+    slot = time(NULL) / STATSWINDOW;
+    w = &stats_data->d_windows[slot % STATSWINDOWS];
+    old = __atomic_load_n(&w->w_slot, __ATOMIC_ACQUIRE);
+    if (old != slot && __atomic_compare_exchange_n(&w->w_slot, &old, slot, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        for (i = 0; i < STATSBUCKETS; i++) {
+            __atomic_store_n(&w->w_bucket[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_add_fetch(&w->w_bucket[stats_bucket(usec)], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_RECENT_SCAN - Add amavisd scan time to the moving average
+**
+** Concurrent updates may be lost, which does not matter for the average
+*/
+static void
+stats_recent_scan(long usec)
+{
+    long        avg;
+
+    avg = __atomic_load_n(&stats_data->d_scan_recent, __ATOMIC_RELAXED);
+    avg = avg == 0 ? usec : avg + (usec - avg) / STATSSMOOTH;
+    __atomic_store_n(&stats_data->d_scan_recent, MAX(avg, 1), __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_SCAN_MEAN - Get moving average of amavisd scan time in usec
+**
+** stats_scan_mean() returns 0 when no message was scanned yet
+*/
+long
+stats_scan_mean(void)
+{
+    return __atomic_load_n(&stats_data->d_scan_recent, __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_WAIT_QUANTILE - Get quantile of recent amavisd connection wait
+**
+** stats_wait_quantile() returns the upper bound in usec of the bucket with
+** the quantile q (in percent), or 0 when there was no wait recently
+*/
+long
+stats_wait_quantile(int q)
+{
+    unsigned long bucket[STATSBUCKETS];
+    unsigned long total = 0, n = 0;
+    struct      statsWindow *w;
+    time_t      slot;
+    unsigned int i, j;
+
+    (void) memset(bucket, '\0', sizeof(bucket));
+    slot = time(NULL) / STATSWINDOW;
+    for (i = 0; i < STATSWINDOWS; i++) {
+        w = &stats_data->d_windows[i];
+        if (__atomic_load_n(&w->w_slot, __ATOMIC_ACQUIRE) <=
+            slot - STATSWINDOWS)
+        {
+            continue;
+        }
+        for (j = 0; j < STATSBUCKETS; j++) {
+            bucket[j] += __atomic_load_n(&w->w_bucket[j], __ATOMIC_RELAXED);
+        }
+    }
+    for (j = 0; j < STATSBUCKETS; j++) {
+        total += bucket[j];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (j = 0; j < STATSBUCKETS; j++) {
+        n += bucket[j];
+        if (n * 100 >= total * q) {
+            break;
+        }
+    }
+    return j < STATSBUCKETS - 1 ? stats_upper(j) : LONG_MAX;
+}
+
+
+/*
+** STATS_CONNECT - Record result of amavisd connect
+*/
+void
+stats_connect(int ok)
+{
+    __atomic_store_n(ok ? &stats_data->d_connect_ok :
+        &stats_data->d_connect_fail, time(NULL), __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_CONNECT_TIME - Get time of last successful and failed amavisd connect
+*/
+void
+stats_connect_time(time_t *ok, time_t *fail)
+{
+    *ok = __atomic_load_n(&stats_data->d_connect_ok, __ATOMIC_RELAXED);
+    *fail = __atomic_load_n(&stats_data->d_connect_fail, __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_PHASE - Change phase of the transaction
+**
+** The time spent in the request and response phases is the amavisd scan
+** time.  Transactions in other than idle phase are in flight.
+*/
+void
+stats_phase(struct mlfiCtx *mlfi, int phase)
+{
+    struct      timespec now;
+
+    if (mlfi->mlfi_phase == phase) {
+        return;
+    }
+    clock_now(&now);
+    if (mlfi->mlfi_phase == PHASE_REQUEST ||
+        mlfi->mlfi_phase == PHASE_RESPONSE)
+    {
+        mlfi->mlfi_scan_usec += clock_usec(&mlfi->mlfi_phase_start, &now);
+    }
+    if (mlfi->mlfi_phase == PHASE_IDLE) {
+        __atomic_add_fetch(&stats_data->d_inflight[worker_id()], 1,
+            __ATOMIC_RELAXED);
+    } else if (phase == PHASE_IDLE) {
+        __atomic_sub_fetch(&stats_data->d_inflight[worker_id()], 1,
+            __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&mlfi->mlfi_phase, phase, __ATOMIC_RELAXED);
+    __atomic_store_n(&mlfi->mlfi_phase_start.tv_sec, now.tv_sec,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&mlfi->mlfi_phase_start.tv_nsec, now.tv_nsec,
+        __ATOMIC_RELAXED);
+}
+
+
+/*
+** STATS_PHASE_NAME - Get name of the transaction phase
+*/
+const char *
+stats_phase_name(int phase)
+{
+    return phase >= 0 && phase < PHASES ? stats_phase_names[phase] : "unknown";
+}
+
+
+/*
+** STATS_MESSAGE - Account the checked message
+**
+** phase is the phase in which the message check ended, the message was
+** checked by amavisd when it is PHASE_DONE.  The verdict of a cached
+** message is replayed without amavisd.
+*/
+void
+stats_message(struct mlfiCtx *mlfi, sfsistat rstat, int phase,
+    const struct timespec *eom, const struct timespec *done)
+{
+    struct      statsShard *s = stats_get_shard();
+
+    /* Latency */
+    if (admit_enabled() && phase >= PHASE_WAIT) {
+        stats_observe(STATS_WAIT, mlfi->mlfi_wait_usec);
+        stats_hist_add(&stats_data->d_class_wait[mlfi->mlfi_class],
+            mlfi->mlfi_wait_usec);
+        stats_recent_wait(mlfi->mlfi_wait_usec);
+    }
+    stats_observe(STATS_SPOOL, clock_usec(&mlfi->mlfi_start, eom));
+    if (phase == PHASE_DONE) {
+        stats_observe(STATS_SCAN, mlfi->mlfi_scan_usec);
+        stats_recent_scan(mlfi->mlfi_scan_usec);
+    }
+    stats_observe(STATS_EOM, clock_usec(eom, done));
+    if (mlfi->mlfi_cached) {
+        stats_observe(STATS_HIT, clock_usec(eom, done));
+    }
+
+    /* Verdict */
+    if (rstat >= 0 && rstat < STATSVERDICTS) {
+        __atomic_add_fetch(&s->s_verdict[rstat], 1, __ATOMIC_RELAXED);
+    }
+    if (mlfi->mlfi_size > 0) {
+        __atomic_add_fetch(&s->s_bytes, mlfi->mlfi_size, __ATOMIC_RELAXED);
+    }
+
+    /* Failures */
+    if (rstat == SMFIS_TEMPFAIL) {
+        __atomic_add_fetch(&s->s_tempfail[phase], 1, __ATOMIC_RELAXED);
+    } else if (rstat == SMFIS_CONTINUE && phase != PHASE_DONE &&
+        !mlfi->mlfi_cached)
+    {
+        __atomic_add_fetch(&s->s_passthrough[phase], 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+** STATS_FORMAT_CLASSES - Format statistics of admission classes
+*/
+static int
+stats_format_classes(char **buf, size_t *size, size_t *len)
+{
+    const struct statsHist *h;
+    const char *name;
+    unsigned long count, sum;
+    unsigned int j;
+    int         i, rc = 0, reserved, used, queued;
+
+    rc |= server_printf(buf, size, len,
+        "# HELP amavisd_milter_class_wait_seconds Time waiting for a free "
+        "amavisd connection by admission class.\n"
+        "# TYPE amavisd_milter_class_wait_seconds histogram\n");
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        h = &stats_data->d_class_wait[i];
+        count = 0;
+        for (j = 0; j < STATSBUCKETS; j++) {
+            count += __atomic_load_n(&h->h_bucket[j], __ATOMIC_RELAXED);
+            if (j < STATSBUCKETS - 1) {
+                rc |= server_printf(buf, size, len,
+                    "amavisd_milter_class_wait_seconds_bucket"
+                    "{class=\"%s\",le=\"%g\"} %lu\n",
+                    name, stats_upper(j) / 1e6, count);
+            }
+        }
+        sum = __atomic_load_n(&h->h_sum, __ATOMIC_RELAXED);
+        rc |= server_printf(buf, size, len,
+            "amavisd_milter_class_wait_seconds_bucket"
+            "{class=\"%s\",le=\"+Inf\"} %lu\n"
+            "amavisd_milter_class_wait_seconds_sum{class=\"%s\"} %lu.%06lu\n"
+            "amavisd_milter_class_wait_seconds_count{class=\"%s\"} %lu\n",
+            name, count, name, sum / 1000000, sum % 1000000, name, count);
+    }
+
+    rc |= server_printf(buf, size, len,
+        "# HELP amavisd_milter_class_connections Used amavisd connections "
+        "by admission class.\n"
+        "# TYPE amavisd_milter_class_connections gauge\n");
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        admit_class_status(i, &reserved, &used, &queued);
+        rc |= server_printf(buf, size, len,
+            "amavisd_milter_class_connections{class=\"%s\"} %d\n",
+            name, used);
+    }
+    rc |= server_printf(buf, size, len,
+        "# HELP amavisd_milter_class_connections_reserved Reserved amavisd "
+        "connections by admission class.\n"
+        "# TYPE amavisd_milter_class_connections_reserved gauge\n");
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        admit_class_status(i, &reserved, &used, &queued);
+        rc |= server_printf(buf, size, len,
+            "amavisd_milter_class_connections_reserved{class=\"%s\"} %d\n",
+            name, reserved);
+    }
+    rc |= server_printf(buf, size, len,
+        "# HELP amavisd_milter_class_queue Messages waiting for amavisd "
+        "connection by admission class.\n"
+        "# TYPE amavisd_milter_class_queue gauge\n");
+    for (i = 0; (name = admit_class_name(i)) != NULL; i++) {
+        admit_class_status(i, &reserved, &used, &queued);
+        rc |= server_printf(buf, size, len,
+            "amavisd_milter_class_queue{class=\"%s\"} %d\n", name, queued);
+    }
+    return rc;
+}
+
+
+/*
+** STATS_FORMAT - Format statistics in Prometheus text format
+**
+** stats_format() returns allocated text, which must be freed by caller
+*/
+char *
+stats_format(size_t *len)
+{
+    char       *buf;
+    size_t      size = 16384;
+    unsigned long n, count, sum, total;
+    unsigned int i, j, k;
+    const char *name;
+    int         rc = 0, limit, used, queued, min, max, overload, state;
+    long        target, latency, wait;
+
+    if ((buf = malloc(size)) == NULL) {
+        return NULL;
+    }
+    *len = 0;
+
+    /* Histograms */
+    for (i = 0; i < STATS_HISTOGRAMS; i++) {
+        if (i == STATS_HIT && !cache_enabled()) {
+            continue;
+        }
+        name = stats_hist_name[i][0];
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_%s_seconds %s.\n"
+            "# TYPE amavisd_milter_%s_seconds histogram\n",
+            name, stats_hist_name[i][1], name);
+        count = 0;
+        sum = 0;
+        for (j = 0; j < STATSBUCKETS; j++) {
+            n = 0;
+            for (k = 0; k < STATSHARDS; k++) {
+                n += __atomic_load_n(
+                    &stats_data->d_shards[k].s_hist[i].h_bucket[j],
+                    __ATOMIC_RELAXED);
+            }
+            count += n;
+            if (j < STATSBUCKETS - 1) {
+                rc |= server_printf(&buf, &size, len,
+                    "amavisd_milter_%s_seconds_bucket{le=\"%g\"} %lu\n",
+                    name, stats_upper(j) / 1e6, count);
+            }
+        }
+        for (k = 0; k < STATSHARDS; k++) {
+            sum += __atomic_load_n(&stats_data->d_shards[k].s_hist[i].h_sum,
+                __ATOMIC_RELAXED);
+        }
+        rc |= server_printf(&buf, &size, len,
+            "amavisd_milter_%s_seconds_bucket{le=\"+Inf\"} %lu\n"
+            "amavisd_milter_%s_seconds_sum %lu.%06lu\n"
+            "amavisd_milter_%s_seconds_count %lu\n",
+            name, count, name, sum / 1000000, sum % 1000000, name, count);
+    }
+
+    /* Messages */
+    rc |= server_printf(&buf, &size, len,
+        "# HELP amavisd_milter_messages_total Checked messages by verdict.\n"
+        "# TYPE amavisd_milter_messages_total counter\n");
+    for (i = 0; i < STATSVERDICTS; i++) {
+        for (n = 0, k = 0; k < STATSHARDS; k++) {
+            n += __atomic_load_n(&stats_data->d_shards[k].s_verdict[i],
+                __ATOMIC_RELAXED);
+        }
+        rc |= server_printf(&buf, &size, len,
+            "amavisd_milter_messages_total{verdict=\"%s\"} %lu\n",
+            stats_verdict_name[i], n);
+    }
+    for (n = 0, k = 0; k < STATSHARDS; k++) {
+        n += __atomic_load_n(&stats_data->d_shards[k].s_bytes,
+            __ATOMIC_RELAXED);
+    }
+    rc |= server_printf(&buf, &size, len,
+        "# HELP amavisd_milter_message_bytes_total Size of checked messages.\n"
+        "# TYPE amavisd_milter_message_bytes_total counter\n"
+        "amavisd_milter_message_bytes_total %lu\n", n);
+
+    /* Failures */
+    for (j = 0; j < 2; j++) {
+        name = j == 0 ? "tempfails" : "passthroughs";
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_%s_total Messages %s because of a "
+            "failure, by the phase of the failure.\n"
+            "# TYPE amavisd_milter_%s_total counter\n", name,
+            j == 0 ? "temporarily rejected" : "passed through unchecked",
+            name);
+        for (i = PHASE_SPOOL; i < PHASES; i++) {
+            /* Messages checked by amavisd are never passed through */
+            if (j != 0 && i == PHASE_DONE) {
+                continue;
+            }
+            for (n = 0, k = 0; k < STATSHARDS; k++) {
+                n += __atomic_load_n(j == 0 ?
+                    &stats_data->d_shards[k].s_tempfail[i] :
+                    &stats_data->d_shards[k].s_passthrough[i],
+                    __ATOMIC_RELAXED);
+            }
+            rc |= server_printf(&buf, &size, len,
+                "amavisd_milter_%s_total{cause=\"%s\"} %lu\n", name,
+                i == PHASE_DONE ? "amavisd" : stats_phase_names[i], n);
+        }
+    }
+
+    /* Gauges */
+    rc |= server_printf(&buf, &size, len,
+        "# HELP amavisd_milter_inflight_messages Messages in progress.\n"
+        "# TYPE amavisd_milter_inflight_messages gauge\n"
+        "amavisd_milter_inflight_messages %ld\n", stats_inflight());
+    if (admit_enabled()) {
+        admit_status(&limit, &used, &queued);
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_amavisd_connections Used amavisd "
+            "connections.\n"
+            "# TYPE amavisd_milter_amavisd_connections gauge\n"
+            "amavisd_milter_amavisd_connections %d\n"
+            "# HELP amavisd_milter_amavisd_connections_max Maximum amavisd "
+            "connections.\n"
+            "# TYPE amavisd_milter_amavisd_connections_max gauge\n"
+            "amavisd_milter_amavisd_connections_max %d\n"
+            "# HELP amavisd_milter_amavisd_queue Messages waiting for amavisd "
+            "connection.\n"
+            "# TYPE amavisd_milter_amavisd_queue gauge\n"
+            "amavisd_milter_amavisd_queue %d\n",
+            used, limit, queued);
+    }
+    if (adapt_enabled()) {
+        adapt_status(&min, &max, &target, &latency);
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_adaptive_limit Adaptive limit of amavisd "
+            "connections.\n"
+            "# TYPE amavisd_milter_adaptive_limit gauge\n"
+            "amavisd_milter_adaptive_limit %d\n"
+            "# HELP amavisd_milter_adaptive_limit_min Lowest adaptive limit.\n"
+            "# TYPE amavisd_milter_adaptive_limit_min gauge\n"
+            "amavisd_milter_adaptive_limit_min %d\n"
+            "# HELP amavisd_milter_adaptive_limit_max Highest adaptive limit.\n"
+            "# TYPE amavisd_milter_adaptive_limit_max gauge\n"
+            "amavisd_milter_adaptive_limit_max %d\n"
+            "# HELP amavisd_milter_adaptive_latency_seconds Average amavisd "
+            "scan time of the last window.\n"
+            "# TYPE amavisd_milter_adaptive_latency_seconds gauge\n"
+            "amavisd_milter_adaptive_latency_seconds %.6f\n"
+            "# HELP amavisd_milter_adaptive_target_seconds Scan time target "
+            "of the adaptive limit.\n"
+            "# TYPE amavisd_milter_adaptive_target_seconds gauge\n"
+            "amavisd_milter_adaptive_target_seconds %.6f\n",
+            limit, min, max, latency / 1e6, target / 1e6);
+    }
+
+    /* Admission classes */
+    if (admit_class_name(1) != NULL) {
+        rc |= stats_format_classes(&buf, &size, len);
+    }
+
+    /* Circuit breaker */
+    if (breaker_enabled()) {
+        breaker_status(&state, &n, &total);
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_breaker_state Amavisd circuit breaker "
+            "state (0 closed, 1 open, 2 half-open).\n"
+            "# TYPE amavisd_milter_breaker_state gauge\n"
+            "amavisd_milter_breaker_state %d\n"
+            "# HELP amavisd_milter_breaker_opened_total Openings of the "
+            "amavisd circuit breaker.\n"
+            "# TYPE amavisd_milter_breaker_opened_total counter\n"
+            "amavisd_milter_breaker_opened_total %lu\n"
+            "# HELP amavisd_milter_breaker_rejected_total Messages failed "
+            "at once by the open circuit breaker.\n"
+            "# TYPE amavisd_milter_breaker_rejected_total counter\n"
+            "amavisd_milter_breaker_rejected_total %lu\n",
+            state, n, total);
+    }
+
+    /* Early rejection */
+    if (early_enabled()) {
+        early_status(&overload, &wait, &total);
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_early_rejected_total Messages rejected "
+            "at MAIL FROM because of predicted overload.\n"
+            "# TYPE amavisd_milter_early_rejected_total counter\n"
+            "amavisd_milter_early_rejected_total %lu\n"
+            "# HELP amavisd_milter_early_overload Messages are rejected "
+            "because of predicted overload.\n"
+            "# TYPE amavisd_milter_early_overload gauge\n"
+            "amavisd_milter_early_overload %d\n"
+            "# HELP amavisd_milter_early_wait_seconds Last predicted wait "
+            "for amavisd connection.\n"
+            "# TYPE amavisd_milter_early_wait_seconds gauge\n"
+            "amavisd_milter_early_wait_seconds %.6f\n",
+            total, overload, wait / 1e6);
+    }
+
+    /* Verdict cache */
+    if (cache_enabled()) {
+        cache_status(&used, &n, &total, &count);
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_cache_lookups_total Verdict cache "
+            "lookups by result.\n"
+            "# TYPE amavisd_milter_cache_lookups_total counter\n"
+            "amavisd_milter_cache_lookups_total{result=\"hit\"} %lu\n"
+            "amavisd_milter_cache_lookups_total{result=\"miss\"} %lu\n"
+            "# HELP amavisd_milter_cache_stored_total Verdicts stored in "
+            "the verdict cache.\n"
+            "# TYPE amavisd_milter_cache_stored_total counter\n"
+            "amavisd_milter_cache_stored_total %lu\n"
+            "# HELP amavisd_milter_cache_entries Used verdict cache "
+            "entries.\n"
+            "# TYPE amavisd_milter_cache_entries gauge\n"
+            "amavisd_milter_cache_entries %d\n",
+            n, total, count, used);
+    }
+
+    /* Fairness */
+    if (fair_enabled()) {
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_fair_throttled_total Messages throttled "
+            "by fairness rule.\n"
+            "# TYPE amavisd_milter_fair_throttled_total counter\n");
+        for (i = 0; (name = fair_rule_name(i)) != NULL; i++) {
+            fair_rule_status(i, &n, &total);
+            rc |= server_printf(&buf, &size, len,
+                "amavisd_milter_fair_throttled_total"
+                "{rule=\"%s\",reason=\"conns\"} %lu\n"
+                "amavisd_milter_fair_throttled_total"
+                "{rule=\"%s\",reason=\"rate\"} %lu\n",
+                name, n, name, total);
+        }
+        rc |= server_printf(&buf, &size, len,
+            "# HELP amavisd_milter_fair_entries Used fairness table "
+            "entries.\n"
+            "# TYPE amavisd_milter_fair_entries gauge\n"
+            "amavisd_milter_fair_entries %d\n", fair_entries());
+    }
+
+    /* Logging */
+    total = log_dropped_count();
+    rc |= server_printf(&buf, &size, len,
+        "# HELP amavisd_milter_log_dropped_total Log messages dropped "
+        "because the log queue was full.\n"
+        "# TYPE amavisd_milter_log_dropped_total counter\n"
+        "amavisd_milter_log_dropped_total %lu\n", total);
+    total = log_suppressed_count();
+    rc |= server_printf(&buf, &size, len,
+        "# HELP amavisd_milter_log_suppressed_total Log messages suppressed "
+        "by the rate limit.\n"
+        "# TYPE amavisd_milter_log_suppressed_total counter\n"
+        "amavisd_milter_log_suppressed_total %lu\n", total);
+
+    if (rc != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+
+/*
+** STATS_SERVE - Serve statistics to client
+*/
+static void
+stats_serve(int sd)
+{
+    char        req[MAXLOGBUF];
+    char       *buf;
+    size_t      len;
+
+    if (server_read(sd, req, sizeof(req), 0) == -1) {
+        return;
+    }
+    if ((buf = stats_format(&len)) == NULL) {
+        logmsg(LOG_ERR, "could not format statistics");
+        (void) server_http_reply(sd, "500 Internal Server Error",
+            "text/plain", "", 0);
+        return;
+    }
+    (void) server_http_reply(sd, "200 OK", "text/plain; version=0.0.4",
+        buf, len);
+    free(buf);
+}
+
+
+/*
+** STATS_OPEN - Open statistics socket
+*/
+int
+stats_open(void)
+{
+    if (stats_socket == NULL) {
+        return 0;
+    }
+    stats_server.s_name = "metrics";
+    stats_server.s_socket = stats_socket;
+    stats_server.s_handler = stats_serve;
+    return server_open(&stats_server);
+}
+
+
+/*
+** STATS_START - Start serving statistics
+*/
+int
+stats_start(void)
+{
+    if (stats_socket == NULL) {
+        return 0;
+    }
+    return server_start(&stats_server);
+}
+
+
+/*
+** STATS_STOP - Stop serving statistics
+*/
+void
+stats_stop(void)
+{
+    if (stats_socket != NULL) {
+        server_stop(&stats_server);
+    }
+}
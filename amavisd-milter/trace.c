@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "amavisd-milter.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+
+/* Trace rule types */
+#define TRACE_CLIENT    1       /* client address or network */
+#define TRACE_SENDER    2       /* sender address or domain */
+#define TRACE_DAEMON    3       /* daemon name */
+#define TRACE_SAMPLE    4       /* one of N messages */
+
+/*
+** Trace rule
+*/
+struct traceRule {
+    struct      traceRule *t_next;      /* next rule */
+    int         t_type;                 /* rule type */
+    int         t_level;                /* debug level */
+    struct      mlfiNet t_net;          /* client network */
+    unsigned long t_sample;             /* sample rate */
+    char        t_value[1];             /* sender or daemon name */
+};
+
+/*
+** Trace rules
+**
+** The rules are reloaded when the modification time of trace_file changes.
+** Checks of the file are at least one second apart.  Readers hold the
+** read lock while they match the rules, the reload swaps the whole list
+** under the write lock.
+*/
+static struct   traceRule *trace_rules;
+static pthread_rwlock_t trace_lock = PTHREAD_RWLOCK_INITIALIZER;
+static time_t   trace_checked;          /* last check of trace_file */
+static time_t   trace_mtime;            /* trace_file modification time */
+static unsigned long trace_count;       /* sampled messages */
+
+
+/*
+** TRACE_FREE_RULES - Free list of trace rules
+*/
+static void
+trace_free_rules(struct traceRule *t)
+{
+    struct      traceRule *next;
+
+    while (t != NULL) {
+        next = t->t_next;
+        free(t);
+        t = next;
+    }
+}
+
+
+/*
+** TRACE_PARSE - Parse trace rules file
+**
+** Every line of the file contains one rule:
+**
+** client address[/prefix] [level]
+** sender address|@domain [level]
+** daemon name [level]
+** sample N [level]
+**
+** Empty lines and lines beginning with '#' are ignored.
+*/
+static int
+trace_parse(FILE *fp, struct traceRule **rules)
+{
+    struct      traceRule *t, **last = rules;
+    char        line[MAXLOGBUF];
+    char       *type, *value, *level, *end, *last_tok;
+    int         n = 0;
+    size_t      len;
+
+    *rules = NULL;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        n++;
+        type = strtok_r(line, " \t\r\n", &last_tok);
+        if (type == NULL || *type == '#') {
+            continue;
+        }
+        value = strtok_r(NULL, " \t\r\n", &last_tok);
+        level = strtok_r(NULL, " \t\r\n", &last_tok);
+        if (value == NULL || strtok_r(NULL, " \t\r\n", &last_tok) != NULL) {
+            logmsg(LOG_ERR, "%s:%d: syntax error", trace_file, n);
+            goto error;
+        }
+
+        /* Allocate rule */
+        len = strlen(value);
+        if ((t = calloc(1, sizeof(*t) + len)) == NULL) {
+            logmsg(LOG_ERR, "could not allocate memory");
+            goto error;
+        }
+        *last = t;
+        last = &t->t_next;
+        (void) memcpy(t->t_value, value, len + 1);
+
+        /* Parse debug level */
+        t->t_level = LOG_DEBUG;
+        if (level != NULL) {
+            t->t_level = (int) strtol(level, &end, 10);
+            if (*level == '\0' || *end != '\0' || t->t_level < 1 ||
+                t->t_level > 3)
+            {
+                logmsg(LOG_ERR, "%s:%d: invalid debug level '%s'",
+                    trace_file, n, level);
+                goto error;
+            }
+            t->t_level += LOG_WARNING;
+        }
+
+        /* Parse rule */
+        if (strcasecmp(type, "client") == 0) {
+            t->t_type = TRACE_CLIENT;
+            if (net_parse(&t->t_net, value) == -1) {
+                logmsg(LOG_ERR, "%s:%d: invalid client address '%s'",
+                    trace_file, n, t->t_value);
+                goto error;
+            }
+        } else if (strcasecmp(type, "sender") == 0) {
+            t->t_type = TRACE_SENDER;
+        } else if (strcasecmp(type, "daemon") == 0) {
+            t->t_type = TRACE_DAEMON;
+        } else if (strcasecmp(type, "sample") == 0) {
+            t->t_type = TRACE_SAMPLE;
+            t->t_sample = strtoul(value, &end, 10);
+            if (*end != '\0' || t->t_sample == 0) {
+                logmsg(LOG_ERR, "%s:%d: invalid sample rate '%s'",
+                    trace_file, n, value);
+                goto error;
+            }
+        } else {
+            logmsg(LOG_ERR, "%s:%d: unknown rule '%s'", trace_file, n, type);
+            goto error;
+        }
+    }
+    return n;
+
+error:
+    trace_free_rules(*rules);
+    *rules = NULL;
+    return -1;
+}
+
+
+/*
+** TRACE_LOAD - Load trace rules when trace_file was changed
+*/
+static int
+trace_load(time_t now)
+{
+    struct      traceRule *rules, *old;
+    struct      stat st;
+    FILE       *fp;
+    int         n;
+
+    /* Only one thread checks the file once per second */
+    if (now == __atomic_load_n(&trace_checked, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    if (__atomic_exchange_n(&trace_checked, now, __ATOMIC_RELAXED) == now) {
+        return 0;
+    }
+
+    /* Check modification time */
+    if (stat(trace_file, &st) == -1) {
+        if (errno != ENOENT) {
+            logmsg(LOG_ERR, "could not stat trace file %s: %s", trace_file,
+                strerror(errno));
+            return -1;
+        }
+        st.st_mtime = 0;
+    }
+    if (st.st_mtime == __atomic_load_n(&trace_mtime, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_store_n(&trace_mtime, st.st_mtime, __ATOMIC_RELAXED);
+
+    /* Load rules, a missing file disables tracing */
+    rules = NULL;
+    if (st.st_mtime != 0) {
+        if ((fp = fopen(trace_file, "r")) == NULL) {
+            logmsg(LOG_ERR, "could not open trace file %s: %s", trace_file,
+                strerror(errno));
+            return -1;
+        }
+        n = trace_parse(fp, &rules);
+        (void) fclose(fp);
+        if (n == -1) {
+            return -1;
+        }
+    }
+
+    /* Replace rules */
+    (void) pthread_rwlock_wrlock(&trace_lock);
+    old = trace_rules;
+    trace_rules = rules;
+    (void) pthread_rwlock_unlock(&trace_lock);
+    trace_free_rules(old);
+
+    if (st.st_mtime != 0) {
+        logmsg(LOG_WARNING, "debug trace rules loaded from %s", trace_file);
+    } else {
+        logmsg(LOG_WARNING, "debug trace file %s does not exist, tracing "
+            "is disabled", trace_file);
+    }
+    return 0;
+}
+
+
+/*
+** TRACE_INIT - Load trace rules
+*/
+int
+trace_init(void)
+{
+    if (trace_file == NULL) {
+        return 0;
+    }
+    trace_mtime = -1;
+    return trace_load(time(NULL));
+}
+
+
+/*
+** TRACE_FREE - Free trace rules
+*/
+void
+trace_free(void)
+{
+    trace_free_rules(trace_rules);
+    trace_rules = NULL;
+}
+
+
+/*
+** TRACE_SENDER_MATCH - Check if sender matches the rule
+**
+** Rules beginning with '@' match the sender domain
+*/
+static int
+trace_sender_match(const struct traceRule *t, const char *from)
+{
+    size_t      len, rlen;
+
+    if (*from == '<') {
+        from++;
+    }
+    len = strlen(from);
+    if (len > 0 && from[len - 1] == '>') {
+        len--;
+    }
+    rlen = strlen(t->t_value);
+    if (t->t_value[0] == '@') {
+        return len >= rlen &&
+            strncasecmp(from + len - rlen, t->t_value, rlen) == 0;
+    }
+    return len == rlen && strncasecmp(from, t->t_value, rlen) == 0;
+}
+
+
+/*
+** TRACE_CONNECT - Get debug level of the connection
+**
+** trace_connect() matches client and daemon rules and returns the highest
+** debug level of matching rules or 0
+*/
+int
+trace_connect(const _SOCK_ADDR *hostaddr, const char *daemon_name)
+{
+    const struct traceRule *t;
+    int         level = 0;
+
+    if (trace_file == NULL) {
+        return 0;
+    }
+    (void) trace_load(time(NULL));
+
+    (void) pthread_rwlock_rdlock(&trace_lock);
+    for (t = trace_rules; t != NULL; t = t->t_next) {
+        if (t->t_level > level &&
+            ((t->t_type == TRACE_CLIENT && net_match(&t->t_net, hostaddr)) ||
+            (t->t_type == TRACE_DAEMON && daemon_name != NULL &&
+            strcmp(daemon_name, t->t_value) == 0)))
+        {
+            level = t->t_level;
+        }
+    }
+    (void) pthread_rwlock_unlock(&trace_lock);
+    return level;
+}
+
+
+/*
+** TRACE_MESSAGE - Get debug level of the message
+**
+** trace_message() matches sender and sample rules and returns the highest
+** debug level of matching rules or 0
+*/
+int
+trace_message(const char *from)
+{
+    const struct traceRule *t;
+    unsigned long count;
+    int         level = 0;
+
+    if (trace_file == NULL) {
+        return 0;
+    }
+    (void) trace_load(time(NULL));
+
+    count = __atomic_fetch_add(&trace_count, 1, __ATOMIC_RELAXED);
+    (void) pthread_rwlock_rdlock(&trace_lock);
+    for (t = trace_rules; t != NULL; t = t->t_next) {
+        if (t->t_level > level &&
+            ((t->t_type == TRACE_SENDER && trace_sender_match(t, from)) ||
+            (t->t_type == TRACE_SAMPLE && count % t->t_sample == 0)))
+        {
+            level = t->t_level;
+        }
+    }
+    (void) pthread_rwlock_unlock(&trace_lock);
+    return level;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2005, Petr Rehor <rx@rx.cz>. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "amavisd-milter.h"
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+
+/*
+** Worker processes
+**
+** The supervisor forks worker_count workers, which accept the milter
+** connections on the inherited milter socket.  A worker which crashed is
+** restarted, its amavisd connections and messages in progress are given
+** back first.  The signals received by the supervisor are passed to all
+** workers.  Worker 0 is also the only process when no workers are used.
+*/
+static int      worker_count;           /* number of workers */
+static int      worker_index;           /* worker of the process */
+static volatile pid_t worker_pids[WORKERS];/* running workers */
+static time_t   worker_started[WORKERS];/* last start of the workers */
+static volatile sig_atomic_t worker_stopping;/* supervisor is stopping */
+
+
+/*
+** WORKER_PARSE - Set number of worker processes
+**
+** worker_parse() returns -1 when the number is not valid
+*/
+int
+worker_parse(const char *spec)
+{
+    long        n;
+    char       *end;
+
+    n = strtol(spec, &end, 10);
+    if (end == spec || *end != '\0' || n < 0 || n > WORKERS) {
+        return -1;
+    }
+    worker_count = (int) n;
+    return 0;
+}
+
+
+/*
+** WORKER_ENABLED - Check if worker processes are used
+*/
+int
+worker_enabled(void)
+{
+    return worker_count > 0;
+}
+
+
+/*
+** WORKER_ID - Get worker of the process
+*/
+int
+worker_id(void)
+{
+    return worker_index;
+}
+
+
+/*
+** WORKER_ALLOC - Allocate memory shared by all workers
+**
+** The memory is mapped before the workers are forked, so that all of them
+** inherit it.  It is zero filled and it is never freed.
+*/
+void *
+worker_alloc(size_t size)
+{
+    void       *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1,
+        0);
+    if (p == MAP_FAILED) {
+        logmsg(LOG_ERR, "could not allocate shared memory: %s",
+            strerror(errno));
+        return NULL;
+    }
+    return p;
+}
+
+
+/*
+** WORKER_SIGNAL - Pass signal to workers and stop restarting them
+*/
+static void
+worker_signal(int sig)
+{
+    int         i;
+
+    worker_stopping = 1;
+    for (i = 0; i < worker_count; i++) {
+        if (worker_pids[i] > 0) {
+            (void) kill(worker_pids[i], sig);
+        }
+    }
+}
+
+
+/*
+** WORKER_FORK - Fork worker process
+**
+** worker_fork() returns 0 in the worker, 1 in the supervisor and -1 when
+** the worker could not be forked
+*/
+static int
+worker_fork(int i)
+{
+    sigset_t    set, oset;
+    pid_t       pid;
+
+    /* The worker must not pass signals to the other workers */
+    (void) sigemptyset(&set);
+    (void) sigaddset(&set, SIGTERM);
+    (void) sigaddset(&set, SIGINT);
+    (void) sigaddset(&set, SIGHUP);
+    (void) sigprocmask(SIG_BLOCK, &set, &oset);
+    (void) fflush(NULL);
+    worker_started[i] = time(NULL);
+    if ((pid = fork()) == -1) {
+        (void) sigprocmask(SIG_SETMASK, &oset, NULL);
+        logmsg(LOG_ERR, "could not fork worker %d: %s", i, strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        worker_index = i;
+        (void) signal(SIGTERM, SIG_DFL);
+        (void) signal(SIGINT, SIG_DFL);
+        (void) signal(SIGHUP, SIG_DFL);
+        (void) sigprocmask(SIG_SETMASK, &oset, NULL);
+        return 0;
+    }
+    worker_pids[i] = pid;
+    (void) sigprocmask(SIG_SETMASK, &oset, NULL);
+    logmsg(LOG_INFO, "started worker %d, pid %ld", i, (long) pid);
+    return 1;
+}
+
+
+/*
+** WORKER_START - Fork worker processes and supervise them
+**
+** worker_start() returns 0 in the worker processes.  In the supervisor, it
+** returns 1 after all workers have stopped, or -1 when the workers could
+** not be started or restarted.
+*/
+int
+worker_start(void)
+{
+    struct      sigaction sa;
+    struct      timespec ts;
+    pid_t       pid;
+    int         i, rc, status, running = 0, failed = 0;
+
+    /* Pass the stop signals to the workers */
+    (void) memset(&sa, '\0', sizeof(sa));
+    sa.sa_handler = worker_signal;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGINT, &sa, NULL);
+    (void) sigaction(SIGHUP, &sa, NULL);
+
+    for (i = 0; i < worker_count; i++) {
+        if ((rc = worker_fork(i)) != 1) {
+            if (rc == 0) {
+                return 0;
+            }
+            failed = 1;
+            worker_signal(SIGTERM);
+            break;
+        }
+        running++;
+    }
+
+    /* Restart the workers which exited */
+    while (running > 0) {
+        if ((pid = waitpid(-1, &status, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logmsg(LOG_ERR, "could not wait for workers: %s",
+                strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < worker_count && worker_pids[i] != pid; i++) {
+            continue;
+        }
+        if (i == worker_count) {
+            continue;
+        }
+        worker_pids[i] = 0;
+        running--;
+
+        /* Give back resources of the worker */
+        admit_reclaim(i);
+        stats_reclaim(i);
+        if (worker_stopping ||
+            (WIFEXITED(status) && WEXITSTATUS(status) == 0))
+        {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            logmsg(LOG_ERR, "worker %d, pid %ld killed by signal %d", i,
+                (long) pid, WTERMSIG(status));
+        } else {
+            logmsg(LOG_ERR, "worker %d, pid %ld exited with status %d", i,
+                (long) pid, WEXITSTATUS(status));
+        }
+
+        /* Do not restart a failing worker in a loop */
+        if (time(NULL) - worker_started[i] < WORKERRESTART) {
+            ts.tv_sec = WORKERRESTART;
+            ts.tv_nsec = 0;
+            (void) nanosleep(&ts, NULL);
+            if (worker_stopping) {
+                continue;
+            }
+        }
+        if ((rc = worker_fork(i)) == 0) {
+            return 0;
+        } else if (rc == 1) {
+            running++;
+        } else {
+            failed = 1;
+        }
+    }
+    return failed ? -1 : 1;
+}